@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+"""Runs the Lox benchmarks and compares them against a saved baseline.
+
+Each benchmark is run --runs times with "clox --stats"; the best wall time is
+kept, the counters come from the last run (they don't vary between runs of
+the same build). Build clox_bench (cmake --build <dir> --target bench) to get
+instruction counts, the plain clox target only reports the GC numbers.
+
+    run.py --clox build/clox_bench                    # run and compare
+    run.py --clox build/clox_bench --save             # record a new baseline
+    run.py --clox build/clox_bench --check fib zoo    # fail on regressions
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+STAT_KEYS = ("instructions", "gc_cycles", "gc_pause_total_ns",
+             "gc_pause_max_ns", "peak_bytes")
+# Extra clox flags for some benchmarks. heap_limit's live data is about 3 MB
+# with 16-byte values, it must finish under the limit.
+FLAGS = {"heap_limit": ["--gc-max-heap=6m"]}
+
+
+def run_one(clox, path, runs, flags):
+    best = None
+    stats = {}
+    for _ in range(runs):
+        start = time.perf_counter()
+        proc = subprocess.run([clox, "--stats"] + flags + [path],
+                              stdout=subprocess.PIPE,
+                              stderr=subprocess.PIPE, universal_newlines=True)
+        elapsed = time.perf_counter() - start
+        if proc.returncode != 0:
+            sys.stderr.write(proc.stderr)
+            raise SystemExit("%s exited with %d" % (path, proc.returncode))
+        best = elapsed if best is None else min(best, elapsed)
+
+        stats = {}
+        lines = proc.stderr.splitlines()
+        if "-- stats --" in lines:
+            for line in lines[lines.index("-- stats --") + 1:]:
+                key, _, value = line.partition(" ")
+                if key in STAT_KEYS:
+                    stats[key] = int(value)
+    stats["time"] = round(best, 4)
+    return stats
+
+
+def delta(now, before):
+    if before is None or before == 0 or now is None:
+        return ""
+    return "%+.1f%%" % (100.0 * (now - before) / before)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--clox", required=True, help="interpreter to run")
+    parser.add_argument("--baseline", default=os.path.join(HERE,
+                                                           "baseline.json"))
+    parser.add_argument("--runs", type=int, default=3)
+    parser.add_argument("--save", action="store_true",
+                        help="write the results as the new baseline")
+    parser.add_argument("--check", action="store_true",
+                        help="exit non-zero if a benchmark got slower than "
+                        "--threshold")
+    parser.add_argument("--threshold", type=float, default=10.0,
+                        help="allowed slowdown in percent (default 10)")
+    parser.add_argument("names", nargs="*",
+                        help="benchmarks to run (default: all)")
+    args = parser.parse_args()
+
+    names = args.names or sorted(f[:-4] for f in os.listdir(HERE)
+                                 if f.endswith(".lox"))
+    baseline = {}
+    if os.path.exists(args.baseline):
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+
+    print("%-14s %9s %8s %14s %8s %5s %10s %9s %10s" %
+          ("benchmark", "time(s)", "vs base", "instructions", "vs base",
+           "gcs", "pause(ms)", "max(ms)", "peak(KiB)"))
+    results = {}
+    regressions = []
+    for name in names:
+        stats = run_one(args.clox, os.path.join(HERE, name + ".lox"),
+                        args.runs, FLAGS.get(name, []))
+        results[name] = stats
+        base = baseline.get(name, {})
+        time_delta = delta(stats["time"], base.get("time"))
+        print("%-14s %9.3f %8s %14s %8s %5s %10.2f %9.2f %10d" %
+              (name, stats["time"], time_delta,
+               stats.get("instructions", "-"),
+               delta(stats.get("instructions"), base.get("instructions")),
+               stats.get("gc_cycles", "-"),
+               stats.get("gc_pause_total_ns", 0) / 1e6,
+               stats.get("gc_pause_max_ns", 0) / 1e6,
+               stats.get("peak_bytes", 0) // 1024))
+        if base.get("time") and \
+                stats["time"] > base["time"] * (1 + args.threshold / 100):
+            regressions.append(name)
+
+    if args.save:
+        baseline.update(results)
+        with open(args.baseline, "w") as f:
+            json.dump(baseline, f, indent=2, sort_keys=True)
+            f.write("\n")
+        print("baseline written to %s" % args.baseline)
+
+    if regressions:
+        print("slower than baseline by more than %g%%: %s" %
+              (args.threshold, ", ".join(regressions)))
+        if args.check:
+            return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+#include "chunk.h"
+#include "mapfile.h"
+#include "memory.h"
+#include "vm.h"
+
+/*
+ * Layout, all integers little endian:
+ *
+ *   "LOXC" version:u32 hash:u64 mtime:i64 size:u64 optimized:u8
+ *   checksum:u64
+ *   globalCount:u32 (name:string)*
+ *   function
+ *
+ * function: arity:u32 upvalueCount:u32 hasName:u8 [name:string]
+ *           codeCount:u32 code:u8* lineCount:u32 (offset:u32 line:u32)*
+ *           cacheCount:u32
+ *           constantCount:u32 (tag:u8 payload)*
+ * string:   length:u32 chars:u8*
+ *
+ * The checksum covers everything after the header. Global slots are baked
+ * into the code, so the names are stored in slot order and the loader only
+ * accepts the file if this VM hands out the same slots for them, which it
+ * does for a fresh VM running the same script.
+ */
+#define BYTECODE_MAGIC "LOXC"
+#define HEADER_SIZE (4 + 4 + 8 + 8 + 8 + 1 + 8)
+
+typedef enum {
+  CONSTANT_NIL,
+  CONSTANT_FALSE,
+  CONSTANT_TRUE,
+  CONSTANT_NUMBER,
+  CONSTANT_STRING,
+  CONSTANT_FUNCTION,
+} ConstantTag;
+
+// 64-bit FNV-1a. Cache keys have to match across builds, so this stays a
+// plain byte loop rather than the word-at-a-time string hash in object.c.
+uint64_t hashSource(const char *source, size_t length) {
+  uint64_t hash = 14695981039346656037u;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint8_t)source[i];
+    hash *= 1099511628211u;
+  }
+  return hash;
+}
+
+// The buffers here are plain malloc memory, nothing in them is seen by the GC.
+typedef struct {
+  uint8_t *bytes;
+  size_t count;
+  size_t capacity;
+} Writer;
+
+static void writeBytes(Writer *writer, const void *data, size_t length) {
+  if (writer->capacity < writer->count + length) {
+    while (writer->capacity < writer->count + length) {
+      writer->capacity = GROW_CAPACITY(writer->capacity);
+    }
+    writer->bytes = realloc(writer->bytes, writer->capacity);
+    if (writer->bytes == NULL) {
+      exit(1);
+    }
+  }
+  memcpy(writer->bytes + writer->count, data, length);
+  writer->count += length;
+}
+
+static void writeU8(Writer *writer, uint8_t value) {
+  writeBytes(writer, &value, 1);
+}
+
+static void writeU32(Writer *writer, uint32_t value) {
+  uint8_t bytes[4];
+  for (int i = 0; i < 4; i++) {
+    bytes[i] = (uint8_t)(value >> (8 * i));
+  }
+  writeBytes(writer, bytes, 4);
+}
+
+static void writeU64(Writer *writer, uint64_t value) {
+  uint8_t bytes[8];
+  for (int i = 0; i < 8; i++) {
+    bytes[i] = (uint8_t)(value >> (8 * i));
+  }
+  writeBytes(writer, bytes, 8);
+}
+
+static void writeString(Writer *writer, ObjString *string) {
+  writeU32(writer, (uint32_t)string->length);
+  writeBytes(writer, string->chars, string->length);
+}
+
+static void writeFunction(Writer *writer, ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  writeU32(writer, (uint32_t)function->arity);
+  writeU32(writer, (uint32_t)function->upvalueCount);
+  writeU8(writer, function->name != NULL);
+  if (function->name != NULL) {
+    writeString(writer, function->name);
+  }
+
+  writeU32(writer, (uint32_t)chunk->count);
+  writeBytes(writer, chunk->code, chunk->count);
+  writeU32(writer, (uint32_t)chunk->lineCount);
+  for (int i = 0; i < chunk->lineCount; i++) {
+    writeU32(writer, (uint32_t)chunk->lines[i].offset);
+    writeU32(writer, (uint32_t)chunk->lines[i].line);
+  }
+  writeU32(writer, (uint32_t)chunk->cacheCount);
+
+  writeU32(writer, (uint32_t)chunk->constants.count);
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value value = chunk->constants.values[i];
+    if (IS_NIL(value)) {
+      writeU8(writer, CONSTANT_NIL);
+    } else if (IS_BOOL(value)) {
+      writeU8(writer, AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE);
+    } else if (IS_NUMBER(value)) {
+      double number = AS_NUMBER(value);
+      uint64_t bits;
+      memcpy(&bits, &number, sizeof(bits));
+      writeU8(writer, CONSTANT_NUMBER);
+      writeU64(writer, bits);
+    } else if (IS_STRING(value)) {
+      writeU8(writer, CONSTANT_STRING);
+      writeString(writer, AS_STRING(value));
+    } else {
+      // The compiler only ever emits the constants above and functions.
+      writeU8(writer, CONSTANT_FUNCTION);
+      writeFunction(writer, AS_FUNCTION(value));
+    }
+  }
+}
+
+bool saveBytecode(const char *path, ObjFunction *function, SourceKey key) {
+  Writer body = {NULL, 0, 0};
+  writeU32(&body, (uint32_t)vm->globalNames.count);
+  for (int i = 0; i < vm->globalNames.count; i++) {
+    writeString(&body, AS_STRING(vm->globalNames.values[i]));
+  }
+  writeFunction(&body, function);
+
+  Writer header = {NULL, 0, 0};
+  writeBytes(&header, BYTECODE_MAGIC, 4);
+  writeU32(&header, BYTECODE_VERSION);
+  writeU64(&header, key.hash);
+  writeU64(&header, (uint64_t)key.mtime);
+  writeU64(&header, key.size);
+  writeU8(&header, key.optimized);
+  writeU64(&header, hashSource((const char *)body.bytes, body.count));
+
+  // Written next to the target and renamed over it, so a process starting
+  // at the same time never sees half a file.
+  size_t tempLength = strlen(path) + 32;
+  char *temp = malloc(tempLength);
+  if (temp == NULL) {
+    exit(1);
+  }
+  snprintf(temp, tempLength, "%s.%ld.tmp", path, (long)getpid());
+
+  bool saved = false;
+  FILE *file = fopen(temp, "wb");
+  if (file != NULL) {
+    saved = fwrite(header.bytes, 1, header.count, file) == header.count &&
+            fwrite(body.bytes, 1, body.count, file) == body.count;
+    saved = fclose(file) == 0 && saved;
+    saved = saved && rename(temp, path) == 0;
+    if (!saved) {
+      remove(temp);
+    }
+  }
+
+  free(temp);
+  free(header.bytes);
+  free(body.bytes);
+  return saved;
+}
+
+typedef struct {
+  const uint8_t *data;
+  size_t size;
+  size_t position;
+  bool error;
+} Reader;
+
+static bool canRead(Reader *reader, size_t length) {
+  if (reader->error || reader->size - reader->position < length) {
+    reader->error = true;
+    return false;
+  }
+  return true;
+}
+
+static uint8_t readU8(Reader *reader) {
+  if (!canRead(reader, 1)) {
+    return 0;
+  }
+  return reader->data[reader->position++];
+}
+
+static uint32_t readU32(Reader *reader) {
+  if (!canRead(reader, 4)) {
+    return 0;
+  }
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++) {
+    value |= (uint32_t)reader->data[reader->position++] << (8 * i);
+  }
+  return value;
+}
+
+static uint64_t readU64(Reader *reader) {
+  if (!canRead(reader, 8)) {
+    return 0;
+  }
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++) {
+    value |= (uint64_t)reader->data[reader->position++] << (8 * i);
+  }
+  return value;
+}
+
+static ObjString *readString(Reader *reader) {
+  uint32_t length = readU32(reader);
+  if (!canRead(reader, length)) {
+    return NULL;
+  }
+  const char *chars = (const char *)reader->data + reader->position;
+  reader->position += length;
+  return copyString(chars, (int)length);
+}
+
+/*
+ * Everything built here is kept on the VM stack until it is reachable from
+ * its parent, the loader allocates like the compiler does and the GC may run
+ * at any point. On malformed input the caller resets the stack and the
+ * partial objects are simply garbage.
+ */
+static ObjFunction *readFunction(Reader *reader, int depth) {
+  // Don't let a corrupted file recurse without bound
+  if (depth > UINT8_COUNT) {
+    reader->error = true;
+    return NULL;
+  }
+
+  ObjFunction *function = newFunction();
+  push(OBJ_VAL(function));
+  Chunk *chunk = &function->chunk;
+
+  function->arity = (int)readU32(reader);
+  function->upvalueCount = (int)readU32(reader);
+  if (function->arity > UINT8_MAX ||
+      function->upvalueCount > LONG_INDEX_MAX + 1) {
+    reader->error = true;
+  }
+  if (readU8(reader)) {
+    function->name = readString(reader);
+    writeBarrier(OBJ_VAL(function->name));
+  }
+
+  uint32_t count = readU32(reader);
+  if (!canRead(reader, count)) {
+    return NULL;
+  }
+  if (count > 0) {
+    chunk->code = GROW_ARRAY(uint8_t, NULL, 0, count);
+    chunk->capacity = (int)count;
+    memcpy(chunk->code, reader->data + reader->position, count);
+    reader->position += count;
+    chunk->count = (int)count;
+  }
+
+  // Runs start at 0, go up strictly and never run past the code, or a lookup
+  // could come back with the wrong line.
+  uint32_t lineCount = readU32(reader);
+  if (lineCount > count || (count > 0 && lineCount == 0)) {
+    reader->error = true;
+  }
+  if (!canRead(reader, (size_t)lineCount * 8)) {
+    return NULL;
+  }
+  if (lineCount > 0) {
+    chunk->lines = GROW_ARRAY(LineStart, NULL, 0, lineCount);
+    chunk->lineCapacity = (int)lineCount;
+    chunk->lineCount = (int)lineCount;
+    for (uint32_t i = 0; i < lineCount; i++) {
+      uint32_t offset = readU32(reader);
+      if (i == 0 ? offset != 0
+                 : offset <= (uint32_t)chunk->lines[i - 1].offset ||
+                       offset >= count) {
+        reader->error = true;
+      }
+      chunk->lines[i].offset = (int)offset;
+      chunk->lines[i].line = (int)readU32(reader);
+    }
+  }
+
+  uint32_t cacheCount = readU32(reader);
+  if (cacheCount > NO_INLINE_CACHE) {
+    reader->error = true;
+  }
+  for (uint32_t i = 0; i < cacheCount && !reader->error; i++) {
+    addInlineCache(chunk);
+  }
+
+  uint32_t constantCount = readU32(reader);
+  for (uint32_t i = 0; i < constantCount && !reader->error; i++) {
+    Value value = NIL_VAL;
+    switch (readU8(reader)) {
+    case CONSTANT_NIL:
+      break;
+    case CONSTANT_FALSE:
+      value = BOOL_VAL(false);
+      break;
+    case CONSTANT_TRUE:
+      value = BOOL_VAL(true);
+      break;
+    case CONSTANT_NUMBER: {
+      uint64_t bits = readU64(reader);
+      double number;
+      memcpy(&number, &bits, sizeof(number));
+      value = NUMBER_VAL(number);
+      break;
+    }
+    case CONSTANT_STRING: {
+      ObjString *string = readString(reader);
+      if (string == NULL) {
+        return NULL;
+      }
+      value = OBJ_VAL(string);
+      break;
+    }
+    case CONSTANT_FUNCTION: {
+      ObjFunction *nested = readFunction(reader, depth + 1);
+      if (nested == NULL) {
+        return NULL;
+      }
+      value = OBJ_VAL(nested);
+      break;
+    }
+    default:
+      reader->error = true;
+      return NULL;
+    }
+    addConstant(chunk, value);
+  }
+
+  if (reader->error) {
+    return NULL;
+  }
+  // Not stored, it's cheap to work out again and can't go stale this way.
+  function->maxStack = maxStackDepth(chunk, function->arity);
+  pop();
+  return function;
+}
+
+ObjFunction *loadBytecode(const uint8_t *data, size_t size, SourceKey key) {
+  Reader reader = {data, size, 0, false};
+  if (size < HEADER_SIZE || memcmp(data, BYTECODE_MAGIC, 4) != 0) {
+    return NULL;
+  }
+  reader.position = 4;
+  if (readU32(&reader) != BYTECODE_VERSION || readU64(&reader) != key.hash ||
+      (int64_t)readU64(&reader) != key.mtime || readU64(&reader) != key.size ||
+      readU8(&reader) != key.optimized) {
+    return NULL;
+  }
+  uint64_t checksum = readU64(&reader);
+  if (hashSource((const char *)data + HEADER_SIZE, size - HEADER_SIZE) !=
+      checksum) {
+    return NULL;
+  }
+
+  Value *stackTop = vm->stackTop;
+  uint32_t globalCount = readU32(&reader);
+  for (uint32_t i = 0; i < globalCount && !reader.error; i++) {
+    ObjString *name = readString(&reader);
+    if (name == NULL || globalSlot(name) != (int)i) {
+      return NULL;
+    }
+  }
+
+  ObjFunction *function = readFunction(&reader, 0);
+  if (function == NULL || reader.position != size) {
+    vm->stackTop = stackTop;
+    return NULL;
+  }
+  return function;
+}
+
+ObjFunction *loadBytecodeFile(const char *path, SourceKey key) {
+  MappedFile file;
+  if (!mapFile(path, &file)) {
+    return NULL;
+  }
+  ObjFunction *function =
+      loadBytecode((const uint8_t *)file.data, file.size, key);
+  unmapFile(&file);
+  return function;
+}
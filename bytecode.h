@@ -0,0 +1,35 @@
+#ifndef clox_bytecode_h
+#define clox_bytecode_h
+
+#include "common.h"
+#include "object.h"
+
+/*
+ * Serialized form of a compiled script, the .loxc cache. A file holds the
+ * whole ObjFunction tree of one script (code, lines, constants with nested
+ * functions and strings, arity, upvalue and inline cache counts) behind a
+ * header that ties it to the exact source it was compiled from.
+ *
+ * Bump BYTECODE_VERSION whenever the instruction set or its encoding
+ * changes, old files are then simply recompiled.
+ */
+#define BYTECODE_VERSION 8
+
+// Identifies the source a cache file was compiled from and how. A cache is
+// only used when all of these match.
+typedef struct {
+  uint64_t hash;
+  int64_t mtime;
+  uint64_t size;
+  bool optimized;
+} SourceKey;
+
+uint64_t hashSource(const char *source, size_t length);
+
+// Returns false if the file couldn't be written, a cache is never required.
+bool saveBytecode(const char *path, ObjFunction *function, SourceKey key);
+// Returns NULL if the data is missing, stale or malformed.
+ObjFunction *loadBytecode(const uint8_t *data, size_t size, SourceKey key);
+ObjFunction *loadBytecodeFile(const char *path, SourceKey key);
+
+#endif
@@ -8,35 +8,361 @@ void initChunk(Chunk *chunk) {
   chunk->count = 0;
   chunk->capacity = 0;
   chunk->code = NULL;
+  chunk->lineCount = 0;
+  chunk->lineCapacity = 0;
   chunk->lines = NULL;
+  chunk->cacheCount = 0;
+  chunk->cacheCapacity = 0;
+  chunk->caches = NULL;
   initValueArray(&chunk->constants);
 }
 
 void freeChunk(Chunk *chunk) {
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+  FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
   freeValueArray(&chunk->constants);
   initChunk(chunk);
 }
 
+// Starts a new run at offset unless the last one is already on that line.
+static void addLine(Chunk *chunk, int offset, int line) {
+  // Runs left over from code the compiler has since truncated
+  while (chunk->lineCount > 0 &&
+         chunk->lines[chunk->lineCount - 1].offset >= offset) {
+    chunk->lineCount--;
+  }
+  if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) {
+    return;
+  }
+
+  if (chunk->lineCapacity < chunk->lineCount + 1) {
+    int oldCapacity = chunk->lineCapacity;
+    chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->lines = GROW_ARRAY(LineStart, chunk->lines, oldCapacity,
+                              chunk->lineCapacity);
+  }
+
+  chunk->lines[chunk->lineCount].offset = offset;
+  chunk->lines[chunk->lineCount].line = line;
+  chunk->lineCount++;
+}
+
 void writeChunk(Chunk *chunk, uint8_t byte, int line) {
   if (chunk->capacity < chunk->count + 1) {
     int oldCapacity = chunk->capacity;
     chunk->capacity = GROW_CAPACITY(oldCapacity);
     chunk->code =
         GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-    chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
   }
 
   chunk->code[chunk->count] = byte;
-  chunk->lines[chunk->count] = line;
+  addLine(chunk, chunk->count, line);
   chunk->count++;
 }
 
+int getLine(Chunk *chunk, int offset) {
+  // Last run starting at or before offset
+  int low = 0;
+  int high = chunk->lineCount - 1;
+  while (low < high) {
+    int mid = low + (high - low + 1) / 2;
+    if (chunk->lines[mid].offset <= offset) {
+      low = mid;
+    } else {
+      high = mid - 1;
+    }
+  }
+  return chunk->lineCount > 0 ? chunk->lines[low].line : 0;
+}
+
+// Rebuilds the table from one line per byte of code, for passes that move
+// code around and find that easier to track byte by byte.
+void setLines(Chunk *chunk, const int *lines) {
+  chunk->lineCount = 0;
+  for (int offset = 0; offset < chunk->count; offset++) {
+    addLine(chunk, offset, lines[offset]);
+  }
+}
+
 int addConstant(Chunk *chunk, Value value) {
   push(value);
   writeValueArray(&chunk->constants, value);
+  writeBarrier(value);
   pop();
   // Return the index where constant was appended
   return chunk->constants.count - 1;
 }
+
+int addInlineCache(Chunk *chunk) {
+  if (chunk->cacheCount == NO_INLINE_CACHE) {
+    // The site still works, it just always takes the slow path.
+    return NO_INLINE_CACHE;
+  }
+
+  if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+    int oldCapacity = chunk->cacheCapacity;
+    chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity,
+                               chunk->cacheCapacity);
+  }
+
+  chunk->caches[chunk->cacheCount].count = 0;
+  return chunk->cacheCount++;
+}
+
+// Size in bytes of the instruction at offset, opcode included. Passes that
+// walk or rewrite code use this instead of decoding operands themselves.
+int instructionLength(Chunk *chunk, int offset) {
+  switch (chunk->code[offset]) {
+  case OP_CONSTANT:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_GET_SUPER:
+  case OP_CALL:
+  case OP_TAIL_CALL:
+  case OP_CLASS:
+  case OP_METHOD:
+  case OP_SET_LOCAL_POP:
+    return 2;
+  case OP_CONSTANT_LONG:
+  case OP_GET_LOCAL_LONG:
+  case OP_SET_LOCAL_LONG:
+  case OP_GET_UPVALUE_LONG:
+  case OP_SET_UPVALUE_LONG:
+  case OP_GET_SUPER_LONG:
+  case OP_CLASS_LONG:
+  case OP_METHOD_LONG:
+  case OP_BUILD_LIST:
+  case OP_BUILD_MAP:
+    return 4;
+  case OP_DEFINE_GLOBAL:
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_TRUE:
+  case OP_LOOP:
+  case OP_SUPER_INVOKE:
+  case OP_ADD_LOCALS:
+  case OP_ADD_LOCAL_CONSTANT:
+  case OP_SET_GLOBAL_POP:
+    return 3;
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+  case OP_GET_THIS_PROPERTY:
+    return 4;
+  case OP_INVOKE:
+  case OP_LESS_LOCAL_CONSTANT_JUMP:
+  case OP_SUPER_INVOKE_LONG:
+    return 5;
+  case OP_GET_PROPERTY_LONG:
+  case OP_SET_PROPERTY_LONG:
+  case OP_FOR_ITER:
+    return 6;
+  case OP_INVOKE_LONG:
+    return 7;
+  case OP_CLOSURE: {
+    ObjFunction *function =
+        AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+    return 2 + 2 * function->upvalueCount;
+  }
+  case OP_CLOSURE_LONG: {
+    int constant = (chunk->code[offset + 1] << 16) |
+                   (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+    return 4 + 4 * function->upvalueCount;
+  }
+  default:
+    return 1;
+  }
+}
+
+// Where in the instruction its 16-bit jump offset is, 0 if it doesn't jump.
+// Offsets count from the end of the instruction.
+int jumpOperand(uint8_t instruction) {
+  switch (instruction) {
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_TRUE:
+  case OP_LOOP:
+    return 1;
+  case OP_LESS_LOCAL_CONSTANT_JUMP:
+    return 3;
+  case OP_FOR_ITER:
+    return 4;
+  default:
+    return 0;
+  }
+}
+
+int jumpTarget(Chunk *chunk, int offset) {
+  int end = offset + instructionLength(chunk, offset);
+  int operand = offset + jumpOperand(chunk->code[offset]);
+  int jump = (chunk->code[operand] << 8) | chunk->code[operand + 1];
+  return chunk->code[offset] == OP_LOOP ? end - jump : end + jump;
+}
+
+static int longOperand(Chunk *chunk, int offset) {
+  return (chunk->code[offset] << 16) | (chunk->code[offset + 1] << 8) |
+         chunk->code[offset + 2];
+}
+
+// How many values the instruction at offset leaves on the stack minus how
+// many it takes off. Handlers that push temporaries beyond that are covered
+// by STACK_SLACK.
+static int stackEffect(Chunk *chunk, int offset) {
+  switch (chunk->code[offset]) {
+  case OP_CONSTANT:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_LOCAL:
+  case OP_GET_GLOBAL:
+  case OP_GET_UPVALUE:
+  case OP_CLOSURE:
+  case OP_CLASS:
+  case OP_CONSTANT_LONG:
+  case OP_GET_LOCAL_LONG:
+  case OP_GET_UPVALUE_LONG:
+  case OP_CLOSURE_LONG:
+  case OP_CLASS_LONG:
+  case OP_ADD_LOCALS:
+  case OP_ADD_LOCAL_CONSTANT:
+  case OP_LESS_LOCAL_CONSTANT_JUMP:
+  case OP_GET_THIS_PROPERTY:
+    return 1;
+  case OP_POP:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_PROPERTY:
+  case OP_GET_SUPER:
+  case OP_EQUAL:
+  case OP_NOT_EQUAL:
+  case OP_GREATER:
+  case OP_GREATER_EQUAL:
+  case OP_LESS:
+  case OP_LESS_EQUAL:
+  case OP_PRINT:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_ADD_NUMBER:
+  case OP_SUBTRACT_NUMBER:
+  case OP_MULTIPLY_NUMBER:
+  case OP_DIVIDE_NUMBER:
+  case OP_GREATER_NUMBER:
+  case OP_LESS_NUMBER:
+  case OP_GREATER_EQUAL_NUMBER:
+  case OP_LESS_EQUAL_NUMBER:
+  case OP_CLOSE_UPVALUE:
+  case OP_METHOD:
+  case OP_INHERIT:
+  case OP_RETURN:
+  case OP_SET_PROPERTY_LONG:
+  case OP_GET_SUPER_LONG:
+  case OP_METHOD_LONG:
+  case OP_SET_LOCAL_POP:
+  case OP_SET_GLOBAL_POP:
+  case OP_INDEX_GET:
+    return -1;
+  case OP_INDEX_SET:
+    return -2;
+  case OP_BUILD_LIST:
+    return 1 - longOperand(chunk, offset + 1);
+  case OP_BUILD_MAP:
+    return 1 - 2 * longOperand(chunk, offset + 1);
+  case OP_CALL:
+  case OP_TAIL_CALL:
+    return -chunk->code[offset + 1];
+  case OP_INVOKE:
+    return -chunk->code[offset + 2];
+  case OP_SUPER_INVOKE:
+    return -chunk->code[offset + 2] - 1;
+  case OP_INVOKE_LONG:
+    return -chunk->code[offset + 4];
+  case OP_SUPER_INVOKE_LONG:
+    return -chunk->code[offset + 4] - 1;
+  default:
+    return 0;
+  }
+}
+
+/*
+ * Fills depths with how deep the value stack is before each instruction,
+ * counting the callee and its arguments in the frame's first slots, and -1
+ * for code nothing reaches. Returns the deepest it gets while the function
+ * runs. The compiler keeps the depth at each instruction the same whichever
+ * way it's reached, so every instruction only needs visiting once.
+ */
+int stackDepths(Chunk *chunk, int arity, int *depths) {
+  for (int i = 0; i < chunk->count; i++) {
+    depths[i] = -1;
+  }
+  int max = arity + 1;
+  if (chunk->count == 0) {
+    return max;
+  }
+
+  int *work = malloc(sizeof(int) * chunk->count);
+  if (work == NULL) {
+    exit(1);
+  }
+
+  int workCount = 0;
+  depths[0] = max;
+  work[workCount++] = 0;
+  while (workCount > 0) {
+    int offset = work[--workCount];
+    int depth = depths[offset];
+    // Falls through the straight-line code, queueing jump targets as it goes.
+    while (offset < chunk->count) {
+      uint8_t instruction = chunk->code[offset];
+      depth += stackEffect(chunk, offset);
+      if (depth > max) {
+        max = depth;
+      }
+      if (instruction == OP_RETURN) {
+        break;
+      }
+
+      if (jumpOperand(instruction) != 0) {
+        int target = jumpTarget(chunk, offset);
+        if (target >= 0 && target < chunk->count && depths[target] == -1) {
+          depths[target] = depth;
+          work[workCount++] = target;
+        }
+        if (instruction == OP_JUMP || instruction == OP_LOOP) {
+          break;
+        }
+      }
+
+      offset += instructionLength(chunk, offset);
+      if (offset >= chunk->count || depths[offset] != -1) {
+        break;
+      }
+      depths[offset] = depth;
+    }
+  }
+
+  free(work);
+  return max;
+}
+
+// Deepest the value stack gets while the function runs. call() makes sure
+// there's room for this up front, so the handlers never have to check.
+int maxStackDepth(Chunk *chunk, int arity) {
+  if (chunk->count == 0) {
+    return arity + 1;
+  }
+
+  int *depths = malloc(sizeof(int) * chunk->count);
+  if (depths == NULL) {
+    exit(1);
+  }
+  int max = stackDepths(chunk, arity, depths);
+  free(depths);
+  return max;
+}
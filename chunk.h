@@ -28,6 +28,7 @@ typedef enum {
   OP_PRINT,
   OP_JUMP,
   OP_JUMP_IF_FALSE,
+  OP_JUMP_IF_TRUE,
   OP_LOOP,
   OP_CALL,
   OP_INVOKE,
@@ -42,19 +43,118 @@ typedef enum {
   OP_METHOD,
   OP_INHERIT,
   OP_RETURN,
+  OP_BUILD_LIST, // count:u24, the items are on the stack
+  OP_BUILD_MAP,  // count:u24, key/value pairs on the stack
+  OP_INDEX_GET,
+  OP_INDEX_SET,
+  OP_FOR_ITER, // slot:u24 jump:u16, the loop variable, see forInStatement()
+  OP_TAIL_CALL, // Like OP_CALL, for "return f(...)", always before OP_RETURN
+  OP_NOT_EQUAL,
+  OP_GREATER_EQUAL, // Both are "not the opposite", NaN is >= and <= anything.
+  OP_LESS_EQUAL,
+  // Wide forms of the instructions above with a 24-bit constant, slot or
+  // upvalue operand, for functions past 256 of them. The compiler only emits
+  // one when the index doesn't fit in a byte.
+  OP_CONSTANT_LONG,
+  OP_GET_LOCAL_LONG,
+  OP_SET_LOCAL_LONG,
+  OP_GET_UPVALUE_LONG,
+  OP_SET_UPVALUE_LONG,
+  OP_GET_PROPERTY_LONG,
+  OP_SET_PROPERTY_LONG,
+  OP_INVOKE_LONG,
+  OP_GET_SUPER_LONG,
+  OP_SUPER_INVOKE_LONG,
+  OP_CLASS_LONG,
+  OP_METHOD_LONG,
+  OP_CLOSURE_LONG, // Upvalue operands are isLocal:u8 index:u24 too.
+  // Superinstructions, written over common sequences by fuseInstructions()
+  // in optimizer.c. The compiler never emits them directly.
+  OP_ADD_LOCALS,               // GET_LOCAL a, GET_LOCAL b, ADD
+  OP_ADD_LOCAL_CONSTANT,       // GET_LOCAL a, CONSTANT k, ADD
+  OP_LESS_LOCAL_CONSTANT_JUMP, // GET_LOCAL a, CONSTANT k, LESS, JUMP_IF_FALSE
+  OP_GET_THIS_PROPERTY,        // GET_LOCAL 0, GET_PROPERTY
+  OP_SET_LOCAL_POP,            // SET_LOCAL a, POP
+  OP_SET_GLOBAL_POP,           // SET_GLOBAL a, POP
+  // Number-only forms run() quickens the arithmetic and comparison
+  // instructions into, in place, once they got two numbers. They turn back
+  // into the generic instruction when that stops being true.
+  OP_ADD_NUMBER,
+  OP_SUBTRACT_NUMBER,
+  OP_MULTIPLY_NUMBER,
+  OP_DIVIDE_NUMBER,
+  OP_GREATER_NUMBER,
+  OP_LESS_NUMBER,
+  OP_GREATER_EQUAL_NUMBER,
+  OP_LESS_EQUAL_NUMBER,
 } OpCode;
 
+// Largest operand of the _LONG instructions.
+#define LONG_INDEX_MAX ((1 << 24) - 1)
+
+// Number of receiver layouts a single property or invoke site remembers
+// before it starts evicting (round-robin) older ones.
+#define INLINE_CACHE_WAYS 4
+// Operand value meaning "this site has no cache", used once a chunk has run
+// out of 16-bit cache indexes.
+#define NO_INLINE_CACHE UINT16_MAX
+
+/*
+ * One remembered receiver layout for a property/invoke site, keyed on the
+ * receiver's shape. A shape belongs to a single class and fixes which fields
+ * exist and in which slots, so one pointer comparison is enough to know both
+ * where a field lives and that no field shadows a cached method.
+ *
+ * OP_SET_PROPERTY sites that add a field also remember the shape the
+ * instance moves to, so building objects in an initializer stays on the
+ * fast path too.
+ */
+typedef struct {
+  ObjShape *shape;
+  ObjShape *transition; // Shape after the store, NULL if it adds no field.
+  int fieldIndex;       // Slot of the field, -1 when this way caches a method.
+  Value method;
+} CacheEntry;
+
+typedef struct {
+  CacheEntry entries[INLINE_CACHE_WAYS];
+  int count;
+} InlineCache;
+
+/*
+ * Lines are stored run-length encoded: one entry for every byte whose line
+ * differs from the byte before it, in code order. Only error reporting and
+ * the tools read them, so a lookup can afford a binary search.
+ */
+typedef struct {
+  int offset; // First byte of the run
+  int line;
+} LineStart;
+
 typedef struct {
   int count;
   int capacity;
   uint8_t *code;
   ValueArray constants;
-  int *lines;
+  int lineCount;
+  int lineCapacity;
+  LineStart *lines;
+  int cacheCount;
+  int cacheCapacity;
+  InlineCache *caches;
 } Chunk;
 
 void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
+int getLine(Chunk *chunk, int offset);
+void setLines(Chunk *chunk, const int *lines);
 int addConstant(Chunk *chunk, Value value);
+int addInlineCache(Chunk *chunk);
+int instructionLength(Chunk *chunk, int offset);
+int jumpOperand(uint8_t instruction);
+int jumpTarget(Chunk *chunk, int offset);
+int stackDepths(Chunk *chunk, int arity, int *depths);
+int maxStackDepth(Chunk *chunk, int arity);
 
 #endif
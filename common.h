@@ -5,10 +5,19 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// CLOX_NO_DEBUG (the CLOX_DEBUG=OFF CMake option) strips all of the below,
+// which is what any timing run wants.
+#ifndef CLOX_NO_DEBUG
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
 #define DEBUG_STRESS_GC
 #define DEBUG_LOG_GC
+#endif
+
+// Build options from CMakeLists.txt
+#ifdef CLOX_NAN_BOXING
+#define NAN_BOXING
+#endif
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
@@ -7,8 +7,10 @@
 #include "compiler.h"
 #include "debug.h"
 #include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
 #include "value.h"
+#include "vm.h"
 
 typedef struct {
   Token current;
@@ -46,8 +48,9 @@ typedef struct {
 } Local;
 
 typedef struct {
-  uint8_t index;
+  int index;
   bool isLocal;
+  Token name; // Kept for the body of a lazy function, see deferBody().
 } Upvalue;
 
 typedef enum {
@@ -63,10 +66,26 @@ typedef struct Compiler {
   ObjFunction *function;
   FunctionType type;
 
-  Local locals[UINT8_COUNT];
+  // Both grow as needed, up to what the _LONG instructions can address.
+  Local *locals;
   int localCount;
-  Upvalue upvalues[UINT8_COUNT];
+  int localCapacity;
+  Upvalue *upvalues;
+  int upvalueCapacity;
   int scopeDepth;
+
+  // The literal the chunk currently ends with, for constant folding. It's at
+  // constantStart and only still the tail while constantEnd is the count.
+  int constantStart;
+  int constantEnd;
+  Value constantValue;
+  // Highest offset a forward jump has been patched to land on. Code at or
+  // after it is reached from more than one place and mustn't be folded away.
+  int lastJumpTarget;
+  // Offset of the last OP_CALL emitted, for spotting calls in tail position.
+  int lastCall;
+  // The body being compiled by compileFunction(), NULL otherwise.
+  LazyBody *lazy;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -74,9 +93,10 @@ typedef struct ClassCompiler {
   bool hasSuperclass;
 } ClassCompiler;
 
-Parser parser;
-Compiler *current = NULL;
-ClassCompiler *currentClass = NULL;
+// Per thread, so VMs on different threads can compile at the same time.
+_Thread_local Parser parser;
+_Thread_local Compiler *current = NULL;
+_Thread_local ClassCompiler *currentClass = NULL;
 static Chunk *currentChunk() { return &current->function->chunk; }
 
 // Error Handling Helpers
@@ -155,7 +175,7 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
   emitByte(byte2);
 }
 
-static void emitLoop(uint8_t loopStart) {
+static void emitLoop(int loopStart) {
   emitByte(OP_LOOP);
   int offset = currentChunk()->count - loopStart + 2;
   if (offset > UINT16_MAX) {
@@ -184,19 +204,50 @@ static void emitReturn() {
   emitByte(OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value) {
+static void emitLong(int value) {
+  emitByte((value >> 16) & 0xff);
+  emitByte((value >> 8) & 0xff);
+  emitByte(value & 0xff);
+}
+
+// Emits the one-byte form when the index fits and the _LONG one otherwise,
+// so code that stays under 256 of anything looks exactly as it used to.
+static void emitIndexed(uint8_t instruction, uint8_t longInstruction,
+                        int index) {
+  if (index <= UINT8_MAX) {
+    emitBytes(instruction, (uint8_t)index);
+  } else {
+    emitByte(longInstruction);
+    emitLong(index);
+  }
+}
+
+static int makeConstant(Value value) {
   // addConstant returns Index in the constant table
   int constant = addConstant(currentChunk(), value);
-  if (constant > UINT8_MAX) {
+  if (constant > LONG_INDEX_MAX) {
     error("Too many constants in one Chunk.");
     return 0;
   }
 
-  return (uint8_t)constant;
+  return constant;
+}
+
+static void noteConstant(int start, Value value) {
+  current->constantStart = start;
+  current->constantEnd = currentChunk()->count;
+  current->constantValue = value;
 }
 
 static void emitConstant(Value value) {
-  emitBytes(OP_CONSTANT, makeConstant(value));
+  int start = currentChunk()->count;
+  emitIndexed(OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(value));
+  noteConstant(start, value);
+}
+
+static void emitInlineCache() {
+  int cache = addInlineCache(currentChunk());
+  emitBytes((cache >> 8) & 0xff, cache & 0xff);
 }
 
 static void patchJump(int offset) {
@@ -211,26 +262,42 @@ static void patchJump(int offset) {
   currentChunk()->code[offset] =
       (jump >> 8) & 0xFF;                         // shift 8 bits to get --> MSB
   currentChunk()->code[offset + 1] = jump & 0xFF; // mask to get --> LSB
+  current->lastJumpTarget = currentChunk()->count;
 }
 
-static void initCompiler(Compiler *compiler, FunctionType type) {
+static Local *newLocal() {
+  if (current->localCapacity < current->localCount + 1) {
+    int oldCapacity = current->localCapacity;
+    current->localCapacity = GROW_CAPACITY(oldCapacity);
+    current->locals = GROW_ARRAY(Local, current->locals, oldCapacity,
+                                 current->localCapacity);
+  }
+  return &current->locals[current->localCount++];
+}
+
+// Makes compiler the current one, the caller fills in its function.
+static void startCompiler(Compiler *compiler, FunctionType type) {
   compiler->enclosing = current;
   compiler->function = NULL;
   compiler->type = type;
 
+  compiler->locals = NULL;
   compiler->localCount = 0;
+  compiler->localCapacity = 0;
+  compiler->upvalues = NULL;
+  compiler->upvalueCapacity = 0;
   compiler->scopeDepth = 0;
-  compiler->function = newFunction();
+  compiler->constantStart = -1;
+  compiler->constantEnd = -1;
+  compiler->constantValue = NIL_VAL;
+  compiler->lastJumpTarget = 0;
+  compiler->lastCall = -1;
+  compiler->lazy = NULL;
   current = compiler;
 
-  if (type != TYPE_SCRIPT) {
-    current->function->name =
-        copyString(parser.previous.start, parser.previous.length);
-  }
-
   // While lexical scoping, we keep first slot reserved for function
   // name.
-  Local *local = &current->locals[current->localCount++];
+  Local *local = newLocal();
   local->depth = 0;
   local->isCaptured = false;
   if (type != TYPE_FUNCTION) {
@@ -242,9 +309,27 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
   }
 }
 
+static void initCompiler(Compiler *compiler, FunctionType type) {
+  startCompiler(compiler, type);
+  compiler->function = newFunction();
+
+  if (type != TYPE_SCRIPT) {
+    current->function->name =
+        copyString(parser.previous.start, parser.previous.length);
+    writeBarrier(OBJ_VAL(current->function->name));
+  }
+}
+
 static ObjFunction *endCompiler() {
   emitReturn();
   ObjFunction *function = current->function;
+  if (!parser.hadError) {
+    if (vm->optimizeCode) {
+      optimizeChunk(currentChunk());
+    }
+    fuseInstructions(currentChunk());
+  }
+  function->maxStack = maxStackDepth(currentChunk(), function->arity);
 #ifdef DEBUG_PRINT_CODE
   if (!parser.hadError) {
     disassembleChunk(currentChunk(), function->name != NULL
@@ -257,6 +342,13 @@ static ObjFunction *endCompiler() {
   return function;
 }
 
+// Separate from endCompiler(), the enclosing function still needs the
+// upvalues for the OP_CLOSURE operands.
+static void freeCompiler(Compiler *compiler) {
+  FREE_ARRAY(Local, compiler->locals, compiler->localCapacity);
+  FREE_ARRAY(Upvalue, compiler->upvalues, compiler->upvalueCapacity);
+}
+
 static void beginScope() { current->scopeDepth++; }
 
 static void endScope() {
@@ -280,10 +372,27 @@ static void declaration();
 static ParseRule *getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
 
-static uint8_t identifierConstant(Token *name) {
+static int identifierConstant(Token *name) {
   return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
+// Globals don't go through the constant table, the name is resolved to a
+// VM-wide slot right here so the runtime only has to index an array.
+static uint16_t globalVariable(Token *name) {
+  int slot = globalSlot(copyString(name->start, name->length));
+  if (slot > UINT16_MAX) {
+    error("Too many global variables.");
+    return 0;
+  }
+  return (uint16_t)slot;
+}
+
+static void emitGlobal(uint8_t instruction, uint16_t slot) {
+  emitByte(instruction);
+  emitByte((slot >> 8) & 0xff);
+  emitByte(slot & 0xff);
+}
+
 static bool identifiersEqual(Token *a, Token *b) {
   if (a->length != b->length) {
     return false;
@@ -306,7 +415,8 @@ static int resolveLocal(Compiler *compiler, Token *name) {
   return -1;
 }
 
-static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Compiler *compiler, int index, bool isLocal,
+                      Token *name) {
   int upvalueCount = compiler->function->upvalueCount;
 
   for (int i = 0; i < upvalueCount; i++) {
@@ -316,43 +426,60 @@ static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal) {
     }
   }
 
-  if (upvalueCount == UINT8_COUNT) {
+  if (upvalueCount > LONG_INDEX_MAX) {
     error("Too many closure variables in function.");
     return 0;
   }
 
+  if (compiler->upvalueCapacity < upvalueCount + 1) {
+    int oldCapacity = compiler->upvalueCapacity;
+    compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+    compiler->upvalues = GROW_ARRAY(Upvalue, compiler->upvalues, oldCapacity,
+                                    compiler->upvalueCapacity);
+  }
   compiler->upvalues[upvalueCount].isLocal = isLocal;
   compiler->upvalues[upvalueCount].index = index;
+  compiler->upvalues[upvalueCount].name = *name;
   return compiler->function->upvalueCount++;
 }
 
 static int resolveUpvalue(Compiler *compiler, Token *name) {
   if (compiler->enclosing == NULL) {
-    // global
+    // A lazy body's enclosing functions are gone, what they would have
+    // resolved to is in the upvalues worked out for it. Otherwise, global.
+    if (compiler->lazy != NULL) {
+      for (int i = 0; i < compiler->function->upvalueCount; i++) {
+        ObjString *upvalue = compiler->lazy->upvalueNames[i];
+        if (upvalue->length == name->length &&
+            memcmp(upvalue->chars, name->start, name->length) == 0) {
+          return i;
+        }
+      }
+    }
     return -1;
   }
 
   int local = resolveLocal(compiler->enclosing, name);
   if (local != -1) {
     compiler->enclosing->locals[local].isCaptured = true;
-    return addUpvalue(compiler, (uint8_t)local, true);
+    return addUpvalue(compiler, local, true, name);
   }
 
   int upvalue = resolveUpvalue(compiler->enclosing, name);
   if (upvalue != -1) {
-    return addUpvalue(compiler, (uint8_t)upvalue, false);
+    return addUpvalue(compiler, upvalue, false, name);
   }
 
   return -1;
 }
 
 static void addLocal(Token name) {
-  if (current->localCount == UINT8_COUNT) {
+  if (current->localCount > LONG_INDEX_MAX) {
     error("Too many local variables in function.");
     return;
   }
 
-  Local *local = &current->locals[current->localCount++];
+  Local *local = newLocal();
   local->name = name;
   local->depth = -1;
   local->isCaptured = false;
@@ -377,21 +504,19 @@ static void declareVariable() {
   addLocal(*name);
 }
 
-static uint8_t parseVariable(const char *errorMessage) {
+static uint16_t parseVariable(const char *errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
 
   declareVariable();
   // For local variables, we use stack instead of resolving it
-  // during the runtime. Hence, we don't want to add variable
-  // lexeme to the constant table, and then to global table during
-  // runtime. We just return a dummy index 0.
+  // during the runtime. Hence, we don't want to reserve a global
+  // slot for the variable. We just return a dummy index 0.
   if (current->scopeDepth > 0) {
     return 0;
   }
 
-  // Store the "identifier" in the constant table and return index
-  // Identifier is big to store directly as a operand in byte code.
-  return identifierConstant(&parser.previous);
+  // Resolve the "identifier" to its global slot and return the index
+  return globalVariable(&parser.previous);
 }
 
 static void markInitialized() {
@@ -402,7 +527,7 @@ static void markInitialized() {
   current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(uint16_t global) {
   if (current->scopeDepth > 0) {
     // The value we want will be right where we want on the stack,
     // since the expression() has already been evaluated and the value
@@ -411,7 +536,7 @@ static void defineVariable(uint8_t global) {
     markInitialized();
     return;
   }
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitGlobal(OP_DEFINE_GLOBAL, global);
 }
 
 static uint8_t argumentList() {
@@ -460,27 +585,42 @@ static void string(bool canAssign) {
 }
 
 static void namedVariable(Token name, bool canAssign) {
-  uint8_t getOp, setOp;
+  uint8_t getOp, setOp, getLongOp, setLongOp;
+  bool global = false;
   int arg = resolveLocal(current, &name);
   if (arg != -1) {
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
+    getLongOp = OP_GET_LOCAL_LONG;
+    setLongOp = OP_SET_LOCAL_LONG;
   } else if ((arg = resolveUpvalue(current, &name)) != -1) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
+    getLongOp = OP_GET_UPVALUE_LONG;
+    setLongOp = OP_SET_UPVALUE_LONG;
   } else {
-    arg = identifierConstant(&name);
+    arg = globalVariable(&name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
+    getLongOp = setLongOp = 0;
+    global = true;
   }
   if (canAssign && match(TOKEN_EQUAL)) {
     // var a = 10;
     // a = ...
     expression();
-    emitBytes(setOp, (uint8_t)arg);
+    if (global) {
+      emitGlobal(setOp, (uint16_t)arg);
+    } else {
+      emitIndexed(setOp, setLongOp, arg);
+    }
   } else {
     // ... = a;
-    emitBytes(getOp, (uint8_t)arg);
+    if (global) {
+      emitGlobal(getOp, (uint16_t)arg);
+    } else {
+      emitIndexed(getOp, getLongOp, arg);
+    }
   }
 }
 
@@ -504,18 +644,18 @@ static void super_(bool canAssign) {
 
   consume(TOKEN_DOT, "Expect '.' after super keyword");
   consume(TOKEN_IDENTIFIER, "Expect superclass method name after 'super.'.");
-  uint8_t name = identifierConstant(&parser.previous);
+  int name = identifierConstant(&parser.previous);
 
   namedVariable(syntheticToken("this"), false);
 
   if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
     namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_SUPER_INVOKE, name);
+    emitIndexed(OP_SUPER_INVOKE, OP_SUPER_INVOKE_LONG, name);
     emitByte(argCount);
   } else {
     namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_GET_SUPER, name);
+    emitIndexed(OP_GET_SUPER, OP_GET_SUPER_LONG, name);
   }
 }
 
@@ -532,14 +672,139 @@ static void grouping(bool canAssign) {
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
+// Where the literal the chunk ends with starts, or -1 if it doesn't end with
+// one or -O is off. *value is nil in that case.
+static int tailConstant(Value *value) {
+  if (!vm->optimizeCode || current->constantEnd != currentChunk()->count) {
+    *value = NIL_VAL;
+    return -1;
+  }
+  *value = current->constantValue;
+  return current->constantStart;
+}
+
+// Drops the literals from start on, and their constants if they were the
+// last ones added, so folding doesn't fill up the constant table.
+static void discardCode(int start) {
+  Chunk *chunk = currentChunk();
+  int constants[2];
+  int constantCount = 0;
+  for (int offset = start; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (constantCount == 2) {
+      break;
+    }
+    if (chunk->code[offset] == OP_CONSTANT) {
+      constants[constantCount++] = chunk->code[offset + 1];
+    } else if (chunk->code[offset] == OP_CONSTANT_LONG) {
+      constants[constantCount++] = (chunk->code[offset + 1] << 16) |
+                                   (chunk->code[offset + 2] << 8) |
+                                   chunk->code[offset + 3];
+    }
+  }
+  for (int i = constantCount - 1; i >= 0; i--) {
+    if (constants[i] == chunk->constants.count - 1) {
+      chunk->constants.count--;
+    }
+  }
+  chunk->count = start;
+}
+
+static void emitFolded(int start, Value value) {
+  discardCode(start);
+  if (IS_BOOL(value)) {
+    emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    noteConstant(start, value);
+  } else {
+    emitConstant(value);
+  }
+}
+
+// Evaluates a binary operator on two literals the way run() would. Returns
+// false for anything that would be a runtime error, that's left to run().
+static bool foldBinary(TokenType operatorType, Value a, Value b,
+                       Value *result) {
+  switch (operatorType) {
+  case TOKEN_EQUAL_EQUAL:
+    *result = BOOL_VAL(valuesEqual(a, b));
+    return true;
+  case TOKEN_BANG_EQUAL:
+    *result = BOOL_VAL(!valuesEqual(a, b));
+    return true;
+  default:
+    break;
+  }
+
+  if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+    ObjString *left = AS_STRING(a);
+    ObjString *right = AS_STRING(b);
+    int length = left->length + right->length;
+    ObjString *string = newString(length);
+    memcpy(string->chars, left->chars, left->length);
+    memcpy(string->chars + left->length, right->chars, right->length);
+    string->chars[length] = '\0';
+    *result = OBJ_VAL(internString(string));
+    return true;
+  }
+
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+    return false;
+  }
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+  switch (operatorType) {
+  case TOKEN_PLUS:
+    *result = NUMBER_VAL(x + y);
+    return true;
+  case TOKEN_MINUS:
+    *result = NUMBER_VAL(x - y);
+    return true;
+  case TOKEN_STAR:
+    *result = NUMBER_VAL(x * y);
+    return true;
+  case TOKEN_SLASH:
+    *result = NUMBER_VAL(x / y);
+    return true;
+  // OP_GREATER_EQUAL and OP_LESS_EQUAL are the negated opposite, fold them
+  // the same way so NaN compares the same as at runtime.
+  case TOKEN_GREATER:
+    *result = BOOL_VAL(x > y);
+    return true;
+  case TOKEN_GREATER_EQUAL:
+    *result = BOOL_VAL(!(x < y));
+    return true;
+  case TOKEN_LESS:
+    *result = BOOL_VAL(x < y);
+    return true;
+  case TOKEN_LESS_EQUAL:
+    *result = BOOL_VAL(!(x > y));
+    return true;
+  default:
+    return false;
+  }
+}
+
 static void binary(bool canAssign) {
   TokenType operatorType = parser.previous.type;
   ParseRule *rule = getRule(operatorType);
+  Value left;
+  int leftStart = tailConstant(&left);
+  int leftEnd = currentChunk()->count;
   parsePrecedence((Precedence)(rule->precedence + 1));
 
+  // Both operands are literals and nothing jumps into the middle of them
+  Value right;
+  Value folded;
+  if (leftStart != -1 && tailConstant(&right) == leftEnd &&
+      current->lastJumpTarget <= leftStart &&
+      foldBinary(operatorType, left, right, &folded)) {
+    emitFolded(leftStart, folded);
+    return;
+  }
+
   switch (operatorType) {
   case TOKEN_BANG_EQUAL:
-    emitBytes(OP_EQUAL, OP_NOT);
+    emitByte(OP_NOT_EQUAL);
     break;
   case TOKEN_EQUAL_EQUAL:
     emitByte(OP_EQUAL);
@@ -548,13 +813,13 @@ static void binary(bool canAssign) {
     emitByte(OP_GREATER);
     break;
   case TOKEN_GREATER_EQUAL:
-    emitBytes(OP_LESS, OP_NOT);
+    emitByte(OP_GREATER_EQUAL);
     break;
   case TOKEN_LESS:
     emitByte(OP_LESS);
     break;
   case TOKEN_LESS_EQUAL:
-    emitBytes(OP_GREATER, OP_NOT);
+    emitByte(OP_LESS_EQUAL);
     break;
   case TOKEN_PLUS:
     emitByte(OP_ADD);
@@ -575,34 +840,91 @@ static void binary(bool canAssign) {
 
 static void call(bool canAssign) {
   uint8_t argCount = argumentList();
+  current->lastCall = currentChunk()->count;
   emitBytes(OP_CALL, argCount);
 }
 
 static void dot(bool canAssign) {
   consume(TOKEN_IDENTIFIER, "Expect property name after '.'");
-  uint8_t name = identifierConstant(&parser.previous);
+  int name = identifierConstant(&parser.previous);
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(OP_SET_PROPERTY, name);
+    emitIndexed(OP_SET_PROPERTY, OP_SET_PROPERTY_LONG, name);
   } else if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
-    emitBytes(OP_INVOKE, name);
+    emitIndexed(OP_INVOKE, OP_INVOKE_LONG, name);
     emitByte(argCount);
   } else {
-    emitBytes(OP_GET_PROPERTY, name);
+    emitIndexed(OP_GET_PROPERTY, OP_GET_PROPERTY_LONG, name);
+  }
+  // Every property site gets its own inline cache slot in the chunk.
+  emitInlineCache();
+}
+
+// a[i] and a[i] = value, on lists, maps and (reading only) strings.
+static void subscript(bool canAssign) {
+  expression();
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+  if (canAssign && match(TOKEN_EQUAL)) {
+    expression();
+    emitByte(OP_INDEX_SET);
+  } else {
+    emitByte(OP_INDEX_GET);
   }
 }
 
+// [a, b, c], a trailing comma is fine.
+static void listLiteral(bool canAssign) {
+  int count = 0;
+  while (!check(TOKEN_RIGHT_BRACKET) && !check(TOKEN_EOF)) {
+    expression();
+    if (count == LONG_INDEX_MAX) {
+      error("Too many items in a list literal.");
+    }
+    count++;
+    if (!match(TOKEN_COMMA)) {
+      break;
+    }
+  }
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list items.");
+  emitByte(OP_BUILD_LIST);
+  emitLong(count);
+}
+
+// {key: value, ...}. A '{' starting a statement is still a block.
+static void mapLiteral(bool canAssign) {
+  int count = 0;
+  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+    expression();
+    consume(TOKEN_COLON, "Expect ':' after map key.");
+    expression();
+    if (count == LONG_INDEX_MAX) {
+      error("Too many entries in a map literal.");
+    }
+    count++;
+    if (!match(TOKEN_COMMA)) {
+      break;
+    }
+  }
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+  emitByte(OP_BUILD_MAP);
+  emitLong(count);
+}
+
 static void literal(bool canAssign) {
+  int start = currentChunk()->count;
   switch (parser.previous.type) {
   case TOKEN_FALSE:
     emitByte(OP_FALSE);
+    noteConstant(start, BOOL_VAL(false));
     break;
   case TOKEN_TRUE:
     emitByte(OP_TRUE);
+    noteConstant(start, BOOL_VAL(true));
     break;
   case TOKEN_NIL:
     emitByte(OP_NIL);
+    noteConstant(start, NIL_VAL);
     break;
   default:
     return;
@@ -615,6 +937,20 @@ static void unary(bool canAssign) {
   // compile the operand.
   parsePrecedence(PREC_UNARY);
 
+  Value operand;
+  int start = tailConstant(&operand);
+  if (start != -1 && current->lastJumpTarget <= start) {
+    if (operatorType == TOKEN_BANG) {
+      bool falsey = IS_NIL(operand) || (IS_BOOL(operand) && !AS_BOOL(operand));
+      emitFolded(start, BOOL_VAL(falsey));
+      return;
+    }
+    if (operatorType == TOKEN_MINUS && IS_NUMBER(operand)) {
+      emitFolded(start, NUMBER_VAL(-AS_NUMBER(operand)));
+      return;
+    }
+  }
+
   // Emit the Instruction
   switch (operatorType) {
   case TOKEN_BANG:
@@ -631,8 +967,11 @@ static void unary(bool canAssign) {
 ParseRule rules[] = {
     [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
     [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACE] = {mapLiteral, NULL, PREC_NONE},
     [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACKET] = {listLiteral, subscript, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET] = {NULL, NULL, PREC_NONE},
+    [TOKEN_COLON] = {NULL, NULL, PREC_NONE},
     [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
     [TOKEN_DOT] = {NULL, dot, PREC_CALL},
     [TOKEN_MINUS] = {unary, binary, PREC_TERM},
@@ -707,11 +1046,8 @@ static void block() {
   consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type) {
-  Compiler compiler;
-  initCompiler(&compiler, type);
-  beginScope();
-
+// The parameter list and the "{" of the body.
+static void parameters() {
   consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
   if (!check(TOKEN_RIGHT_PAREN)) {
     do {
@@ -727,19 +1063,124 @@ static void function(FunctionType type) {
   }
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
   consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-  block();
+}
 
-  ObjFunction *function = endCompiler();
-  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+/*
+ * Lazy mode: skips the body instead of compiling it and keeps its source
+ * for compileFunction(). The enclosing function's OP_CLOSURE still needs the
+ * upvalues now, so every name in the body that could be a variable gets
+ * resolved like one. A name the body only declares itself may capture an
+ * outer variable it didn't need; that costs a slot in the closure but is
+ * never wrong, the body resolves its own locals first.
+ */
+static void deferVariable(Token name) {
+  if (resolveLocal(current, &name) == -1) {
+    resolveUpvalue(current, &name);
+  }
+}
+
+static ObjFunction *deferBody(const char *start, int line) {
+  TokenType before = TOKEN_LEFT_BRACE;
+  int depth = 1;
+  while (depth > 0 && !check(TOKEN_EOF)) {
+    advance();
+    TokenType type = parser.previous.type;
+    if (type == TOKEN_LEFT_BRACE) {
+      depth++;
+    } else if (type == TOKEN_RIGHT_BRACE) {
+      depth--;
+    } else if (type == TOKEN_IDENTIFIER && before != TOKEN_DOT &&
+               before != TOKEN_VAR && before != TOKEN_FUN &&
+               before != TOKEN_CLASS) {
+      deferVariable(parser.previous);
+    } else if ((type == TOKEN_THIS || type == TOKEN_SUPER) &&
+               currentClass != NULL) {
+      // super_() reads "this" as well.
+      deferVariable(syntheticToken("this"));
+      if (type == TOKEN_SUPER) {
+        deferVariable(syntheticToken("super"));
+      }
+    }
+    before = type;
+  }
+  if (depth > 0) {
+    errorAtCurrent("Expect '}' after block.");
+  }
+
+  ObjFunction *function = current->function;
+  int length = (int)(parser.previous.start + parser.previous.length - start);
+  char *source = ALLOCATE(char, length + 1);
+  memcpy(source, start, length);
+  source[length] = '\0';
+  int upvalueCount = function->upvalueCount;
+  ObjString **names = ALLOCATE(ObjString *, upvalueCount);
+  for (int i = 0; i < upvalueCount; i++) {
+    names[i] = NULL;
+  }
+
+  LazyBody *lazy = ALLOCATE(LazyBody, 1);
+  lazy->source = source;
+  lazy->length = length;
+  lazy->line = line;
+  lazy->type = (uint8_t)current->type;
+  lazy->inClass = currentClass != NULL;
+  lazy->hasSuperclass = currentClass != NULL && currentClass->hasSuperclass;
+  lazy->upvalueNames = names;
+  function->lazy = lazy;
+  // The names are allocated last, the GC marks them through the function.
+  for (int i = 0; i < upvalueCount; i++) {
+    Token *name = &current->upvalues[i].name;
+    names[i] = copyString(name->start, name->length);
+    writeBarrier(OBJ_VAL(names[i]));
+  }
+
+  current = current->enclosing;
+  return function;
+}
+
+static void function(FunctionType type) {
+  Compiler compiler;
+  initCompiler(&compiler, type);
+  beginScope();
+
+  const char *start = parser.current.start;
+  int line = parser.current.line;
+  parameters();
+
+  ObjFunction *function;
+  if (vm->lazyCompile) {
+    function = deferBody(start, line);
+  } else {
+    block();
+    function = endCompiler();
+  }
+  int constant = makeConstant(OBJ_VAL(function));
+  // One upvalue index past a byte makes the whole instruction wide.
+  bool wide = constant > UINT8_MAX;
+  for (int i = 0; i < function->upvalueCount; i++) {
+    wide = wide || compiler.upvalues[i].index > UINT8_MAX;
+  }
+
+  if (wide) {
+    emitByte(OP_CLOSURE_LONG);
+    emitLong(constant);
+  } else {
+    emitBytes(OP_CLOSURE, (uint8_t)constant);
+  }
   for (int i = 0; i < function->upvalueCount; i++) {
     emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-    emitByte(compiler.upvalues[i].index);
+    if (wide) {
+      emitLong(compiler.upvalues[i].index);
+    } else {
+      emitByte((uint8_t)compiler.upvalues[i].index);
+    }
   }
+  freeCompiler(&compiler);
 }
 
 static void method() {
   consume(TOKEN_IDENTIFIER, "Expect method name.");
-  uint8_t constant = identifierConstant(&parser.previous);
+  int constant = identifierConstant(&parser.previous);
 
   FunctionType type = TYPE_METHOD;
 
@@ -749,7 +1190,7 @@ static void method() {
   }
   function(type);
 
-  emitBytes(OP_METHOD, constant);
+  emitIndexed(OP_METHOD, OP_METHOD_LONG, constant);
 }
 
 static void classDeclaration() {
@@ -762,7 +1203,7 @@ static void classDeclaration() {
    */
   Token className = parser.previous;
 
-  uint8_t nameConstant = identifierConstant(&parser.previous);
+  int nameConstant = identifierConstant(&parser.previous);
   // If local, adds to local stack, but still unusable as its not mark
   // initialized. For global case, we just return as a variable, as it will be
   // added in global table
@@ -774,13 +1215,13 @@ static void classDeclaration() {
    * OP_CLASS
    * constant_table INDEX
    * OP_DEFINE_GLOBAL
-   * constant_table INDEX
+   * global slot INDEX (2 bytes)
    *
    * In Local Case, we don't have the OP_DEFINE_GLOBAL, but value is on top
    * of the stack of where its expected to be.
    */
-  emitBytes(OP_CLASS, nameConstant);
-  defineVariable(nameConstant);
+  emitIndexed(OP_CLASS, OP_CLASS_LONG, nameConstant);
+  defineVariable(current->scopeDepth > 0 ? 0 : globalVariable(&className));
 
   ClassCompiler classCompiler;
   classCompiler.hasSuperclass = false;
@@ -823,11 +1264,10 @@ static void classDeclaration() {
 }
 
 static void funDeclaration() {
-  uint8_t global = parseVariable("Expect function name");
-  // NOTE: If function is a global, we store it in globals tables, hence it is
-  // resolved at runtime, we store the function name identifier in constant
-  // table, and get the index while storing it in table. Its same as how we
-  // declare the global variable. Same with functions inside a function, which
+  uint16_t global = parseVariable("Expect function name");
+  // NOTE: If function is a global, we store it in a global slot, the name is
+  // resolved to the slot index at compile time and the value is filled in at
+  // runtime. Its same as how we declare the global variable. Same with functions inside a function, which
   // are locally defined. Here, unlike local where we don't support access the
   // variable being declared like var a = a; For functions, we can allow this,
   // this is how we can support "recurision". Hence unlike local variable, where
@@ -838,9 +1278,8 @@ static void funDeclaration() {
   defineVariable(global);
 }
 
-static void varDeclaration() {
-  uint8_t global = parseVariable("Expect variable name.");
-
+// The rest of a var declaration once the name has been parsed.
+static void varInitializer(uint16_t global) {
   if (match(TOKEN_EQUAL)) {
     expression();
   } else {
@@ -851,19 +1290,63 @@ static void varDeclaration() {
   defineVariable(global);
 }
 
+static void varDeclaration() {
+  varInitializer(parseVariable("Expect variable name."));
+}
+
 static void expressionStatement() {
   expression();
   consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
   emitByte(OP_POP);
 }
 
+/*
+ * for (var item in sequence) body, over the items of a list, the keys of a
+ * map or the characters of a string. The loop variable, already declared by
+ * the caller, is followed by two hidden locals: the sequence and the
+ * position in it. Each OP_FOR_ITER stores the next item in the variable or
+ * jumps out of the loop when there is none, so an iteration is a single
+ * instruction instead of calls into the sequence.
+ */
+static void forInStatement() {
+  int slot = current->localCount - 1;
+  emitByte(OP_NIL);
+  advance(); // 'in'
+  expression();
+  addLocal(syntheticToken(" sequence"));
+  emitConstant(NUMBER_VAL(0));
+  addLocal(syntheticToken(" position"));
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after for-in sequence.");
+  for (int i = slot; i < current->localCount; i++) {
+    current->locals[i].depth = current->scopeDepth;
+  }
+
+  int loopStart = currentChunk()->count;
+  emitByte(OP_FOR_ITER);
+  emitLong(slot);
+  emitBytes(0xff, 0xff);
+  int exitJump = currentChunk()->count - 2;
+  statement();
+  emitLoop(loopStart);
+
+  patchJump(exitJump);
+  endScope();
+}
+
 static void forStatement() {
   beginScope();
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
   if (match(TOKEN_SEMICOLON)) {
     // No Initializer
   } else if (match(TOKEN_VAR)) {
-    varDeclaration();
+    uint16_t global = parseVariable("Expect variable name.");
+    // "in" is only a keyword here, it stays usable as a name elsewhere.
+    if (check(TOKEN_IDENTIFIER) && parser.current.length == 2 &&
+        memcmp(parser.current.start, "in", 2) == 0) {
+      forInStatement();
+      return;
+    }
+    varInitializer(global);
   } else {
     expressionStatement();
   }
@@ -942,6 +1425,15 @@ static void returnStatement() {
     }
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after the return value.");
+
+    // A call that is the whole return value can reuse the frame, unless a
+    // jump lands after it, as in "return a and f();", and needs the return.
+    int call = current->lastCall;
+    Chunk *chunk = currentChunk();
+    if (call >= 0 && call == chunk->count - 2 &&
+        chunk->code[call] == OP_CALL && current->lastJumpTarget <= call) {
+      chunk->code[call] = OP_TAIL_CALL;
+    }
     emitByte(OP_RETURN);
   }
 }
@@ -1034,9 +1526,48 @@ ObjFunction *compile(const char *source) {
   }
   consume(TOKEN_EOF, "Expect End of Expression.");
   ObjFunction *function = endCompiler();
+  freeCompiler(&compiler);
   return parser.hadError ? NULL : function;
 }
 
+bool compileFunction(ObjFunction *function) {
+  LazyBody *lazy = function->lazy;
+  initScannerAt(lazy->source, lazy->line);
+  parser.hadError = false;
+  parser.panicMode = false;
+
+  ClassCompiler classCompiler;
+  classCompiler.enclosing = NULL;
+  classCompiler.hasSuperclass = lazy->hasSuperclass;
+  currentClass = lazy->inClass ? &classCompiler : NULL;
+
+  Compiler compiler;
+  startCompiler(&compiler, (FunctionType)lazy->type);
+  compiler.function = function;
+  compiler.lazy = lazy;
+  int arity = function->arity;
+  function->arity = 0;
+  beginScope();
+
+  advance();
+  parameters();
+  block();
+  endCompiler();
+  freeCompiler(&compiler);
+  currentClass = NULL;
+
+  if (parser.hadError) {
+    // Left lazy, the errors come up again if it's called again.
+    freeChunk(&function->chunk);
+    function->arity = arity;
+    return false;
+  }
+
+  function->lazy = NULL;
+  freeLazyBody(lazy, function->upvalueCount);
+  return true;
+}
+
 void markCompilerRoots() {
   Compiler *compiler = current;
 
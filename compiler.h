@@ -5,6 +5,9 @@
 #include "vm.h"
 
 ObjFunction *compile(const char *source);
+// Compiles the body of a function compile() skipped in lazy mode. Returns
+// false after reporting the compile errors.
+bool compileFunction(ObjFunction *function);
 void markCompilerRoots();
 
 #endif
@@ -4,6 +4,87 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
+
+const char *opcodeName(uint8_t opcode) {
+  static const char *names[UINT8_COUNT] = {
+      [OP_CONSTANT] = "OP_CONSTANT",
+      [OP_NIL] = "OP_NIL",
+      [OP_TRUE] = "OP_TRUE",
+      [OP_FALSE] = "OP_FALSE",
+      [OP_POP] = "OP_POP",
+      [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+      [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+      [OP_SET_LOCAL] = "OP_SET_LOCAL",
+      [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+      [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+      [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+      [OP_GET_LOCAL] = "OP_GET_LOCAL",
+      [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+      [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+      [OP_GET_SUPER] = "OP_GET_SUPER",
+      [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+      [OP_EQUAL] = "OP_EQUAL",
+      [OP_GREATER] = "OP_GREATER",
+      [OP_LESS] = "OP_LESS",
+      [OP_NEGATE] = "OP_NEGATE",
+      [OP_PRINT] = "OP_PRINT",
+      [OP_JUMP] = "OP_JUMP",
+      [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+      [OP_JUMP_IF_TRUE] = "OP_JUMP_IF_TRUE",
+      [OP_LOOP] = "OP_LOOP",
+      [OP_CALL] = "OP_CALL",
+      [OP_INVOKE] = "OP_INVOKE",
+      [OP_CLOSURE] = "OP_CLOSURE",
+      [OP_ADD] = "OP_ADD",
+      [OP_SUBTRACT] = "OP_SUBTRACT",
+      [OP_MULTIPLY] = "OP_MULTIPLY",
+      [OP_DIVIDE] = "OP_DIVIDE",
+      [OP_NOT] = "OP_NOT",
+      [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+      [OP_CLASS] = "OP_CLASS",
+      [OP_METHOD] = "OP_METHOD",
+      [OP_INHERIT] = "OP_INHERIT",
+      [OP_RETURN] = "OP_RETURN",
+      [OP_BUILD_LIST] = "OP_BUILD_LIST",
+      [OP_BUILD_MAP] = "OP_BUILD_MAP",
+      [OP_INDEX_GET] = "OP_INDEX_GET",
+      [OP_INDEX_SET] = "OP_INDEX_SET",
+      [OP_FOR_ITER] = "OP_FOR_ITER",
+      [OP_TAIL_CALL] = "OP_TAIL_CALL",
+      [OP_NOT_EQUAL] = "OP_NOT_EQUAL",
+      [OP_GREATER_EQUAL] = "OP_GREATER_EQUAL",
+      [OP_LESS_EQUAL] = "OP_LESS_EQUAL",
+      [OP_ADD_LOCALS] = "OP_ADD_LOCALS",
+      [OP_ADD_LOCAL_CONSTANT] = "OP_ADD_LOCAL_CONSTANT",
+      [OP_LESS_LOCAL_CONSTANT_JUMP] = "OP_LESS_LOCAL_CONSTANT_JUMP",
+      [OP_GET_THIS_PROPERTY] = "OP_GET_THIS_PROPERTY",
+      [OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+      [OP_SET_GLOBAL_POP] = "OP_SET_GLOBAL_POP",
+      [OP_ADD_NUMBER] = "OP_ADD_NUMBER",
+      [OP_SUBTRACT_NUMBER] = "OP_SUBTRACT_NUMBER",
+      [OP_MULTIPLY_NUMBER] = "OP_MULTIPLY_NUMBER",
+      [OP_DIVIDE_NUMBER] = "OP_DIVIDE_NUMBER",
+      [OP_GREATER_NUMBER] = "OP_GREATER_NUMBER",
+      [OP_LESS_NUMBER] = "OP_LESS_NUMBER",
+      [OP_GREATER_EQUAL_NUMBER] = "OP_GREATER_EQUAL_NUMBER",
+      [OP_LESS_EQUAL_NUMBER] = "OP_LESS_EQUAL_NUMBER",
+      [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+      [OP_GET_LOCAL_LONG] = "OP_GET_LOCAL_LONG",
+      [OP_SET_LOCAL_LONG] = "OP_SET_LOCAL_LONG",
+      [OP_GET_UPVALUE_LONG] = "OP_GET_UPVALUE_LONG",
+      [OP_SET_UPVALUE_LONG] = "OP_SET_UPVALUE_LONG",
+      [OP_GET_PROPERTY_LONG] = "OP_GET_PROPERTY_LONG",
+      [OP_SET_PROPERTY_LONG] = "OP_SET_PROPERTY_LONG",
+      [OP_INVOKE_LONG] = "OP_INVOKE_LONG",
+      [OP_GET_SUPER_LONG] = "OP_GET_SUPER_LONG",
+      [OP_SUPER_INVOKE_LONG] = "OP_SUPER_INVOKE_LONG",
+      [OP_CLASS_LONG] = "OP_CLASS_LONG",
+      [OP_METHOD_LONG] = "OP_METHOD_LONG",
+      [OP_CLOSURE_LONG] = "OP_CLOSURE_LONG",
+  };
+  return names[opcode] != NULL ? names[opcode] : "OP_UNKNOWN";
+}
 
 void disassembleChunk(Chunk *chunk, const char *name) {
   printf("== %s ==\n", name);
@@ -39,6 +120,15 @@ static int constantInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 2;
 }
 
+static int globalInstruction(const char *name, Chunk *chunk, int offset) {
+  uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+  slot |= chunk->code[offset + 2];
+  printf("%-16s %4d '", name, slot);
+  printValue(vm->globalNames.values[slot]);
+  printf("'\n");
+  return offset + 3;
+}
+
 static int invokeInstruction(const char *name, Chunk *chunk, int offset) {
   uint8_t constant = chunk->code[offset + 1];
   uint8_t argCount = chunk->code[offset + 2];
@@ -48,19 +138,143 @@ static int invokeInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 3;
 }
 
+static void printInlineCache(Chunk *chunk, int offset) {
+  uint16_t cache = (uint16_t)(chunk->code[offset] << 8);
+  cache |= chunk->code[offset + 1];
+  if (cache == NO_INLINE_CACHE) {
+    printf(" [no cache]\n");
+  } else {
+    printf(" [cache %d: %d ways]\n", cache, chunk->caches[cache].count);
+  }
+}
+
+static int propertyInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'");
+  printInlineCache(chunk, offset + 2);
+  return offset + 4;
+}
+
+static int cachedInvokeInstruction(const char *name, Chunk *chunk,
+                                   int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint8_t argCount = chunk->code[offset + 2];
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'");
+  printInlineCache(chunk, offset + 3);
+  return offset + 5;
+}
+
+static int localsInstruction(const char *name, Chunk *chunk, int offset) {
+  printf("%-16s %4d %4d\n", name, chunk->code[offset + 1],
+         chunk->code[offset + 2]);
+  return offset + 3;
+}
+
+static int localConstantInstruction(const char *name, Chunk *chunk,
+                                    int offset) {
+  uint8_t constant = chunk->code[offset + 2];
+  printf("%-16s %4d %4d '", name, chunk->code[offset + 1], constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 3;
+}
+
+static int localConstantJumpInstruction(const char *name, Chunk *chunk,
+                                        int offset) {
+  uint8_t constant = chunk->code[offset + 2];
+  uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+  jump |= chunk->code[offset + 4];
+  printf("%-16s %4d %4d '", name, chunk->code[offset + 1], constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' %4d -> %d\n", offset, offset + 5 + jump);
+  return offset + 5;
+}
+
+static int readLong(Chunk *chunk, int offset) {
+  return (chunk->code[offset] << 16) | (chunk->code[offset + 1] << 8) |
+         chunk->code[offset + 2];
+}
+
+static int longInstruction(const char *name, Chunk *chunk, int offset) {
+  printf("%-16s %4d\n", name, readLong(chunk, offset + 1));
+  return offset + 4;
+}
+
+static int longConstantInstruction(const char *name, Chunk *chunk,
+                                   int offset) {
+  int constant = readLong(chunk, offset + 1);
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 4;
+}
+
+static int longInvokeInstruction(const char *name, Chunk *chunk, int offset) {
+  int constant = readLong(chunk, offset + 1);
+  uint8_t argCount = chunk->code[offset + 4];
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 5;
+}
+
+static int longPropertyInstruction(const char *name, Chunk *chunk,
+                                   int offset) {
+  int constant = readLong(chunk, offset + 1);
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'");
+  printInlineCache(chunk, offset + 4);
+  return offset + 6;
+}
+
+static int longCachedInvokeInstruction(const char *name, Chunk *chunk,
+                                       int offset) {
+  int constant = readLong(chunk, offset + 1);
+  uint8_t argCount = chunk->code[offset + 4];
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'");
+  printInlineCache(chunk, offset + 5);
+  return offset + 7;
+}
+
+static int forIterInstruction(const char *name, Chunk *chunk, int offset) {
+  uint16_t jump = (uint16_t)(chunk->code[offset + 4] << 8);
+  jump |= chunk->code[offset + 5];
+  printf("%-16s %4d %4d -> %d\n", name, readLong(chunk, offset + 1), offset,
+         offset + 6 + jump);
+  return offset + 6;
+}
+
 int disassembleInstruction(Chunk *chunk, int offset) {
   printf("%04d", offset);
 
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+  int line = getLine(chunk, offset);
+  if (offset > 0 && line == getLine(chunk, offset - 1)) {
     printf("   | ");
   } else {
-    printf("%4d ", chunk->lines[offset]);
+    printf("%4d ", line);
   }
 
   uint8_t instruction = chunk->code[offset];
   switch (instruction) {
   case OP_RETURN:
     return simpleInstruction("OP_RETURN", offset);
+  case OP_BUILD_LIST:
+    return longInstruction("OP_BUILD_LIST", chunk, offset);
+  case OP_BUILD_MAP:
+    return longInstruction("OP_BUILD_MAP", chunk, offset);
+  case OP_INDEX_GET:
+    return simpleInstruction("OP_INDEX_GET", offset);
+  case OP_INDEX_SET:
+    return simpleInstruction("OP_INDEX_SET", offset);
+  case OP_FOR_ITER:
+    return forIterInstruction("OP_FOR_ITER", chunk, offset);
   case OP_CLASS:
     return constantInstruction("OP_CLASS", chunk, offset);
   case OP_METHOD:
@@ -71,8 +285,10 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return simpleInstruction("OP_CLOSE_UPVALUE", offset);
   case OP_CALL:
     return byteInstruction("OP_CALL", chunk, offset);
+  case OP_TAIL_CALL:
+    return byteInstruction("OP_TAIL_CALL", chunk, offset);
   case OP_INVOKE:
-    return invokeInstruction("OP_INVOKE", chunk, offset);
+    return cachedInvokeInstruction("OP_INVOKE", chunk, offset);
   case OP_CLOSURE: {
     offset++;
     uint8_t constant = chunk->code[offset++];
@@ -89,6 +305,23 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     }
     return offset;
   }
+  case OP_CLOSURE_LONG: {
+    int constant = readLong(chunk, offset + 1);
+    offset += 4;
+    printf("%-16s %4d ", "OP_CLOSURE_LONG", constant);
+    printValue(chunk->constants.values[constant]);
+    printf("\n");
+
+    ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+    for (int j = 0; j < function->upvalueCount; j++) {
+      int isLocal = chunk->code[offset];
+      int index = readLong(chunk, offset + 1);
+      printf("%04d      |                     %s %d\n", offset,
+             isLocal ? "local" : "upvalue", index);
+      offset += 4;
+    }
+    return offset;
+  }
   case OP_LOOP:
     return jumpInstruction("OP_LOOP", -1, chunk, offset);
   case OP_PRINT:
@@ -97,6 +330,8 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return jumpInstruction("OP_JUMP", 1, chunk, offset);
   case OP_JUMP_IF_FALSE:
     return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+  case OP_JUMP_IF_TRUE:
+    return jumpInstruction("OP_JUMP_IF_TRUE", 1, chunk, offset);
   case OP_CONSTANT:
     return constantInstruction("OP_CONSTANT", chunk, offset);
   case OP_NIL:
@@ -114,27 +349,33 @@ int disassembleInstruction(Chunk *chunk, int offset) {
   case OP_SET_UPVALUE:
     return byteInstruction("OP_SET_UPVALUE", chunk, offset);
   case OP_SET_PROPERTY:
-    return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+    return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
   case OP_GET_PROPERTY:
-    return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+    return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
   case OP_GET_UPVALUE:
     return byteInstruction("OP_GET_UPVALUE", chunk, offset);
   case OP_DEFINE_GLOBAL:
-    return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+    return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
   case OP_SET_GLOBAL:
-    return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+    return globalInstruction("OP_SET_GLOBAL", chunk, offset);
   case OP_GET_GLOBAL:
-    return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+    return globalInstruction("OP_GET_GLOBAL", chunk, offset);
   case OP_GET_SUPER:
     return constantInstruction("OP_GET_SUPER", chunk, offset);
   case OP_SUPER_INVOKE:
     return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
   case OP_EQUAL:
     return simpleInstruction("OP_EQUAL", offset);
+  case OP_NOT_EQUAL:
+    return simpleInstruction("OP_NOT_EQUAL", offset);
   case OP_GREATER:
     return simpleInstruction("OP_GREATER", offset);
+  case OP_GREATER_EQUAL:
+    return simpleInstruction("OP_GREATER_EQUAL", offset);
   case OP_LESS:
     return simpleInstruction("OP_LESS", offset);
+  case OP_LESS_EQUAL:
+    return simpleInstruction("OP_LESS_EQUAL", offset);
   case OP_ADD:
     return simpleInstruction("OP_ADD", offset);
   case OP_SUBTRACT:
@@ -147,6 +388,59 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return simpleInstruction("OP_NOT", offset);
   case OP_NEGATE:
     return simpleInstruction("OP_NEGATE", offset);
+  case OP_ADD_LOCALS:
+    return localsInstruction("OP_ADD_LOCALS", chunk, offset);
+  case OP_ADD_LOCAL_CONSTANT:
+    return localConstantInstruction("OP_ADD_LOCAL_CONSTANT", chunk, offset);
+  case OP_LESS_LOCAL_CONSTANT_JUMP:
+    return localConstantJumpInstruction("OP_LESS_LOCAL_CONSTANT_JUMP", chunk,
+                                        offset);
+  case OP_GET_THIS_PROPERTY:
+    return propertyInstruction("OP_GET_THIS_PROPERTY", chunk, offset);
+  case OP_SET_LOCAL_POP:
+    return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+  case OP_SET_GLOBAL_POP:
+    return globalInstruction("OP_SET_GLOBAL_POP", chunk, offset);
+  case OP_ADD_NUMBER:
+    return simpleInstruction("OP_ADD_NUMBER", offset);
+  case OP_SUBTRACT_NUMBER:
+    return simpleInstruction("OP_SUBTRACT_NUMBER", offset);
+  case OP_MULTIPLY_NUMBER:
+    return simpleInstruction("OP_MULTIPLY_NUMBER", offset);
+  case OP_DIVIDE_NUMBER:
+    return simpleInstruction("OP_DIVIDE_NUMBER", offset);
+  case OP_GREATER_NUMBER:
+    return simpleInstruction("OP_GREATER_NUMBER", offset);
+  case OP_LESS_NUMBER:
+    return simpleInstruction("OP_LESS_NUMBER", offset);
+  case OP_GREATER_EQUAL_NUMBER:
+    return simpleInstruction("OP_GREATER_EQUAL_NUMBER", offset);
+  case OP_LESS_EQUAL_NUMBER:
+    return simpleInstruction("OP_LESS_EQUAL_NUMBER", offset);
+  case OP_CONSTANT_LONG:
+    return longConstantInstruction("OP_CONSTANT_LONG", chunk, offset);
+  case OP_GET_LOCAL_LONG:
+    return longInstruction("OP_GET_LOCAL_LONG", chunk, offset);
+  case OP_SET_LOCAL_LONG:
+    return longInstruction("OP_SET_LOCAL_LONG", chunk, offset);
+  case OP_GET_UPVALUE_LONG:
+    return longInstruction("OP_GET_UPVALUE_LONG", chunk, offset);
+  case OP_SET_UPVALUE_LONG:
+    return longInstruction("OP_SET_UPVALUE_LONG", chunk, offset);
+  case OP_GET_PROPERTY_LONG:
+    return longPropertyInstruction("OP_GET_PROPERTY_LONG", chunk, offset);
+  case OP_SET_PROPERTY_LONG:
+    return longPropertyInstruction("OP_SET_PROPERTY_LONG", chunk, offset);
+  case OP_INVOKE_LONG:
+    return longCachedInvokeInstruction("OP_INVOKE_LONG", chunk, offset);
+  case OP_GET_SUPER_LONG:
+    return longConstantInstruction("OP_GET_SUPER_LONG", chunk, offset);
+  case OP_SUPER_INVOKE_LONG:
+    return longInvokeInstruction("OP_SUPER_INVOKE_LONG", chunk, offset);
+  case OP_CLASS_LONG:
+    return longConstantInstruction("OP_CLASS_LONG", chunk, offset);
+  case OP_METHOD_LONG:
+    return longConstantInstruction("OP_METHOD_LONG", chunk, offset);
   default:
     printf("Unknown OpCode %d\n", instruction);
     return offset + 1;
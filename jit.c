@@ -0,0 +1,994 @@
+// Anonymous mmap() is POSIX plus MAP_ANONYMOUS, neither of them C11
+#define _DEFAULT_SOURCE
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "jit.h"
+#include "memory.h"
+#include "vm.h"
+
+#ifdef CLOX_JIT
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define JIT_X64
+#include <sys/mman.h>
+#include <unistd.h>
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+// Native code is entered at start, somewhere past the prologue at the
+// beginning of the code, and returns the offset of the instruction it
+// stopped at.
+typedef int (*NativeCode)(Value *slots, Value *constants, ObjClosure *closure,
+                          uint8_t *start);
+
+uint8_t *runJit(ObjClosure *closure, Value *slots, uint8_t *ip) {
+  ObjFunction *function = closure->function;
+  JitCode *jit = function->jit;
+  int offset = (int)(ip - function->chunk.code);
+  NativeCode native = (NativeCode)(void *)jit->code;
+  int stop = native(slots, function->chunk.constants.values, closure,
+                    jit->code + jit->entries[offset]);
+  vm->stackTop = slots + jit->depths[stop];
+  return function->chunk.code + stop;
+}
+
+void freeJitCode(JitCode *jit) {
+  if (jit == NULL) {
+    return;
+  }
+#ifdef JIT_X64
+  munmap(jit->code, jit->size);
+#endif
+  free(jit->entries);
+  free(jit->depths);
+  free(jit);
+}
+
+#ifdef JIT_X64
+
+/*
+ * While native code runs, rbx holds the frame's slots, r12 its constants,
+ * r13 the closure and, with NaN boxing, r15 the QNAN mask. All of them are
+ * callee-saved, so the C helpers it calls leave them alone. Everything else
+ * is scratch within a single template: the stack values stay in the VM's
+ * stack, at the depth the bytecode has them.
+ */
+enum {
+  RAX,
+  RCX,
+  RDX,
+  RBX,
+  RSP,
+  RBP,
+  RSI,
+  RDI,
+  R8,
+  R9,
+  R10,
+  R11,
+  R12,
+  R13,
+  R14,
+  R15
+};
+
+// Condition codes, the low nibble of Jcc and SETcc.
+enum {
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_BE = 0x6,
+  CC_A = 0x7,
+  CC_S = 0x8,
+  CC_NP = 0xb,
+  CC_ALWAYS = -1
+};
+
+// A rel32 at position in the code, to be pointed at the code for the
+// instruction at target.
+typedef struct {
+  int position;
+  int target;
+} Fixup;
+
+typedef struct {
+  int count;
+  int capacity;
+  Fixup *fixups;
+} FixupArray;
+
+typedef struct {
+  Chunk *chunk;
+  uint8_t *code;
+  int count;
+  int capacity;
+  int *depths;
+  // Start of each instruction's template in code
+  int *starts;
+  // Jumps to other instructions, and guards that hand the instruction
+  // they're in back to run().
+  FixupArray jumps;
+  FixupArray exits;
+  int epilogue;
+  // The instruction being compiled
+  int offset;
+} Assembler;
+
+static void emitByte(Assembler *as, uint8_t byte) {
+  if (as->count == as->capacity) {
+    as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+    as->code = realloc(as->code, as->capacity);
+    if (as->code == NULL) {
+      exit(1);
+    }
+  }
+  as->code[as->count++] = byte;
+}
+
+static void emit32(Assembler *as, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    emitByte(as, (uint8_t)(value >> (8 * i)));
+  }
+}
+
+static void emit64(Assembler *as, uint64_t value) {
+  emit32(as, (uint32_t)value);
+  emit32(as, (uint32_t)(value >> 32));
+}
+
+static void addFixup(FixupArray *array, int position, int target) {
+  if (array->count == array->capacity) {
+    array->capacity = array->capacity < 8 ? 8 : array->capacity * 2;
+    array->fixups =
+        realloc(array->fixups, sizeof(Fixup) * (size_t)array->capacity);
+    if (array->fixups == NULL) {
+      exit(1);
+    }
+  }
+  array->fixups[array->count].position = position;
+  array->fixups[array->count].target = target;
+  array->count++;
+}
+
+// The REX prefix, if the instruction needs one: for a 64-bit operand or to
+// reach r8-r15 in the ModRM reg or rm field.
+static void emitRex(Assembler *as, bool wide, int reg, int rm) {
+  uint8_t rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+  if (rex != 0x40) {
+    emitByte(as, rex);
+  }
+}
+
+// ModRM (and SIB) for [base + disp], with the shortest displacement.
+static void emitAddress(Assembler *as, int reg, int base, int32_t disp) {
+  uint8_t modrm = (uint8_t)(((reg & 7) << 3) | (base & 7));
+  // rbp and r13 as a base always need a displacement, rsp and r12 a SIB.
+  bool noDisp = disp == 0 && (base & 7) != RBP;
+  bool shortDisp = disp >= INT8_MIN && disp <= INT8_MAX;
+  emitByte(as, modrm | (noDisp ? 0x00 : shortDisp ? 0x40 : 0x80));
+  if ((base & 7) == RSP) {
+    emitByte(as, 0x24);
+  }
+  if (noDisp) {
+    return;
+  }
+  if (shortDisp) {
+    emitByte(as, (uint8_t)disp);
+  } else {
+    emit32(as, (uint32_t)disp);
+  }
+}
+
+// op reg, [base + disp], or the other way around, depending on op.
+static void emitMemoryOp(Assembler *as, bool wide, uint8_t op, int reg,
+                         int base, int32_t disp) {
+  emitRex(as, wide, reg, base);
+  emitByte(as, op);
+  emitAddress(as, reg, base, disp);
+}
+
+static void emitRegisterOp(Assembler *as, bool wide, uint8_t op, int reg,
+                           int rm) {
+  emitRex(as, wide, reg, rm);
+  emitByte(as, op);
+  emitByte(as, (uint8_t)(0xc0 | ((reg & 7) << 3) | (rm & 7)));
+}
+
+static void emitLoad(Assembler *as, int reg, int base, int32_t disp) {
+  emitMemoryOp(as, true, 0x8b, reg, base, disp);
+}
+
+static void emitStore(Assembler *as, int base, int32_t disp, int reg) {
+  emitMemoryOp(as, true, 0x89, reg, base, disp);
+}
+
+static void emitMove(Assembler *as, int dst, int src) {
+  emitRegisterOp(as, true, 0x89, src, dst);
+}
+
+static void emitMoveImmediate(Assembler *as, int reg, uint64_t value) {
+  // A 32-bit move zero-extends, and is half the size.
+  bool wide = value > UINT32_MAX;
+  emitRex(as, wide, 0, reg);
+  emitByte(as, (uint8_t)(0xb8 | (reg & 7)));
+  if (wide) {
+    emit64(as, value);
+  } else {
+    emit32(as, (uint32_t)value);
+  }
+}
+
+static void emitLea(Assembler *as, int reg, int base, int32_t disp) {
+  emitMemoryOp(as, true, 0x8d, reg, base, disp);
+}
+
+// SSE2 scalar double instructions on an xmm register and memory, or two
+// xmm registers.
+static void emitSse(Assembler *as, uint8_t prefix, uint8_t op, int xmm,
+                    int base, int32_t disp) {
+  emitByte(as, prefix);
+  emitRex(as, false, xmm, base);
+  emitByte(as, 0x0f);
+  emitByte(as, op);
+  emitAddress(as, xmm, base, disp);
+}
+
+static void emitSseRegisters(Assembler *as, uint8_t prefix, uint8_t op,
+                             int dst, int src) {
+  emitByte(as, prefix);
+  emitRex(as, false, dst, src);
+  emitByte(as, 0x0f);
+  emitByte(as, op);
+  emitByte(as, (uint8_t)(0xc0 | ((dst & 7) << 3) | (src & 7)));
+}
+
+#define MOVSD_LOAD 0x10
+#define MOVSD_STORE 0x11
+#define ADDSD 0x58
+#define MULSD 0x59
+#define SUBSD 0x5c
+#define DIVSD 0x5e
+#define UCOMISD 0x2e
+
+static void emitLoadDouble(Assembler *as, int xmm, int base, int32_t disp) {
+  emitSse(as, 0xf2, MOVSD_LOAD, xmm, base, disp);
+}
+
+static void emitStoreDouble(Assembler *as, int base, int32_t disp, int xmm) {
+  emitSse(as, 0xf2, MOVSD_STORE, xmm, base, disp);
+}
+
+// setcc on al, cl, dl or bl.
+static void emitSetcc(Assembler *as, int cc, int reg) {
+  emitByte(as, 0x0f);
+  emitByte(as, (uint8_t)(0x90 | cc));
+  emitByte(as, (uint8_t)(0xc0 | reg));
+}
+
+// movzx reg, al
+static void emitZeroExtendAl(Assembler *as, int reg) {
+  emitByte(as, 0x0f);
+  emitByte(as, 0xb6);
+  emitByte(as, (uint8_t)(0xc0 | (reg << 3)));
+}
+
+static void emitTestAl(Assembler *as) {
+  emitByte(as, 0x84);
+  emitByte(as, 0xc0);
+}
+
+// Returns where the rel32 is, for patchJump().
+static int emitJump(Assembler *as, int cc) {
+  if (cc == CC_ALWAYS) {
+    emitByte(as, 0xe9);
+  } else {
+    emitByte(as, 0x0f);
+    emitByte(as, (uint8_t)(0x80 | cc));
+  }
+  emit32(as, 0);
+  return as->count - 4;
+}
+
+static void patchJump(Assembler *as, int position, int target) {
+  int32_t distance = target - (position + 4);
+  memcpy(as->code + position, &distance, sizeof(distance));
+}
+
+static void emitPush(Assembler *as, int reg) {
+  emitRex(as, false, 0, reg);
+  emitByte(as, (uint8_t)(0x50 | (reg & 7)));
+}
+
+static void emitPop(Assembler *as, int reg) {
+  emitRex(as, false, 0, reg);
+  emitByte(as, (uint8_t)(0x58 | (reg & 7)));
+}
+
+static void emitCall(Assembler *as, void *function) {
+  emitMoveImmediate(as, RAX, (uint64_t)(uintptr_t)function);
+  emitByte(as, 0xff);
+  emitByte(as, 0xd0); // call rax
+}
+
+// Hands the instruction being compiled back to run() if the condition holds.
+static void exitIf(Assembler *as, int cc) {
+  addFixup(&as->exits, emitJump(as, cc), as->offset);
+}
+
+static void jumpTo(Assembler *as, int cc, int target) {
+  addFixup(&as->jumps, emitJump(as, cc), target);
+}
+
+static void emitExit(Assembler *as, int offset) {
+  emitMoveImmediate(as, RAX, (uint64_t)offset);
+  patchJump(as, emitJump(as, CC_ALWAYS), as->epilogue);
+}
+
+// Operands are [base + disp] pairs, the two arguments these expand to.
+#define SLOT(index) RBX, (int32_t)((index) * (int32_t)sizeof(Value))
+#define CONSTANT(index) R12, (int32_t)((index) * (int32_t)sizeof(Value))
+
+/*
+ * The templates that depend on how a Value is laid out. rax, rcx, rdx and
+ * xmm2 are theirs to clobber.
+ */
+#ifdef NAN_BOXING
+
+static void emitCopy(Assembler *as, int dstBase, int32_t dst, int srcBase,
+                     int32_t src) {
+  emitLoad(as, RCX, srcBase, src);
+  emitStore(as, dstBase, dst, RCX);
+}
+
+static void emitStoreValue(Assembler *as, int base, int32_t disp,
+                           Value value) {
+  emitMoveImmediate(as, RAX, value);
+  emitStore(as, base, disp, RAX);
+}
+
+// Taken when the value isn't a number.
+static int emitJumpIfNotNumber(Assembler *as, int base, int32_t disp) {
+  emitLoad(as, RCX, base, disp);
+  emitRegisterOp(as, true, 0x21, R15, RCX); // and rcx, r15
+  emitRegisterOp(as, true, 0x39, R15, RCX); // cmp rcx, r15
+  return emitJump(as, CC_E);
+}
+
+static void exitIfUndefined(Assembler *as, int base, int32_t disp) {
+  emitLoad(as, RCX, base, disp);
+  emitMoveImmediate(as, RAX, UNDEFINED_VAL);
+  emitRegisterOp(as, true, 0x39, RAX, RCX); // cmp rcx, rax
+  exitIf(as, CC_E);
+}
+
+static void emitLoadNumber(Assembler *as, int xmm, int base, int32_t disp) {
+  emitLoadDouble(as, xmm, base, disp);
+}
+
+static void emitStoreNumber(Assembler *as, int base, int32_t disp, int xmm) {
+  emitStoreDouble(as, base, disp, xmm);
+}
+
+static void emitNegate(Assembler *as, int base, int32_t disp) {
+  emitMoveImmediate(as, RAX, SIGN_BIT);
+  emitMemoryOp(as, true, 0x31, RAX, base, disp); // xor [m], rax
+}
+
+// From the 0 or 1 in al, which is left as it was.
+static void emitStoreBool(Assembler *as, int base, int32_t disp) {
+  emitZeroExtendAl(as, RCX);
+  emitMoveImmediate(as, RDX, FALSE_VAL);
+  emitRegisterOp(as, true, 0x09, RDX, RCX); // or rcx, rdx
+  emitStore(as, base, disp, RCX);
+}
+
+// al = whether the value is nil or false, the two of them are QNAN | 1 and
+// QNAN | 2.
+static void emitFalsey(Assembler *as, int base, int32_t disp) {
+  emitLoad(as, RCX, base, disp);
+  emitRegisterOp(as, true, 0x31, R15, RCX); // xor rcx, r15
+  emitRegisterOp(as, true, 0x83, 5, RCX);   // sub rcx, 1
+  emitByte(as, 1);
+  emitRegisterOp(as, true, 0x83, 7, RCX); // cmp rcx, 1
+  emitByte(as, 1);
+  emitSetcc(as, CC_BE, RAX);
+}
+
+#else
+
+#define TYPE 0
+#define PAYLOAD ((int32_t)offsetof(Value, as))
+
+static void emitCopy(Assembler *as, int dstBase, int32_t dst, int srcBase,
+                     int32_t src) {
+  emitSse(as, 0xf3, 0x6f, 2, srcBase, src); // movdqu xmm2, [src]
+  emitSse(as, 0xf3, 0x7f, 2, dstBase, dst); // movdqu [dst], xmm2
+}
+
+static void emitStoreType(Assembler *as, int base, int32_t disp,
+                          ValueType type) {
+  emitMemoryOp(as, false, 0xc7, 0, base, disp + TYPE); // mov dword [m], imm
+  emit32(as, (uint32_t)type);
+}
+
+static void emitStoreValue(Assembler *as, int base, int32_t disp,
+                           Value value) {
+  uint64_t payload = 0;
+  memcpy(&payload, &value.as, sizeof(value.as));
+  emitStoreType(as, base, disp, value.type);
+  emitMoveImmediate(as, RAX, payload);
+  emitStore(as, base, disp + PAYLOAD, RAX);
+}
+
+static void emitCompareType(Assembler *as, int base, int32_t disp,
+                            ValueType type) {
+  emitMemoryOp(as, false, 0x83, 7, base, disp + TYPE); // cmp dword [m], imm8
+  emitByte(as, (uint8_t)type);
+}
+
+static int emitJumpIfNotNumber(Assembler *as, int base, int32_t disp) {
+  emitCompareType(as, base, disp, VAL_NUMBER);
+  return emitJump(as, CC_NE);
+}
+
+static void exitIfUndefined(Assembler *as, int base, int32_t disp) {
+  emitCompareType(as, base, disp, VAL_UNDEFINED);
+  exitIf(as, CC_E);
+}
+
+static void emitLoadNumber(Assembler *as, int xmm, int base, int32_t disp) {
+  emitLoadDouble(as, xmm, base, disp + PAYLOAD);
+}
+
+static void emitStoreNumber(Assembler *as, int base, int32_t disp, int xmm) {
+  emitStoreType(as, base, disp, VAL_NUMBER);
+  emitStoreDouble(as, base, disp + PAYLOAD, xmm);
+}
+
+static void emitNegate(Assembler *as, int base, int32_t disp) {
+  // xor byte [m], 0x80 on the byte with the sign bit
+  emitMemoryOp(as, false, 0x80, 6, base,
+               disp + PAYLOAD + (int32_t)sizeof(double) - 1);
+  emitByte(as, 0x80);
+}
+
+static void emitStoreBool(Assembler *as, int base, int32_t disp) {
+  emitStoreType(as, base, disp, VAL_BOOL);
+  emitZeroExtendAl(as, RCX);
+  emitStore(as, base, disp + PAYLOAD, RCX);
+}
+
+static void emitFalsey(Assembler *as, int base, int32_t disp) {
+  emitMemoryOp(as, false, 0x8b, RDX, base, disp + TYPE); // mov edx, type
+  emitRegisterOp(as, false, 0x83, 7, RDX);               // cmp edx, VAL_NIL
+  emitByte(as, VAL_NIL);
+  emitSetcc(as, CC_E, RAX);
+  emitRegisterOp(as, false, 0x83, 7, RDX); // cmp edx, VAL_BOOL
+  emitByte(as, VAL_BOOL);
+  emitSetcc(as, CC_E, RDX);
+  emitMemoryOp(as, false, 0x80, 7, base, disp + PAYLOAD); // cmp byte [m], 0
+  emitByte(as, 0);
+  emitSetcc(as, CC_E, RCX);
+  emitRegisterOp(as, false, 0x20, RCX, RDX); // and dl, cl
+  emitRegisterOp(as, false, 0x08, RDX, RAX); // or al, dl
+}
+
+#endif
+
+static void exitIfNotNumber(Assembler *as, int base, int32_t disp) {
+  addFixup(&as->exits, emitJumpIfNotNumber(as, base, disp), as->offset);
+}
+
+
+// The helpers native code calls. None of them allocates, so vm->stackTop
+// doesn't need to be up to date for them.
+static void jitPrint(Value *value) {
+  printValue(*value);
+  printf("\n");
+}
+
+// -1 when ropes are involved, comparing those flattens them, which is
+// left to run().
+static int jitEqual(Value *operands) {
+  if (IS_ROPE(operands[0]) || IS_ROPE(operands[1])) {
+    return -1;
+  }
+  return valuesEqual(operands[0], operands[1]);
+}
+
+static void jitSetUpvalue(ObjUpvalue *upvalue, Value *value) {
+  *upvalue->location = *value;
+  writeBarrier(*value);
+}
+
+// Fields the site's inline cache has the slot of. Methods, misses and
+// adding a field are left to run().
+static CacheEntry *cachedField(Value receiver, InlineCache *cache) {
+  if (!IS_INSTANCE(receiver) || AS_INSTANCE(receiver)->shape == NULL) {
+    return NULL;
+  }
+  ObjShape *shape = AS_INSTANCE(receiver)->shape;
+  for (int i = 0; i < cache->count; i++) {
+    CacheEntry *entry = &cache->entries[i];
+    if (entry->shape == shape) {
+      return entry->fieldIndex >= 0 && entry->transition == NULL ? entry
+                                                                 : NULL;
+    }
+  }
+  return NULL;
+}
+
+static bool jitGetField(Value *receiver, Value *result, InlineCache *cache) {
+  CacheEntry *entry = cachedField(*receiver, cache);
+  if (entry == NULL) {
+    return false;
+  }
+  *result = AS_INSTANCE(*receiver)->fields[entry->fieldIndex];
+  return true;
+}
+
+// The value replaces the receiver on the stack, like in run().
+static bool jitSetField(Value *receiver, Value *value, InlineCache *cache) {
+  CacheEntry *entry = cachedField(*receiver, cache);
+  if (entry == NULL) {
+    return false;
+  }
+  AS_INSTANCE(*receiver)->fields[entry->fieldIndex] = *value;
+  writeBarrier(*value);
+  *receiver = *value;
+  return true;
+}
+
+// Both operands must be numbers, the result replaces the left one.
+static void emitArithmetic(Assembler *as, int depth, uint8_t op) {
+  exitIfNotNumber(as, SLOT(depth - 2));
+  exitIfNotNumber(as, SLOT(depth - 1));
+  emitLoadNumber(as, 0, SLOT(depth - 2));
+  emitLoadNumber(as, 1, SLOT(depth - 1));
+  emitSseRegisters(as, 0xf2, op, 0, 1);
+  emitStoreNumber(as, SLOT(depth - 2), 0);
+}
+
+/*
+ * ucomisd sets the flags like an unsigned compare, and all of ZF, PF and CF
+ * when either side is NaN. So "above" is false for NaN, as > and < need,
+ * and its opposite "below or equal" true, which is what >= and <= are
+ * defined as: not < and not >.
+ */
+static void emitComparison(Assembler *as, int depth, bool swap, int cc) {
+  exitIfNotNumber(as, SLOT(depth - 2));
+  exitIfNotNumber(as, SLOT(depth - 1));
+  emitLoadNumber(as, 0, SLOT(depth - 2));
+  emitLoadNumber(as, 1, SLOT(depth - 1));
+  if (swap) {
+    emitSseRegisters(as, 0x66, UCOMISD, 1, 0);
+  } else {
+    emitSseRegisters(as, 0x66, UCOMISD, 0, 1);
+  }
+  emitSetcc(as, cc, RAX);
+  emitStoreBool(as, SLOT(depth - 2));
+}
+
+// Numbers are compared inline, anything else by jitEqual().
+static void emitEqual(Assembler *as, int depth, bool negate) {
+  int notNumberA = emitJumpIfNotNumber(as, SLOT(depth - 2));
+  int notNumberB = emitJumpIfNotNumber(as, SLOT(depth - 1));
+  emitLoadNumber(as, 0, SLOT(depth - 2));
+  emitLoadNumber(as, 1, SLOT(depth - 1));
+  emitSseRegisters(as, 0x66, UCOMISD, 0, 1);
+  // Equal and ordered
+  emitSetcc(as, CC_E, RAX);
+  emitSetcc(as, CC_NP, RCX);
+  emitRegisterOp(as, false, 0x20, RCX, RAX); // and al, cl
+  int done = emitJump(as, CC_ALWAYS);
+
+  patchJump(as, notNumberA, as->count);
+  patchJump(as, notNumberB, as->count);
+  emitLea(as, RDI, SLOT(depth - 2));
+  emitCall(as, (void *)jitEqual);
+  emitRegisterOp(as, false, 0x85, RAX, RAX); // test eax, eax
+  exitIf(as, CC_S);
+
+  patchJump(as, done, as->count);
+  if (negate) {
+    emitByte(as, 0x34); // xor al, 1
+    emitByte(as, 1);
+  }
+  emitStoreBool(as, SLOT(depth - 2));
+}
+
+// Calls the helper with the receiver and the value or result slot in rdi and
+// rsi and the site's cache in rdx, and stops if it returns false.
+static void emitFieldAccess(Assembler *as, void *helper, int cacheIndex) {
+  InlineCache *cache = &as->chunk->caches[cacheIndex];
+  emitMoveImmediate(as, RDX, (uint64_t)(uintptr_t)cache);
+  emitCall(as, helper);
+  emitTestAl(as);
+  exitIf(as, CC_E);
+}
+
+// rdx = the globals array, it moves when a new global gets a slot.
+static void emitLoadGlobals(Assembler *as) {
+  emitMoveImmediate(as, RDX, (uint64_t)(uintptr_t)&vm->globalValues.values);
+  emitLoad(as, RDX, RDX, 0);
+}
+
+#define GLOBAL(index) RDX, (int32_t)((index) * (int32_t)sizeof(Value))
+
+// rdx = the closure's upvalue at index.
+static void emitLoadUpvalue(Assembler *as, int index) {
+  emitLoad(as, RDX, R13,
+           (int32_t)(offsetof(ObjClosure, upvalues) +
+                     (size_t)index * sizeof(ObjUpvalue *)));
+}
+
+// Emits the template of the instruction at offset, returns false if there is
+// none for it.
+static bool emitInstruction(Assembler *as, int offset) {
+  uint8_t *code = as->chunk->code;
+  Value *constants = as->chunk->constants.values;
+  int depth = as->depths[offset];
+  int length = instructionLength(as->chunk, offset);
+  int byte = length > 1 ? code[offset + 1] : 0;
+  int shortOperand = 0;
+  int longOperand = 0;
+  if (length > 2) {
+    shortOperand = (code[offset + 1] << 8) | code[offset + 2];
+  }
+  if (length > 3) {
+    longOperand = (shortOperand << 8) | code[offset + 3];
+  }
+
+  switch (code[offset]) {
+  case OP_CONSTANT:
+    emitCopy(as, SLOT(depth), CONSTANT(byte));
+    return true;
+  case OP_CONSTANT_LONG:
+    emitCopy(as, SLOT(depth), CONSTANT(longOperand));
+    return true;
+  case OP_NIL:
+    emitStoreValue(as, SLOT(depth), NIL_VAL);
+    return true;
+  case OP_TRUE:
+    emitStoreValue(as, SLOT(depth), BOOL_VAL(true));
+    return true;
+  case OP_FALSE:
+    emitStoreValue(as, SLOT(depth), BOOL_VAL(false));
+    return true;
+  case OP_POP:
+    return true;
+  case OP_GET_LOCAL:
+    emitCopy(as, SLOT(depth), SLOT(byte));
+    return true;
+  case OP_GET_LOCAL_LONG:
+    emitCopy(as, SLOT(depth), SLOT(longOperand));
+    return true;
+  case OP_SET_LOCAL:
+  case OP_SET_LOCAL_POP:
+    emitCopy(as, SLOT(byte), SLOT(depth - 1));
+    return true;
+  case OP_SET_LOCAL_LONG:
+    emitCopy(as, SLOT(longOperand), SLOT(depth - 1));
+    return true;
+  case OP_GET_GLOBAL:
+    emitLoadGlobals(as);
+    exitIfUndefined(as, GLOBAL(shortOperand));
+    emitCopy(as, SLOT(depth), GLOBAL(shortOperand));
+    return true;
+  case OP_SET_GLOBAL:
+  case OP_SET_GLOBAL_POP:
+    emitLoadGlobals(as);
+    exitIfUndefined(as, GLOBAL(shortOperand));
+    emitCopy(as, GLOBAL(shortOperand), SLOT(depth - 1));
+    return true;
+  case OP_DEFINE_GLOBAL:
+    emitLoadGlobals(as);
+    emitCopy(as, GLOBAL(shortOperand), SLOT(depth - 1));
+    return true;
+  case OP_GET_UPVALUE:
+  case OP_GET_UPVALUE_LONG:
+    emitLoadUpvalue(as, code[offset] == OP_GET_UPVALUE ? byte : longOperand);
+    emitLoad(as, RDX, RDX, (int32_t)offsetof(ObjUpvalue, location));
+    emitCopy(as, SLOT(depth), RDX, 0);
+    return true;
+  case OP_SET_UPVALUE:
+  case OP_SET_UPVALUE_LONG:
+    emitLoadUpvalue(as, code[offset] == OP_SET_UPVALUE ? byte : longOperand);
+    emitMove(as, RDI, RDX);
+    emitLea(as, RSI, SLOT(depth - 1));
+    emitCall(as, (void *)jitSetUpvalue);
+    return true;
+  case OP_EQUAL:
+  case OP_NOT_EQUAL:
+    emitEqual(as, depth, code[offset] == OP_NOT_EQUAL);
+    return true;
+  case OP_GREATER:
+  case OP_GREATER_NUMBER:
+    emitComparison(as, depth, false, CC_A);
+    return true;
+  case OP_LESS:
+  case OP_LESS_NUMBER:
+    emitComparison(as, depth, true, CC_A);
+    return true;
+  case OP_GREATER_EQUAL:
+  case OP_GREATER_EQUAL_NUMBER:
+    emitComparison(as, depth, true, CC_BE);
+    return true;
+  case OP_LESS_EQUAL:
+  case OP_LESS_EQUAL_NUMBER:
+    emitComparison(as, depth, false, CC_BE);
+    return true;
+  // Strings and the error are OP_ADD's in run().
+  case OP_ADD:
+  case OP_ADD_NUMBER:
+    emitArithmetic(as, depth, ADDSD);
+    return true;
+  case OP_SUBTRACT:
+  case OP_SUBTRACT_NUMBER:
+    emitArithmetic(as, depth, SUBSD);
+    return true;
+  case OP_MULTIPLY:
+  case OP_MULTIPLY_NUMBER:
+    emitArithmetic(as, depth, MULSD);
+    return true;
+  case OP_DIVIDE:
+  case OP_DIVIDE_NUMBER:
+    emitArithmetic(as, depth, DIVSD);
+    return true;
+  case OP_NEGATE:
+    exitIfNotNumber(as, SLOT(depth - 1));
+    emitNegate(as, SLOT(depth - 1));
+    return true;
+  case OP_NOT:
+    emitFalsey(as, SLOT(depth - 1));
+    emitStoreBool(as, SLOT(depth - 1));
+    return true;
+  // Fields the inline cache knows about, see cachedField(). Sites without
+  // a cache always take run()'s way. The cache index is the last operand.
+  case OP_GET_PROPERTY:
+  case OP_GET_PROPERTY_LONG:
+  case OP_GET_THIS_PROPERTY:
+  case OP_SET_PROPERTY:
+  case OP_SET_PROPERTY_LONG: {
+    uint8_t instruction = code[offset];
+    int cache = (code[offset + length - 2] << 8) | code[offset + length - 1];
+    if (cache == NO_INLINE_CACHE) {
+      return false;
+    }
+    if (instruction == OP_SET_PROPERTY ||
+        instruction == OP_SET_PROPERTY_LONG) {
+      emitLea(as, RDI, SLOT(depth - 2));
+      emitLea(as, RSI, SLOT(depth - 1));
+      emitFieldAccess(as, (void *)jitSetField, cache);
+    } else if (instruction == OP_GET_THIS_PROPERTY) {
+      emitLea(as, RDI, SLOT(0));
+      emitLea(as, RSI, SLOT(depth));
+      emitFieldAccess(as, (void *)jitGetField, cache);
+    } else {
+      emitLea(as, RDI, SLOT(depth - 1));
+      emitMove(as, RSI, RDI);
+      emitFieldAccess(as, (void *)jitGetField, cache);
+    }
+    return true;
+  }
+  case OP_PRINT:
+    emitLea(as, RDI, SLOT(depth - 1));
+    emitCall(as, (void *)jitPrint);
+    return true;
+  case OP_JUMP:
+  case OP_LOOP:
+    jumpTo(as, CC_ALWAYS, jumpTarget(as->chunk, offset));
+    return true;
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_TRUE:
+    emitFalsey(as, SLOT(depth - 1));
+    emitTestAl(as);
+    jumpTo(as, code[offset] == OP_JUMP_IF_FALSE ? CC_NE : CC_E,
+           jumpTarget(as->chunk, offset));
+    return true;
+  case OP_ADD_LOCALS:
+    exitIfNotNumber(as, SLOT(byte));
+    exitIfNotNumber(as, SLOT(code[offset + 2]));
+    emitLoadNumber(as, 0, SLOT(byte));
+    emitLoadNumber(as, 1, SLOT(code[offset + 2]));
+    emitSseRegisters(as, 0xf2, ADDSD, 0, 1);
+    emitStoreNumber(as, SLOT(depth), 0);
+    return true;
+  // The constant's type is known now, one that isn't a number always
+  // takes run()'s way.
+  case OP_ADD_LOCAL_CONSTANT:
+    if (!IS_NUMBER(constants[code[offset + 2]])) {
+      return false;
+    }
+    exitIfNotNumber(as, SLOT(byte));
+    emitLoadNumber(as, 0, SLOT(byte));
+    emitLoadNumber(as, 1, CONSTANT(code[offset + 2]));
+    emitSseRegisters(as, 0xf2, ADDSD, 0, 1);
+    emitStoreNumber(as, SLOT(depth), 0);
+    return true;
+  case OP_LESS_LOCAL_CONSTANT_JUMP:
+    if (!IS_NUMBER(constants[code[offset + 2]])) {
+      return false;
+    }
+    exitIfNotNumber(as, SLOT(byte));
+    emitLoadNumber(as, 0, SLOT(byte));
+    emitLoadNumber(as, 1, CONSTANT(code[offset + 2]));
+    emitSseRegisters(as, 0x66, UCOMISD, 1, 0);
+    emitSetcc(as, CC_A, RAX);
+    emitStoreBool(as, SLOT(depth));
+    emitTestAl(as);
+    jumpTo(as, CC_E, jumpTarget(as->chunk, offset));
+    return true;
+  default:
+    return false;
+  }
+}
+
+/*
+ * Going into native code and back costs about as much as interpreting a few
+ * instructions. So run() is only let in where at least JIT_MIN_RUN templates
+ * follow in a row, or there's a jump that carries on somewhere else in native
+ * code. Jumps within native code can still go anywhere.
+ */
+#define JIT_MIN_RUN 4
+
+static void dropShortRuns(Assembler *as, int *entries) {
+  int run = 0;
+  for (int offset = as->chunk->count - 1; offset >= 0; offset--) {
+    if (as->starts[offset] < 0) {
+      continue;
+    }
+    if (entries[offset] < 0) {
+      run = 0;
+      continue;
+    }
+
+    uint8_t instruction = as->chunk->code[offset];
+    run = instruction == OP_JUMP || instruction == OP_LOOP ? JIT_MIN_RUN
+                                                           : run + 1;
+    if (run < JIT_MIN_RUN) {
+      entries[offset] = -1;
+    }
+  }
+}
+
+static bool assemble(Assembler *as, int *entries) {
+  Chunk *chunk = as->chunk;
+
+  // Saves what the helpers must not see changed, r14 only to keep the stack
+  // 16-byte aligned for calls to them.
+  emitPush(as, RBX);
+  emitPush(as, R12);
+  emitPush(as, R13);
+  emitPush(as, R14);
+  emitPush(as, R15);
+  emitMove(as, RBX, RDI);
+  emitMove(as, R12, RSI);
+  emitMove(as, R13, RDX);
+#ifdef NAN_BOXING
+  emitMoveImmediate(as, R15, QNAN);
+#endif
+  emitByte(as, 0xff);
+  emitByte(as, 0xe1); // jmp rcx
+
+  // eax holds the offset of the instruction to continue at.
+  as->epilogue = as->count;
+  emitPop(as, R15);
+  emitPop(as, R14);
+  emitPop(as, R13);
+  emitPop(as, R12);
+  emitPop(as, RBX);
+  emitByte(as, 0xc3);
+
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    as->offset = offset;
+    as->starts[offset] = as->count;
+    entries[offset] = as->count;
+    if (as->depths[offset] < 0 || !emitInstruction(as, offset)) {
+      entries[offset] = -1;
+      emitExit(as, offset);
+    }
+  }
+
+  for (int i = 0; i < as->jumps.count; i++) {
+    Fixup *jump = &as->jumps.fixups[i];
+    if (jump->target < 0 || jump->target >= chunk->count ||
+        as->starts[jump->target] < 0) {
+      return false;
+    }
+    patchJump(as, jump->position, as->starts[jump->target]);
+  }
+
+  // One stub per instruction with guards, shared by all of them.
+  int lastOffset = -1;
+  int stub = 0;
+  for (int i = 0; i < as->exits.count; i++) {
+    Fixup *exit = &as->exits.fixups[i];
+    if (exit->target != lastOffset) {
+      lastOffset = exit->target;
+      stub = as->count;
+      emitExit(as, exit->target);
+    }
+    patchJump(as, exit->position, stub);
+  }
+
+  dropShortRuns(as, entries);
+  return true;
+}
+
+bool jitCompile(ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  if (chunk->count == 0) {
+    return false;
+  }
+
+  Assembler as;
+  memset(&as, 0, sizeof(as));
+  as.chunk = chunk;
+  as.depths = malloc(sizeof(int) * (size_t)chunk->count);
+  as.starts = malloc(sizeof(int) * (size_t)chunk->count);
+  int *entries = malloc(sizeof(int) * (size_t)chunk->count);
+  if (as.depths == NULL || as.starts == NULL || entries == NULL) {
+    exit(1);
+  }
+  stackDepths(chunk, function->arity, as.depths);
+  for (int i = 0; i < chunk->count; i++) {
+    as.starts[i] = -1;
+  }
+
+  bool compiled = assemble(&as, entries);
+  uint8_t *code = MAP_FAILED;
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t size = ((size_t)as.count + page - 1) / page * page;
+  if (compiled) {
+    // Written while it's only writable, run once it's only executable.
+    code = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code != MAP_FAILED) {
+      memcpy(code, as.code, (size_t)as.count);
+      if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, size);
+        code = MAP_FAILED;
+      }
+    }
+  }
+
+  free(as.code);
+  free(as.starts);
+  free(as.jumps.fixups);
+  free(as.exits.fixups);
+  if (code == MAP_FAILED) {
+    free(as.depths);
+    free(entries);
+    return false;
+  }
+
+  JitCode *jit = malloc(sizeof(JitCode));
+  if (jit == NULL) {
+    exit(1);
+  }
+  jit->code = code;
+  jit->size = size;
+  jit->entries = entries;
+  jit->depths = as.depths;
+  function->jit = jit;
+  return true;
+}
+
+#else
+
+bool jitCompile(ObjFunction *function) {
+  (void)function;
+  return false;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+
+/*
+ * Baseline JIT, only built with the CLOX_JIT CMake option. A function that
+ * has been called or gone round a loop JIT_HOT_COUNT times gets its bytecode
+ * turned into x86-64 code, one fixed template per instruction. The code works
+ * on the VM's own stack and frame, each instruction reading and writing the
+ * same slots the interpreter would, so the GC and runtimeError() see nothing
+ * different.
+ *
+ * Calls, returns, methods and everything else without a template hand back
+ * to run(), as do templates whose operands aren't what they expect (an
+ * OP_ADD of two strings, an undefined global, a field the inline cache
+ * hasn't seen). run() executes that instruction and goes back into native
+ * code at the next call, return, loop or property access. Instructions the
+ * interpreter runs are all the tracer and the profiler see.
+ *
+ * Elsewhere than x86-64 (System V) jitCompile() never succeeds and
+ * everything stays interpreted.
+ */
+#ifdef CLOX_JIT
+
+#define JIT_HOT_COUNT 1000
+
+typedef struct JitCode {
+  uint8_t *code;
+  size_t size;
+  // Where in code each instruction's template starts, -1 for the ones run()
+  // shouldn't go into native code at.
+  int *entries;
+  // Stack depth before each instruction, vm->stackTop is set from it when
+  // native code stops there.
+  int *depths;
+} JitCode;
+
+// Compiles the function, whose bytecode must not change anymore apart from
+// quickening. Returns false if it can't be, the function is then never
+// tried again.
+bool jitCompile(ObjFunction *function);
+
+// Runs the native code of the frame's function from ip on, which is where
+// run() is about to continue and must have an entry. Returns where the native
+// code stopped, with vm->stackTop brought up to date.
+uint8_t *runJit(ObjClosure *closure, Value *slots, uint8_t *ip);
+
+void freeJitCode(JitCode *jit);
+
+// Counts one call or loop iteration of function.
+static inline void heatUp(ObjFunction *function) {
+  if (function->hotness < JIT_HOT_COUNT &&
+      ++function->hotness == JIT_HOT_COUNT) {
+    jitCompile(function);
+  }
+}
+
+#endif
+
+#endif
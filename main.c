@@ -1,12 +1,19 @@
+#include "bytecode.h"
 #include "chunk.h"
 #include "common.h"
+#include "compiler.h"
 #include "debug.h"
+#include "mapfile.h"
+#include "memory.h"
+#include "profile.h"
+#include "table.h"
 #include "vm.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
-static void repl() {
+static void repl(VM *machine) {
   char line[1024];
   for (;;) {
     printf("> ");
@@ -15,61 +22,279 @@ static void repl() {
       printf("\n");
       break;
     }
-    interpret(line);
+    interpret(machine, line);
   }
 }
 
-static char *readFile(const char *path) {
-  FILE *file = fopen(path, "rb");
-  if (file == NULL) {
-    fprintf(stderr, "Could not open the file \"%s\".\n", path);
+static MappedFile readFile(const char *path) {
+  MappedFile file;
+  if (!mapFile(path, &file)) {
+    fprintf(stderr, "Could not read file \"%s\".\n", path);
     exit(74);
   }
+  return file;
+}
 
-  fseek(file, 0L, SEEK_END);
-  size_t fileSize = ftell(file);
-  rewind(file);
+// Compiles through the .loxc file next to the script, "foo.lox" caches to
+// "foo.loxc". The source is still read, its hash is part of the key.
+static InterpretResult interpretCached(VM *machine, const char *path,
+                                       MappedFile *source) {
+  struct stat status;
+  SourceKey key = {hashSource(source->data, source->size), 0, 0,
+                   machine->optimizeCode};
+  if (stat(path, &status) == 0) {
+    key.mtime = (int64_t)status.st_mtime;
+    key.size = (uint64_t)status.st_size;
+  }
 
-  char *buffer = (char *)malloc(fileSize + 1);
-  if (buffer == NULL) {
+  size_t length = strlen(path);
+  char *cachePath = (char *)malloc(length + 2);
+  if (cachePath == NULL) {
     fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
     exit(74);
   }
+  memcpy(cachePath, path, length);
+  cachePath[length] = 'c';
+  cachePath[length + 1] = '\0';
 
-  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-  if (bytesRead < fileSize) {
-    fprintf(stderr, "Could not read file \"%s\".\n", path);
-    exit(74);
+  ObjFunction *function = loadBytecodeFile(cachePath, key);
+  if (function == NULL) {
+    function = compile(source->data);
+    if (function == NULL) {
+      free(cachePath);
+      return INTERPRET_COMPILER_ERROR;
+    }
+    // Not being able to write the cache only costs the next run a compile.
+    push(OBJ_VAL(function));
+    saveBytecode(cachePath, function, key);
+    pop();
   }
 
-  buffer[bytesRead] = '\0';
-
-  fclose(file);
-  return buffer;
+  free(cachePath);
+  return interpretFunction(machine, function);
 }
 
-static void runFile(const char *path) {
-  char *source = readFile(path);
-  InterpretResult result = interpret(source);
-  free(source);
+static int runFile(VM *machine, const char *path, bool cache) {
+  MappedFile source = readFile(path);
+  InterpretResult result = cache ? interpretCached(machine, path, &source)
+                                 : interpret(machine, source.data);
+  unmapFile(&source);
 
   if (result == INTERPRET_COMPILER_ERROR)
-    exit(65);
+    return 65;
   if (result == INTERPRET_RUNTIME_ERROR)
-    exit(70);
+    return 70;
+  return 0;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "Usage: clox [-O] [--lazy] [--cache] [--gc-threads=N]\n"
+          "            [--gc-initial-heap=BYTES] [--gc-grow-factor=F]\n"
+          "            [--gc-max-heap=BYTES] [--profile[=cycles]] [--stats]\n"
+          "            [path]\n"
+          "BYTES may end in k, m or g. The CLOX_GC_INITIAL_HEAP, "
+          "CLOX_GC_GROW_FACTOR and\nCLOX_GC_MAX_HEAP environment variables "
+          "work too, the flags win over them.\n");
+}
+
+// A byte count, with an optional k, m or g suffix.
+static bool parseBytes(const char *text, size_t *bytes) {
+  if (*text < '0' || *text > '9') {
+    return false;
+  }
+  char *end;
+  unsigned long long value = strtoull(text, &end, 10);
+  switch (*end) {
+  case 'k':
+  case 'K':
+    value <<= 10;
+    end++;
+    break;
+  case 'm':
+  case 'M':
+    value <<= 20;
+    end++;
+    break;
+  case 'g':
+  case 'G':
+    value <<= 30;
+    end++;
+    break;
+  }
+  *bytes = (size_t)value;
+  return *end == '\0';
+}
+
+// Below 1 a cycle would be due before the last one has finished.
+static bool parseGrowFactor(const char *text, double *factor) {
+  char *end;
+  *factor = strtod(text, &end);
+  return end != text && *end == '\0' && *factor >= 1;
+}
+
+static bool heapSettingsFromEnvironment(size_t *initialHeap,
+                                        double *growFactor, size_t *maxHeap) {
+  const char *text = getenv("CLOX_GC_INITIAL_HEAP");
+  if (text != NULL && !parseBytes(text, initialHeap)) {
+    fprintf(stderr, "Invalid CLOX_GC_INITIAL_HEAP \"%s\".\n", text);
+    return false;
+  }
+  text = getenv("CLOX_GC_GROW_FACTOR");
+  if (text != NULL && !parseGrowFactor(text, growFactor)) {
+    fprintf(stderr, "Invalid CLOX_GC_GROW_FACTOR \"%s\".\n", text);
+    return false;
+  }
+  text = getenv("CLOX_GC_MAX_HEAP");
+  if (text != NULL && !parseBytes(text, maxHeap)) {
+    fprintf(stderr, "Invalid CLOX_GC_MAX_HEAP \"%s\".\n", text);
+    return false;
+  }
+  return true;
+}
+
+// One "name value" pair per line, benchmarks/run.py reads these.
+static void printStats(VM *machine) {
+  fprintf(stderr, "-- stats --\n");
+#ifdef CLOX_STATS
+  fprintf(stderr, "instructions %llu\n",
+          (unsigned long long)machine->instructionCount);
+#endif
+  fprintf(stderr, "gc_cycles %d\n", machine->gcStats.cycles);
+  fprintf(stderr, "gc_pause_total_ns %llu\n",
+          (unsigned long long)machine->gcStats.pauseTotal);
+  fprintf(stderr, "gc_pause_max_ns %llu\n",
+          (unsigned long long)machine->gcStats.pauseMax);
+  fprintf(stderr, "peak_bytes %zu\n", machine->gcStats.peakBytes);
+  fprintf(stderr, "gc_bytes_freed %llu\n",
+          (unsigned long long)machine->gcStats.bytesFreed);
+  fprintf(stderr, "heap_bytes %zu\n", machine->bytesAllocated);
+  fprintf(stderr, "interned_strings %d\n", tableSize(&machine->strings));
+
+  // machine is still the current VM, which countObjects() looks at.
+  int counts[OBJ_TYPE_COUNT];
+  countObjects(counts);
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    fprintf(stderr, "objects_%s %d\n", objTypeName((ObjType)i), counts[i]);
+  }
 }
 
 int main(int argc, const char *argv[]) {
-  initVM();
+  const char *path = NULL;
+  bool profile = false;
+  bool profileTiming = false;
+  bool stats = false;
+  bool cache = false;
+  bool optimize = false;
+  bool lazy = false;
+  int gcThreads = 1;
+  size_t initialHeap = GC_INITIAL_HEAP;
+  double growFactor = GC_HEAP_GROW_FACTOR;
+  size_t maxHeap = 0;
+  if (!heapSettingsFromEnvironment(&initialHeap, &growFactor, &maxHeap)) {
+    return 64;
+  }
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--profile") == 0) {
+      profile = true;
+    } else if (strcmp(argv[i], "--profile=cycles") == 0) {
+      profile = true;
+      profileTiming = true;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      stats = true;
+    } else if (strcmp(argv[i], "-O") == 0) {
+      optimize = true;
+    } else if (strcmp(argv[i], "--lazy") == 0) {
+      lazy = true;
+    } else if (strcmp(argv[i], "--cache") == 0) {
+      cache = true;
+    } else if (strncmp(argv[i], "--gc-threads=", 13) == 0) {
+      char *end;
+      long count = strtol(argv[i] + 13, &end, 10);
+      if (*end != '\0' || count < 1 || count > GC_THREADS_MAX) {
+        usage();
+        return 64;
+      }
+      gcThreads = (int)count;
+    } else if (strncmp(argv[i], "--gc-initial-heap=", 18) == 0) {
+      if (!parseBytes(argv[i] + 18, &initialHeap)) {
+        usage();
+        return 64;
+      }
+    } else if (strncmp(argv[i], "--gc-grow-factor=", 17) == 0) {
+      if (!parseGrowFactor(argv[i] + 17, &growFactor)) {
+        usage();
+        return 64;
+      }
+    } else if (strncmp(argv[i], "--gc-max-heap=", 14) == 0) {
+      if (!parseBytes(argv[i] + 14, &maxHeap)) {
+        usage();
+        return 64;
+      }
+    } else if (argv[i][0] == '-' || path != NULL) {
+      usage();
+      return 64;
+    } else {
+      path = argv[i];
+    }
+  }
+
+  if (profile) {
+#ifdef CLOX_PROFILE
+    startProfiler(profileTiming);
+#else
+    (void)profileTiming;
+    fprintf(stderr, "--profile needs a build with the CLOX_PROFILE option.\n");
+    return 64;
+#endif
+  }
+
+#ifndef CLOX_PARALLEL_GC
+  if (gcThreads > 1) {
+    fprintf(stderr,
+            "--gc-threads needs a build with the CLOX_PARALLEL_GC option.\n");
+    return 64;
+  }
+#endif
+
+  VM *machine = newVM();
+  machine->optimizeCode = optimize;
+  // A .loxc file holds finished bytecode for every function, so with --cache
+  // everything is compiled up front.
+  machine->lazyCompile = lazy && !cache;
+  machine->gcThreads = gcThreads;
+  // newVM() has already allocated with the defaults. A cycle it left running
+  // picks the settings up when it ends.
+  machine->gcInitialHeap = initialHeap;
+  machine->gcGrowFactor = growFactor;
+  machine->gcMaxHeap = maxHeap;
+  if (machine->gcPhase == GC_IDLE && machine->nextGC < initialHeap) {
+    machine->nextGC = initialHeap;
+  }
 
-  if (argc == 1) {
-    repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
+  int status = 0;
+  if (path == NULL) {
+    repl(machine);
   } else {
-    fprintf(stderr, "Usage: clox [path]\n");
+    status = runFile(machine, path, cache);
   }
 
-  freeVM();
-  return 0;
+  if (stats) {
+    fflush(stdout);
+    printStats(machine);
+  }
+
+#ifdef CLOX_PROFILE
+  // Printed for scripts that stopped with an error too, that's often exactly
+  // the run someone wants to look at.
+  if (profile) {
+    fflush(stdout);
+    printProfile();
+    freeProfiler();
+  }
+#endif
+
+  freeVM(machine);
+  return status;
 }
@@ -0,0 +1,95 @@
+// mmap() and friends are POSIX, not C11
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mapfile.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Reads until EOF rather than trusting ftell(), so pipes work too.
+static bool readWholeFile(const char *path, MappedFile *file) {
+  FILE *handle = fopen(path, "rb");
+  if (handle == NULL) {
+    return false;
+  }
+
+  size_t capacity = 4096;
+  size_t size = 0;
+  char *buffer = NULL;
+  for (;;) {
+    char *grown = (char *)realloc(buffer, capacity + 1);
+    if (grown == NULL) {
+      break;
+    }
+    buffer = grown;
+    size += fread(buffer + size, sizeof(char), capacity - size, handle);
+    if (size < capacity) {
+      break;
+    }
+    capacity *= 2;
+  }
+
+  bool ok = buffer != NULL && size < capacity && !ferror(handle);
+  fclose(handle);
+  if (!ok) {
+    free(buffer);
+    return false;
+  }
+
+  buffer[size] = '\0';
+  file->data = buffer;
+  file->size = size;
+  file->mapped = false;
+  return true;
+}
+
+bool mapFile(const char *path, MappedFile *file) {
+#ifdef HAVE_MMAP
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat status;
+  if (fstat(fd, &status) == 0 && S_ISREG(status.st_mode) &&
+      status.st_size > 0) {
+    size_t size = (size_t)status.st_size;
+    // The rest of the last page reads as zeros, which gives the '\0' after
+    // the data for free. A file that ends exactly on a page boundary has
+    // nothing mapped after it, so that one is copied.
+    if (size % (size_t)sysconf(_SC_PAGESIZE) != 0) {
+      void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        close(fd);
+        file->data = (const char *)data;
+        file->size = size;
+        file->mapped = true;
+        return true;
+      }
+    }
+  }
+  close(fd);
+#endif
+
+  return readWholeFile(path, file);
+}
+
+void unmapFile(MappedFile *file) {
+#ifdef HAVE_MMAP
+  if (file->mapped) {
+    munmap((void *)file->data, file->size);
+    file->data = NULL;
+    return;
+  }
+#endif
+  free((void *)file->data);
+  file->data = NULL;
+}
@@ -0,0 +1,23 @@
+#ifndef clox_mapfile_h
+#define clox_mapfile_h
+
+#include "common.h"
+
+/*
+ * Read-only view of a whole file. Regular files are mmap()ed where the
+ * platform has it, so the scanner and the bytecode loader work straight off
+ * the page cache; anything else (pipes, other platforms, a failed mmap) is
+ * read into a malloc'd copy instead. Either way data[size] is '\0', which is
+ * what the scanner stops at.
+ */
+typedef struct {
+  const char *data;
+  size_t size;
+  bool mapped;
+} MappedFile;
+
+// Returns false if the file can't be opened or read.
+bool mapFile(const char *path, MappedFile *file);
+void unmapFile(MappedFile *file);
+
+#endif
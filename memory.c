@@ -1,6 +1,9 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
@@ -9,22 +12,134 @@
 
 #ifdef DEBUG_LOG_GC
 #include "debug.h"
-#include <stdio.h>
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+#ifdef CLOX_PARALLEL_GC
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <string.h>
+#endif
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
-  vm.bytesAllocated += newSize - oldSize;
+#ifdef CLOX_PARALLEL_GC
+// Below this heap size the threads cost more than they save, and the heap is
+// traced and swept on the VM's own thread.
+#ifndef PARALLEL_GC_MIN_BYTES
+#define PARALLEL_GC_MIN_BYTES (4 * 1024 * 1024)
+#endif
+// Gray objects a busy marker hands over at a time, and dead objects given
+// to each sweeper in turn.
+#define STEAL_BATCH 64
+#define SWEEP_BATCH 256
+
+struct MarkPool;
+
+/*
+ * One thread's share of a parallel mark or sweep. While marking, the gray
+ * objects it finds go on its private stack; when another marker has run out
+ * it moves a batch into "shared", where any idle marker can steal it. While
+ * sweeping, it frees the objects on its dead list and keeps what that hands
+ * back to itself, since reallocate() and the slab free lists belong to the
+ * VM's thread.
+ */
+typedef struct {
+  struct MarkPool *pool;
+  int index;
+  pthread_t thread;
+
+  Obj **items;
+  int count;
+  int capacity;
+  pthread_mutex_t lock;
+  Obj *shared[STEAL_BATCH];
+  atomic_int sharedCount;
+
+  Obj *dead;
+  size_t freedBytes;
+  void *freeLists[SLAB_CLASS_COUNT];
+  void *freeTails[SLAB_CLASS_COUNT];
+} GCWorker;
+
+typedef struct MarkPool {
+  VM *vm;
+  GCWorker *workers;
+  int count;
+  // Markers with nothing left to do. Marking is over once all of them are
+  // idle and no shared batch is left to steal.
+  atomic_int idle;
+} MarkPool;
+
+// Set on every thread taking part in a parallel phase, NULL otherwise.
+static _Thread_local GCWorker *gcWorker = NULL;
+#endif
 
-  if (newSize > oldSize) {
+// DEBUG_STRESS_GC collects the whole heap on every allocation and never
+// takes a step.
+#ifndef DEBUG_STRESS_GC
+static void gcStep();
+static void collectAll();
+#endif
+
+// Only growing pays for collection work. Frees also come through reallocate
+// from the sweeper itself, and starting a collection from inside the sweep
+// would walk a half-freed heap.
+static uint64_t gcClock() {
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static void collectOnAllocation() {
+  if (vm->bytesAllocated > vm->gcStats.peakBytes) {
+    vm->gcStats.peakBytes = vm->bytesAllocated;
+  }
+
+  // Over the limit a step isn't enough, only a full collection can tell
+  // whether the heap really needs that much, see collectAll().
+  bool overLimit = vm->gcMaxHeap > 0 && vm->bytesAllocated > vm->gcMaxHeap;
+#ifndef DEBUG_STRESS_GC
+  if (!overLimit && vm->gcPhase == GC_IDLE &&
+      vm->bytesAllocated <= vm->nextGC) {
+    return;
+  }
+#endif
+
+  uint64_t start = gcClock();
 #ifdef DEBUG_STRESS_GC
-    collectGarbage();
+  collectGarbage();
+#else
+  if (overLimit) {
+    collectAll();
+  } else {
+    gcStep();
+  }
 #endif
+  uint64_t pause = gcClock() - start;
+  vm->gcStats.pauseTotal += pause;
+  if (pause > vm->gcStats.pauseMax) {
+    vm->gcStats.pauseMax = pause;
   }
 
-  if (vm.bytesAllocated > vm.nextGC) {
-    collectGarbage();
+  if (overLimit && vm->bytesAllocated > vm->gcMaxHeap) {
+    fprintf(stderr, "Out of memory, the heap needs more than %zu bytes.\n",
+            vm->gcMaxHeap);
+    exit(1);
+  }
+}
+
+void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+#ifdef CLOX_PARALLEL_GC
+  // Only frees happen during a parallel sweep, from freeObject().
+  if (gcWorker != NULL) {
+    gcWorker->freedBytes += oldSize;
+    free(pointer);
+    return NULL;
+  }
+#endif
+  vm->bytesAllocated += newSize - oldSize;
+
+  if (newSize > oldSize) {
+    collectOnAllocation();
   }
 
   if (newSize == 0) {
@@ -38,10 +153,123 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
   return result;
 }
 
+static int slabClass(size_t size) {
+  if (size == 0 || size > SLAB_MAX_SIZE) {
+    return -1;
+  }
+  return (int)((size - 1) / SLAB_GRANULE);
+}
+
+static void newSlabPage(SlabClass *slab) {
+  // Page aligned, so a page never straddles more OS pages than it has to.
+  SlabPage *page = (SlabPage *)aligned_alloc(SLAB_PAGE_SIZE, SLAB_PAGE_SIZE);
+  if (page == NULL) {
+    exit(1);
+  }
+  page->next = slab->pages;
+  slab->pages = page;
+  // Slots start right past the header. Slot sizes are multiples of 8, so
+  // every object stays pointer aligned.
+  slab->bump = (char *)(page + 1);
+  slab->end = (char *)page + SLAB_PAGE_SIZE;
+}
+
+/*
+ * Memory for an Obj. Objects of the same size class are carved one after the
+ * other out of the same pages, and freed ones are reused before the bump
+ * pointer moves on, so the objects list stays mostly in address order and
+ * sweeping it touches few pages. bytesAllocated counts the slot size, which is
+ * what the object really occupies.
+ */
+void *allocateObjectMemory(size_t size) {
+  int index = slabClass(size);
+  if (index < 0) {
+    return reallocate(NULL, 0, size);
+  }
+
+  size_t slotSize = (size_t)(index + 1) * SLAB_GRANULE;
+  vm->bytesAllocated += slotSize;
+  // May sweep objects back onto the free list we are about to use.
+  collectOnAllocation();
+
+  SlabClass *slab = &vm->slabs[index];
+  if (slab->freeList != NULL) {
+    void *slot = slab->freeList;
+    slab->freeList = *(void **)slot;
+    return slot;
+  }
+
+  if (slab->bump == NULL || slab->bump + slotSize > slab->end) {
+    newSlabPage(slab);
+  }
+  void *slot = slab->bump;
+  slab->bump += slotSize;
+  return slot;
+}
+
+void freeObjectMemory(void *pointer, size_t size) {
+  int index = slabClass(size);
+  if (index < 0) {
+    reallocate(pointer, size, 0);
+    return;
+  }
+
+#ifdef CLOX_PARALLEL_GC
+  if (gcWorker != NULL) {
+    gcWorker->freedBytes += (size_t)(index + 1) * SLAB_GRANULE;
+    *(void **)pointer = gcWorker->freeLists[index];
+    if (gcWorker->freeLists[index] == NULL) {
+      gcWorker->freeTails[index] = pointer;
+    }
+    gcWorker->freeLists[index] = pointer;
+    return;
+  }
+#endif
+
+  vm->bytesAllocated -= (size_t)(index + 1) * SLAB_GRANULE;
+  SlabClass *slab = &vm->slabs[index];
+  *(void **)pointer = slab->freeList;
+  slab->freeList = pointer;
+}
+
+#ifdef CLOX_PARALLEL_GC
+static void growWorkerStack(GCWorker *worker, int needed) {
+  if (worker->capacity >= needed) {
+    return;
+  }
+  while (worker->capacity < needed) {
+    worker->capacity = GROW_CAPACITY(worker->capacity);
+  }
+  worker->items =
+      (Obj **)realloc(worker->items, sizeof(Obj *) * worker->capacity);
+  if (worker->items == NULL) {
+    exit(1);
+  }
+}
+
+// Other markers may reach the same object at the same time, whoever flips
+// isMarked first owns tracing it. isMarked is a plain bool everywhere else,
+// so this uses the GCC/Clang builtins rather than an _Atomic field.
+static void markShared(GCWorker *worker, Obj *object) {
+  if (__atomic_load_n(&object->isMarked, __ATOMIC_RELAXED) ||
+      __atomic_exchange_n(&object->isMarked, true, __ATOMIC_RELAXED)) {
+    return;
+  }
+  growWorkerStack(worker, worker->count + 1);
+  worker->items[worker->count++] = object;
+}
+#endif
+
 void markObject(Obj *object) {
   if (object == NULL) {
     return;
   }
+#ifdef CLOX_PARALLEL_GC
+  if (gcWorker != NULL) {
+    markShared(gcWorker, object);
+    return;
+  }
+#endif
   if (object->isMarked) {
     // We dont want to repeatedly add same objects to worklist
     return;
@@ -53,23 +281,23 @@ void markObject(Obj *object) {
 #endif
   object->isMarked = true;
 
-  if (vm.grayCapacity < vm.grayCount + 1) {
-    vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+  if (vm->grayCapacity < vm->grayCount + 1) {
+    vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
     /*
      * Note, we are using the std lib realloc instead of the wrapper
      * "reallocate" This is because, GC don't manage the grayStack.
      * If while dynamically allocating the grayStack, we will end up
      * calling GC again.
      */
-    vm.grayStack =
-        (Obj **)realloc(vm.grayStack, sizeof(Obj *) * vm.grayCapacity);
+    vm->grayStack =
+        (Obj **)realloc(vm->grayStack, sizeof(Obj *) * vm->grayCapacity);
 
-    if (vm.grayStack == NULL) {
+    if (vm->grayStack == NULL) {
       exit(1);
     }
   }
 
-  vm.grayStack[vm.grayCount++] = object;
+  vm->grayStack[vm->grayCount++] = object;
 }
 
 void markValue(Value value) {
@@ -100,13 +328,36 @@ static void blackenObject(Obj *object) {
   case OBJ_INSTANCE: {
     ObjInstance *instance = (ObjInstance *)object;
     markObject((Obj *)instance->klass);
-    markTable(&instance->fields);
+    if (instance->shape != NULL) {
+      markObject((Obj *)instance->shape);
+      for (int i = 0; i < instance->shape->fieldCount; i++) {
+        markValue(instance->fields[i]);
+      }
+    }
+    markTable(&instance->dictionary);
+    markObject((Obj *)instance->bound);
     break;
   }
   case OBJ_CLASS: {
     ObjClass *klass = (ObjClass *)object;
     markObject((Obj *)klass->name);
-    markTable(&klass->methods);
+    // Shared methods are marked through the superclass that owns them.
+    markObject((Obj *)klass->superclass);
+    if (klass->ownsMethods) {
+      markTable(&klass->methods);
+    }
+    if (klass->ownsVtable) {
+      markArray(&klass->vtable);
+    }
+    markObject((Obj *)klass->rootShape);
+    break;
+  }
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    markObject((Obj *)shape->parent);
+    markObject((Obj *)shape->name);
+    markTable(&shape->slots);
+    markTable(&shape->transitions);
     break;
   }
   case OBJ_CLOSURE: {
@@ -120,14 +371,50 @@ static void blackenObject(Obj *object) {
   case OBJ_FUNCTION: {
     ObjFunction *function = (ObjFunction *)object;
     markObject((Obj *)function->name);
+    markObject((Obj *)function->closure);
+    if (function->lazy != NULL) {
+      for (int i = 0; i < function->upvalueCount; i++) {
+        markObject((Obj *)function->lazy->upvalueNames[i]);
+      }
+    }
     markArray(&function->chunk.constants);
+    // Cached classes and methods are kept alive for as long as the code that
+    // may hit on them.
+    for (int i = 0; i < function->chunk.cacheCount; i++) {
+      InlineCache *cache = &function->chunk.caches[i];
+      for (int j = 0; j < cache->count; j++) {
+        markObject((Obj *)cache->entries[j].shape);
+        markObject((Obj *)cache->entries[j].transition);
+        markValue(cache->entries[j].method);
+      }
+    }
     break;
   }
   // Value not in stack, but moved to upvalue
   case OBJ_UPVALUE:
     markValue(((ObjUpvalue *)object)->closed);
     break;
+  case OBJ_ROPE: {
+    ObjRope *rope = (ObjRope *)object;
+    markObject(rope->left);
+    markObject(rope->right);
+    markObject((Obj *)rope->flat);
+    break;
+  }
   case OBJ_NATIVE:
+    markObject((Obj *)((ObjNative *)object)->name);
+    break;
+  case OBJ_LIST:
+    markArray(&((ObjList *)object)->items);
+    break;
+  case OBJ_MAP: {
+    ObjMap *map = (ObjMap *)object;
+    for (int i = 0; i < map->entryCount; i++) {
+      markValue(map->entries[i].key);
+      markValue(map->entries[i].value);
+    }
+    break;
+  }
   case OBJ_STRING:
     break;
   }
@@ -140,119 +427,393 @@ static void freeObject(Obj *object) {
 
   switch (object->type) {
   case OBJ_BOUND_METHOD: {
-    FREE(ObjBoundMethod, object);
+    FREE_OBJ(ObjBoundMethod, object);
     break;
   }
   case OBJ_INSTANCE: {
     ObjInstance *instance = (ObjInstance *)object;
-    freeTable(&instance->fields);
-    FREE(ObjInstance, object);
+    FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+    freeTable(&instance->dictionary);
+    FREE_OBJ(ObjInstance, object);
+    break;
+  }
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    freeTable(&shape->slots);
+    freeTable(&shape->transitions);
+    FREE_OBJ(ObjShape, object);
     break;
   }
   case OBJ_CLASS: {
     ObjClass *klass = (ObjClass *)object;
-    freeTable(&klass->methods);
-    FREE(ObjClass, object);
+    if (klass->ownsMethods) {
+      freeTable(&klass->methods);
+    }
+    if (klass->ownsVtable) {
+      freeValueArray(&klass->vtable);
+    }
+    FREE_OBJ(ObjClass, object);
     break;
   }
   case OBJ_CLOSURE: {
     ObjClosure *closure = (ObjClosure *)object;
-    FREE_ARRAY(ObjClosure *, closure->upvalues, closure->upvalueCount);
-    FREE(ObjClosure, object);
+    freeObjectMemory(object, sizeof(ObjClosure) + sizeof(ObjUpvalue *) *
+                                                      closure->upvalueCount);
     break;
   }
   case OBJ_UPVALUE: {
-    FREE(ObjUpvalue, object);
+    FREE_OBJ(ObjUpvalue, object);
     break;
   }
   case OBJ_FUNCTION: {
     ObjFunction *function = (ObjFunction *)object;
     freeChunk(&function->chunk);
-    FREE(ObjFunction, object);
+    if (function->lazy != NULL) {
+      freeLazyBody(function->lazy, function->upvalueCount);
+    }
+#ifdef CLOX_JIT
+    freeJitCode(function->jit);
+#endif
+    FREE_OBJ(ObjFunction, object);
     break;
   }
   case OBJ_NATIVE: {
-    FREE(ObjNative, object);
+    FREE_OBJ(ObjNative, object);
+    break;
+  }
+  case OBJ_ROPE: {
+    FREE_OBJ(ObjRope, object);
+    break;
+  }
+  case OBJ_LIST: {
+    freeValueArray(&((ObjList *)object)->items);
+    FREE_OBJ(ObjList, object);
+    break;
+  }
+  case OBJ_MAP: {
+    ObjMap *map = (ObjMap *)object;
+    FREE_ARRAY(MapEntry, map->entries, map->entryCapacity);
+    FREE_ARRAY(int32_t, map->index, map->indexCapacity);
+    FREE_OBJ(ObjMap, object);
     break;
   }
   case OBJ_STRING: {
     ObjString *string = (ObjString *)object;
-    // Free the Dynamic String array
-    FREE_ARRAY(char, string->chars, string->length + 1);
-    // Free the ObjString struct
-    FREE(ObjString, object);
+    // The characters are part of the same allocation
+    freeObjectMemory(object, sizeof(ObjString) + (size_t)string->length + 1);
     break;
   }
   }
 }
 
+// Frees an object the sweep found dead, on the VM's thread. freeObject()
+// never allocates, so the drop in bytesAllocated is exactly its size.
+static void freeGarbage(Obj *object) {
+  size_t before = vm->bytesAllocated;
+  freeObject(object);
+  vm->gcStats.bytesFreed += before - vm->bytesAllocated;
+}
+
 static void markRoots() {
   // Stack Values
-  for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+  for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
     markValue(*slot);
   }
 
   // initString
-  markObject((Obj *)vm.initString);
+  markObject((Obj *)vm->initString);
 
   // Closures
-  for (int i = 0; i < vm.frameCount; i++) {
-    markObject((Obj *)vm.frames[i].closure);
+  for (int i = 0; i < vm->frameCount; i++) {
+    markObject((Obj *)vm->frames[i].closure);
   }
 
   // Upvalues, there are open upvalues, already closed "upvalues"
   // objects in closure upvalue array are indirect references of
   // closure. They are not direct "roots"
-  for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL;
-       upvalue = upvalue->next) {
-    markObject((Obj *)upvalue);
+  for (int i = 0; i < vm->frameCount; i++) {
+    for (ObjUpvalue *upvalue = vm->frames[i].openUpvalues; upvalue != NULL;
+         upvalue = upvalue->next) {
+      markObject((Obj *)upvalue);
+    }
   }
 
-  // Global table
-  markTable(&vm.globals);
+  // Globals, names and values live in parallel arrays indexed by slot
+  markTable(&vm->globalSlots);
+  markArray(&vm->globalNames);
+  markArray(&vm->globalValues);
 
   // Compiler related objects (function obj, and its enclosings)
   markCompilerRoots();
 }
 
-static void traceReferences() {
-  while (vm.grayCount > 0) {
-    Obj *object = vm.grayStack[--vm.grayCount];
-    // mark the current object black, then traces other references, and adds it
-    // to grayStack/worklist.
-    blackenObject(object);
+#ifdef CLOX_PARALLEL_GC
+// Moves a batch to where idle markers can take it, if one is waiting and the
+// last batch has been taken.
+static void shareWork(GCWorker *worker) {
+  if (worker->count <= STEAL_BATCH ||
+      atomic_load_explicit(&worker->pool->idle, memory_order_relaxed) == 0 ||
+      atomic_load_explicit(&worker->sharedCount, memory_order_relaxed) != 0) {
+    return;
   }
+
+  pthread_mutex_lock(&worker->lock);
+  if (atomic_load(&worker->sharedCount) == 0) {
+    worker->count -= STEAL_BATCH;
+    memcpy(worker->shared, worker->items + worker->count,
+           sizeof(Obj *) * STEAL_BATCH);
+    atomic_store(&worker->sharedCount, STEAL_BATCH);
+  }
+  pthread_mutex_unlock(&worker->lock);
 }
 
-static void sweep() {
-  Obj *prev = NULL;
-  Obj *object = vm.objects;
-  while (object != NULL) {
+static bool takeShared(GCWorker *worker, GCWorker *victim) {
+  pthread_mutex_lock(&victim->lock);
+  int taken = atomic_load(&victim->sharedCount);
+  if (taken > 0) {
+    growWorkerStack(worker, worker->count + taken);
+    memcpy(worker->items + worker->count, victim->shared,
+           sizeof(Obj *) * taken);
+    worker->count += taken;
+    atomic_store(&victim->sharedCount, 0);
+  }
+  pthread_mutex_unlock(&victim->lock);
+  return taken > 0;
+}
+
+/*
+ * Called once the worker's own stack is empty. Returns false when marking is
+ * done. A marker only counts as idle while it holds no gray objects, and it
+ * stops being idle before it takes a batch, so once every marker is idle and
+ * nothing is shared there is no work left anywhere.
+ */
+static bool stealWork(GCWorker *worker) {
+  MarkPool *pool = worker->pool;
+  atomic_fetch_add(&pool->idle, 1);
+  for (;;) {
+    bool sharing = false;
+    for (int i = 0; i < pool->count; i++) {
+      GCWorker *victim = &pool->workers[(worker->index + i) % pool->count];
+      if (atomic_load(&victim->sharedCount) == 0) {
+        continue;
+      }
+      sharing = true;
+      atomic_fetch_sub(&pool->idle, 1);
+      if (takeShared(worker, victim)) {
+        return true;
+      }
+      atomic_fetch_add(&pool->idle, 1);
+    }
+
+    if (!sharing && atomic_load(&pool->idle) == pool->count) {
+      return false;
+    }
+    sched_yield();
+  }
+}
+
+static void drainWorker(GCWorker *worker) {
+  do {
+    while (worker->count > 0) {
+      blackenObject(worker->items[--worker->count]);
+      shareWork(worker);
+    }
+  } while (stealWork(worker));
+}
+
+static void *markThread(void *argument) {
+  GCWorker *worker = (GCWorker *)argument;
+  // Only read from here, the mark bits are all this thread writes.
+  vm = worker->pool->vm;
+  gcWorker = worker;
+  drainWorker(worker);
+  gcWorker = NULL;
+  return NULL;
+}
+
+static void *sweepThread(void *argument) {
+  GCWorker *worker = (GCWorker *)argument;
+  vm = worker->pool->vm;
+  gcWorker = worker;
+  while (worker->dead != NULL) {
+    Obj *next = worker->dead->next;
+    freeObject(worker->dead);
+    worker->dead = next;
+  }
+  gcWorker = NULL;
+  return NULL;
+}
+
+static void initPool(MarkPool *pool) {
+  pool->vm = vm;
+  pool->count = vm->gcThreads;
+  pool->workers = (GCWorker *)calloc(pool->count, sizeof(GCWorker));
+  if (pool->workers == NULL) {
+    exit(1);
+  }
+  atomic_init(&pool->idle, 0);
+  for (int i = 0; i < pool->count; i++) {
+    GCWorker *worker = &pool->workers[i];
+    worker->pool = pool;
+    worker->index = i;
+    pthread_mutex_init(&worker->lock, NULL);
+    atomic_init(&worker->sharedCount, 0);
+  }
+}
+
+// Runs the phase on worker 0 here and the rest on new threads, then waits for
+// them. A thread that can't be started is simply counted as idle.
+static void runPool(MarkPool *pool, void *(*phase)(void *)) {
+  for (int i = 1; i < pool->count; i++) {
+    GCWorker *worker = &pool->workers[i];
+    if (pthread_create(&worker->thread, NULL, phase, worker) != 0) {
+      worker->thread = pthread_self();
+      atomic_fetch_add(&pool->idle, 1);
+    }
+  }
+
+  VM *owner = vm;
+  phase(&pool->workers[0]);
+  vm = owner;
+
+  for (int i = 1; i < pool->count; i++) {
+    if (!pthread_equal(pool->workers[i].thread, pthread_self())) {
+      pthread_join(pool->workers[i].thread, NULL);
+    }
+  }
+}
+
+static void freePool(MarkPool *pool) {
+  for (int i = 0; i < pool->count; i++) {
+    pthread_mutex_destroy(&pool->workers[i].lock);
+    free(pool->workers[i].items);
+  }
+  free(pool->workers);
+}
+
+// The gray stack becomes the first marker's stack; the others start empty and
+// steal from it.
+static void traceParallel() {
+  MarkPool pool;
+  initPool(&pool);
+  GCWorker *first = &pool.workers[0];
+  first->items = vm->grayStack;
+  first->count = vm->grayCount;
+  first->capacity = vm->grayCapacity;
+
+  runPool(&pool, markThread);
+
+  vm->grayStack = first->items;
+  vm->grayCapacity = first->capacity;
+  vm->grayCount = 0;
+  first->items = NULL;
+  freePool(&pool);
+}
+
+/*
+ * Sweeps the whole list at once. Walking it stays on this thread, it's one
+ * chain of pointers and the live objects have to be relinked in order anyway.
+ * Freeing the dead ones, where the time goes, is dealt out in batches to all
+ * the threads; their freed slots and bytes are handed back to the VM after.
+ */
+static void sweepParallel() {
+  MarkPool pool;
+  initPool(&pool);
+
+  int next = 0;
+  int batch = 0;
+  while (vm->sweepList != NULL) {
+    Obj *object = vm->sweepList;
+    vm->sweepList = object->next;
     if (object->isMarked) {
-      // make these obj white for the GC cycle
       object->isMarked = false;
-      prev = object;
-      object = object->next;
+      object->next = vm->objects;
+      vm->objects = object;
     } else {
-      Obj *unreached = object;
-      object = object->next;
-      if (prev != NULL) {
-        prev->next = object;
-      } else {
-        vm.objects = object;
+      GCWorker *worker = &pool.workers[next];
+      object->next = worker->dead;
+      worker->dead = object;
+      if (++batch == SWEEP_BATCH) {
+        batch = 0;
+        next = (next + 1) % pool.count;
       }
+    }
+  }
+
+  runPool(&pool, sweepThread);
 
-      freeObject(unreached);
+  for (int i = 0; i < pool.count; i++) {
+    GCWorker *worker = &pool.workers[i];
+    // A thread that never started left its share for us.
+    while (worker->dead != NULL) {
+      Obj *object = worker->dead;
+      worker->dead = object->next;
+      freeGarbage(object);
+    }
+    vm->bytesAllocated -= worker->freedBytes;
+    vm->gcStats.bytesFreed += worker->freedBytes;
+    for (int j = 0; j < SLAB_CLASS_COUNT; j++) {
+      if (worker->freeLists[j] != NULL) {
+        *(void **)worker->freeTails[j] = vm->slabs[j].freeList;
+        vm->slabs[j].freeList = worker->freeLists[j];
+      }
     }
   }
+  freePool(&pool);
 }
 
-void collectGarbage() {
+static bool useParallelGC() {
+  return vm->gcThreads > 1 && vm->bytesAllocated >= PARALLEL_GC_MIN_BYTES;
+}
+#endif
+
+static void traceReferences() {
+#ifdef CLOX_PARALLEL_GC
+  if (useParallelGC()) {
+    traceParallel();
+    return;
+  }
+#endif
+  while (vm->grayCount > 0) {
+    Obj *object = vm->grayStack[--vm->grayCount];
+    // mark the current object black, then traces other references, and adds it
+    // to grayStack/worklist.
+    blackenObject(object);
+  }
+}
+
+static void beginCycle() {
 #ifdef DEBUG_LOG_GC
   printf("-- gc begin\n");
-  size_t before = vm.bytesAllocated;
+  vm->cycleStartBytes = vm->bytesAllocated;
 #endif
 
+  vm->gcPhase = GC_MARK;
+  markRoots();
+}
+
+#ifndef DEBUG_STRESS_GC
+// Blackens up to "budget" gray objects, returns false once the gray stack is
+// empty and marking can be finished.
+static bool markStep(int budget) {
+  while (vm->grayCount > 0) {
+    if (budget-- <= 0) {
+      return true;
+    }
+    blackenObject(vm->grayStack[--vm->grayCount]);
+  }
+  return false;
+}
+#endif
+
+static void finishMark() {
+  /*
+   * The mutator changed the stack, globals and open upvalues without any
+   * barrier while we were marking, and everything allocated since the cycle
+   * began is still white. Scan the roots again and trace to completion; this
+   * is the one atomic part of a cycle and only covers what changed since it
+   * started.
+   */
   markRoots();
   traceReferences();
   /*
@@ -264,24 +825,154 @@ void collectGarbage() {
    * marked string, we can scan the table and deleted the ones that are marked
    * false.
    */
-  tableRemoveWhite(&vm.strings);
-  sweep();
+  tableRemoveWhite(&vm->strings);
+
+  // From here on new objects go to a fresh list, the sweeper only walks what
+  // existed when marking ended.
+  vm->sweepList = vm->objects;
+  vm->objects = NULL;
+  vm->gcPhase = GC_SWEEP;
+}
 
-  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+// Sweeps up to "budget" objects, returns false once the list is exhausted.
+static bool sweepStep(int budget) {
+  while (vm->sweepList != NULL) {
+    if (budget-- <= 0) {
+      return true;
+    }
+
+    Obj *object = vm->sweepList;
+    vm->sweepList = object->next;
+    if (object->isMarked) {
+      // make these obj white for the GC cycle
+      object->isMarked = false;
+      object->next = vm->objects;
+      vm->objects = object;
+    } else {
+      freeGarbage(object);
+    }
+  }
+  return false;
+}
+
+static void endCycle() {
+  vm->gcPhase = GC_IDLE;
+  vm->gcStats.cycles++;
+  vm->nextGC = (size_t)((double)vm->bytesAllocated * vm->gcGrowFactor);
+  if (vm->nextGC < vm->gcInitialHeap) {
+    vm->nextGC = vm->gcInitialHeap;
+  }
+  // Starting before the limit gives the increments a chance to keep under it.
+  if (vm->gcMaxHeap > 0 && vm->nextGC > vm->gcMaxHeap) {
+    vm->nextGC = vm->gcMaxHeap;
+  }
 #ifdef DEBUG_LOG_GC
   printf("-- gc end\n");
   printf("    collected %zu bytes (from %zu to %zu) next GC at %zu\n",
-         before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+         vm->cycleStartBytes - vm->bytesAllocated, vm->cycleStartBytes,
+         vm->bytesAllocated, vm->nextGC);
 #endif
 }
 
-void freeObjects() {
-  Obj *object = vm.objects;
+#ifndef DEBUG_STRESS_GC
+// One increment of work, called from allocations.
+static void gcStep() {
+  if (vm->gcStepSize <= 0) {
+    collectGarbage();
+    return;
+  }
+
+  switch (vm->gcPhase) {
+  case GC_IDLE:
+    beginCycle();
+    break;
+  case GC_MARK:
+    if (!markStep(vm->gcStepSize)) {
+      finishMark();
+    }
+    break;
+  case GC_SWEEP:
+    if (!sweepStep(vm->gcStepSize)) {
+      endCycle();
+    }
+    break;
+  }
+}
+#endif
+
+// Runs a collection to completion, finishing off any cycle in progress.
+void collectGarbage() {
+  if (vm->gcPhase == GC_IDLE) {
+    beginCycle();
+  }
+  if (vm->gcPhase == GC_MARK) {
+    traceReferences();
+    finishMark();
+  }
+#ifdef CLOX_PARALLEL_GC
+  if (useParallelGC()) {
+    sweepParallel();
+  }
+#endif
+  sweepStep(INT32_MAX);
+  endCycle();
+}
+
+#ifndef DEBUG_STRESS_GC
+/*
+ * Frees everything that is unreachable right now. A cycle already under way
+ * keeps whatever was reachable when it began marking, and everything it
+ * allocated since once marking is over, so finishing it is not enough: a
+ * second, complete cycle runs after it.
+ */
+static void collectAll() {
+  bool running = vm->gcPhase != GC_IDLE;
+  collectGarbage();
+  if (running) {
+    collectGarbage();
+  }
+}
+#endif
+
+void countObjects(int counts[OBJ_TYPE_COUNT]) {
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    counts[i] = 0;
+  }
+  for (Obj *object = vm->objects; object != NULL; object = object->next) {
+    counts[object->type]++;
+  }
+  // Whatever the sweep hasn't reached yet survives only if it was marked.
+  for (Obj *object = vm->sweepList; object != NULL; object = object->next) {
+    if (object->isMarked) {
+      counts[object->type]++;
+    }
+  }
+}
+
+static void freeList(Obj *object) {
   while (object != NULL) {
     Obj *next = object->next;
     freeObject(object);
     object = next;
   }
+}
+
+void freeObjects() {
+  freeList(vm->objects);
+  freeList(vm->sweepList);
+  vm->objects = NULL;
+  vm->sweepList = NULL;
+
+  // Every slot is free now, hand the pages back.
+  for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+    SlabPage *page = vm->slabs[i].pages;
+    while (page != NULL) {
+      SlabPage *next = page->next;
+      free(page);
+      page = next;
+    }
+    vm->slabs[i] = (SlabClass){NULL, NULL, NULL, NULL};
+  }
 
-  free(vm.grayStack);
+  free(vm->grayStack);
 }
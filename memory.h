@@ -19,10 +19,44 @@
 #define FREE_ARRAY(type, pointer, oldCount)                                    \
   reallocate(pointer, sizeof(type) * oldCount, 0)
 
+#define FREE_OBJ(type, pointer) freeObjectMemory(pointer, sizeof(type))
+
+// Objects the incremental collector traces or sweeps per allocation, once a
+// cycle is running. Zero keeps the old stop-the-world collector.
+#ifndef GC_STEP_SIZE
+#define GC_STEP_SIZE 256
+#endif
+
+// Defaults for VM.gcInitialHeap and VM.gcGrowFactor
+#define GC_INITIAL_HEAP 1024
+#define GC_HEAP_GROW_FACTOR 2
+
+// Upper bound for VM.gcThreads
+#define GC_THREADS_MAX 64
+
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+void *allocateObjectMemory(size_t size);
+void freeObjectMemory(void *pointer, size_t size);
 void markValue(Value value);
 void markObject(Obj *object);
 void collectGarbage();
 void freeObjects();
+// Live objects of each ObjType. While a sweep is running the garbage it has
+// yet to free is left out.
+void countObjects(int counts[OBJ_TYPE_COUNT]);
+
+/*
+ * Write barrier for the incremental marker. While a cycle is marking, an
+ * object the collector has already blackened won't be looked at again, so a
+ * reference stored into it afterwards would never be traced. Every store of a
+ * reference into a heap object (fields, tables, upvalues, caches, constants)
+ * has to go through here. Stores into the stack and globals don't need it,
+ * those are roots and get scanned again before the sweep.
+ */
+static inline void writeBarrier(Value value) {
+  if (vm->gcPhase == GC_MARK) {
+    markValue(value);
+  }
+}
 
 #endif
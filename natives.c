@@ -0,0 +1,559 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mapfile.h"
+#include "memory.h"
+#include "natives.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+/*
+ * Every native gets its arguments in args and stores what it returns in
+ * *result. The arguments are still on the VM stack, so natives may allocate
+ * while they hold on to them. *result is the stack slot of the callee, an
+ * object stored there is just as safe while the native goes on allocating.
+ * On bad input a native reports the error with runtimeError() and returns
+ * false.
+ */
+
+// Ropes are flattened in place, args is part of the stack and keeps the
+// flat string reachable.
+static bool stringArg(const char *native, Value *args, int index,
+                      ObjString **string) {
+  if (IS_ROPE(args[index])) {
+    args[index] = OBJ_VAL(flattenRope(AS_ROPE(args[index])));
+  }
+  if (!IS_STRING(args[index])) {
+    runtimeError("%s() expects a string.", native);
+    return false;
+  }
+  *string = AS_STRING(args[index]);
+  return true;
+}
+
+static bool numberArg(const char *native, Value *args, int index,
+                      double *number) {
+  if (!IS_NUMBER(args[index])) {
+    runtimeError("%s() expects a number.", native);
+    return false;
+  }
+  *number = AS_NUMBER(args[index]);
+  return true;
+}
+
+static bool listArg(const char *native, Value *args, int index,
+                    ObjList **list) {
+  if (!IS_LIST(args[index])) {
+    runtimeError("%s() expects a list.", native);
+    return false;
+  }
+  *list = AS_LIST(args[index]);
+  return true;
+}
+
+static bool mapArg(const char *native, Value *args, int index,
+                   ObjMap **map) {
+  if (!IS_MAP(args[index])) {
+    runtimeError("%s() expects a map.", native);
+    return false;
+  }
+  *map = AS_MAP(args[index]);
+  return true;
+}
+
+// Any value can be a key, only ropes need flattening first.
+static Value keyArg(Value *args, int index) {
+  if (IS_ROPE(args[index])) {
+    args[index] = OBJ_VAL(flattenRope(AS_ROPE(args[index])));
+  }
+  return args[index];
+}
+
+static bool clockNative(int argCount, Value *args, Value *result) {
+  *result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+  return true;
+}
+
+static bool lenNative(int argCount, Value *args, Value *result) {
+  Value value = args[0];
+  if (IS_STRING(value)) {
+    *result = NUMBER_VAL(AS_STRING(value)->length);
+  } else if (IS_ROPE(value)) {
+    *result = NUMBER_VAL(AS_ROPE(value)->length);
+  } else if (IS_LIST(value)) {
+    *result = NUMBER_VAL(AS_LIST(value)->items.count);
+  } else if (IS_MAP(value)) {
+    *result = NUMBER_VAL(AS_MAP(value)->count);
+  } else {
+    runtimeError("len() expects a string, list or map.");
+    return false;
+  }
+  return true;
+}
+
+static bool substringNative(int argCount, Value *args, Value *result) {
+  ObjString *string;
+  double start, end;
+  if (!stringArg("substring", args, 0, &string) ||
+      !numberArg("substring", args, 1, &start) ||
+      !numberArg("substring", args, 2, &end)) {
+    return false;
+  }
+  if (start != floor(start) || end != floor(end) || start < 0 ||
+      end < start || end > string->length) {
+    runtimeError("substring() range [%g, %g) is out of bounds.", start, end);
+    return false;
+  }
+
+  *result = OBJ_VAL(
+      copyString(string->chars + (int)start, (int)end - (int)start));
+  return true;
+}
+
+// First needle in [start, end), or NULL. needle isn't empty. memchr() skips
+// to candidates for the first char, only those get compared.
+static const char *findText(const char *start, const char *end,
+                            ObjString *needle) {
+  if (end - start < needle->length) {
+    return NULL;
+  }
+  const char *last = end - needle->length;
+  for (const char *at = start; at <= last; at++) {
+    at = memchr(at, needle->chars[0], (size_t)(last - at) + 1);
+    if (at == NULL) {
+      break;
+    }
+    if (memcmp(at, needle->chars, needle->length) == 0) {
+      return at;
+    }
+  }
+  return NULL;
+}
+
+static bool findNative(int argCount, Value *args, Value *result) {
+  ObjString *string;
+  ObjString *needle;
+  if (!stringArg("find", args, 0, &string) ||
+      !stringArg("find", args, 1, &needle)) {
+    return false;
+  }
+
+  if (needle->length == 0) {
+    *result = NUMBER_VAL(0);
+    return true;
+  }
+  const char *at =
+      findText(string->chars, string->chars + string->length, needle);
+  *result = NUMBER_VAL(at == NULL ? -1 : at - string->chars);
+  return true;
+}
+
+static bool splitNative(int argCount, Value *args, Value *result) {
+  ObjString *string;
+  ObjString *separator;
+  if (!stringArg("split", args, 0, &string) ||
+      !stringArg("split", args, 1, &separator)) {
+    return false;
+  }
+
+  ObjList *list = newList(NULL, 0);
+  *result = OBJ_VAL(list);
+  const char *start = string->chars;
+  const char *end = string->chars + string->length;
+  // An empty separator splits into single characters.
+  if (separator->length == 0) {
+    for (const char *at = start; at < end; at++) {
+      appendToList(list, OBJ_VAL(copyString(at, 1)));
+    }
+    return true;
+  }
+
+  for (;;) {
+    const char *at = findText(start, end, separator);
+    const char *pieceEnd = at == NULL ? end : at;
+    appendToList(list, OBJ_VAL(copyString(start, (int)(pieceEnd - start))));
+    if (at == NULL) {
+      return true;
+    }
+    start = at + separator->length;
+  }
+}
+
+static bool joinNative(int argCount, Value *args, Value *result) {
+  ObjList *list;
+  ObjString *separator;
+  if (!listArg("join", args, 0, &list) ||
+      !stringArg("join", args, 1, &separator)) {
+    return false;
+  }
+
+  size_t length = 0;
+  for (int i = 0; i < list->items.count; i++) {
+    Value item = list->items.values[i];
+    if (IS_ROPE(item)) {
+      length += (size_t)flattenRope(AS_ROPE(item))->length;
+    } else if (IS_STRING(item)) {
+      length += (size_t)AS_STRING(item)->length;
+    } else {
+      runtimeError("join() expects a list of strings.");
+      return false;
+    }
+    if (i > 0) {
+      length += (size_t)separator->length;
+    }
+  }
+  if (length > INT32_MAX) {
+    runtimeError("join() result is too long.");
+    return false;
+  }
+
+  // The ropes are flat now and keep their flat strings.
+  ObjString *joined = newString((int)length);
+  char *at = joined->chars;
+  for (int i = 0; i < list->items.count; i++) {
+    Value item = list->items.values[i];
+    ObjString *piece =
+        IS_ROPE(item) ? AS_ROPE(item)->flat : AS_STRING(item);
+    if (i > 0) {
+      memcpy(at, separator->chars, separator->length);
+      at += separator->length;
+    }
+    memcpy(at, piece->chars, piece->length);
+    at += piece->length;
+  }
+  *at = '\0';
+  *result = OBJ_VAL(internString(joined));
+  return true;
+}
+
+static bool strNative(int argCount, Value *args, Value *result) {
+  Value value = args[0];
+  if (IS_STRING(value) || IS_ROPE(value)) {
+    *result = value;
+    return true;
+  }
+
+  char buffer[32];
+  int length;
+  if (IS_NUMBER(value)) {
+    // The same format print uses.
+    length = snprintf(buffer, sizeof(buffer), "%g", AS_NUMBER(value));
+  } else if (IS_BOOL(value)) {
+    length = snprintf(buffer, sizeof(buffer), "%s",
+                      AS_BOOL(value) ? "true" : "false");
+  } else if (IS_NIL(value)) {
+    length = snprintf(buffer, sizeof(buffer), "nil");
+  } else {
+    runtimeError("str() expects a number, bool, nil or string.");
+    return false;
+  }
+  *result = OBJ_VAL(copyString(buffer, length));
+  return true;
+}
+
+static bool numberNative(int argCount, Value *args, Value *result) {
+  ObjString *string;
+  if (!stringArg("number", args, 0, &string)) {
+    return false;
+  }
+
+  char *end;
+  double number = strtod(string->chars, &end);
+  bool parsed = string->length > 0 && end == string->chars + string->length;
+  *result = parsed ? NUMBER_VAL(number) : NIL_VAL;
+  return true;
+}
+
+#define MATH_NATIVE(name, function)                                            \
+  static bool name##Native(int argCount, Value *args, Value *result) {         \
+    double x;                                                                  \
+    if (!numberArg(#name, args, 0, &x)) {                                      \
+      return false;                                                            \
+    }                                                                          \
+    *result = NUMBER_VAL(function(x));                                         \
+    return true;                                                               \
+  }
+
+MATH_NATIVE(abs, fabs)
+MATH_NATIVE(floor, floor)
+MATH_NATIVE(ceil, ceil)
+MATH_NATIVE(sqrt, sqrt)
+MATH_NATIVE(exp, exp)
+MATH_NATIVE(log, log)
+MATH_NATIVE(sin, sin)
+MATH_NATIVE(cos, cos)
+
+#undef MATH_NATIVE
+
+static bool powNative(int argCount, Value *args, Value *result) {
+  double x, y;
+  if (!numberArg("pow", args, 0, &x) || !numberArg("pow", args, 1, &y)) {
+    return false;
+  }
+  *result = NUMBER_VAL(pow(x, y));
+  return true;
+}
+
+static bool minNative(int argCount, Value *args, Value *result) {
+  double x, y;
+  if (!numberArg("min", args, 0, &x) || !numberArg("min", args, 1, &y)) {
+    return false;
+  }
+  *result = NUMBER_VAL(y < x ? y : x);
+  return true;
+}
+
+static bool maxNative(int argCount, Value *args, Value *result) {
+  double x, y;
+  if (!numberArg("max", args, 0, &x) || !numberArg("max", args, 1, &y)) {
+    return false;
+  }
+  *result = NUMBER_VAL(y > x ? y : x);
+  return true;
+}
+
+static bool pushNative(int argCount, Value *args, Value *result) {
+  ObjList *list;
+  if (!listArg("push", args, 0, &list)) {
+    return false;
+  }
+  appendToList(list, args[1]);
+  *result = NIL_VAL;
+  return true;
+}
+
+static bool popNative(int argCount, Value *args, Value *result) {
+  ObjList *list;
+  if (!listArg("pop", args, 0, &list)) {
+    return false;
+  }
+  if (list->items.count == 0) {
+    runtimeError("pop() from an empty list.");
+    return false;
+  }
+  *result = list->items.values[--list->items.count];
+  return true;
+}
+
+static bool hasNative(int argCount, Value *args, Value *result) {
+  ObjMap *map;
+  if (!mapArg("has", args, 0, &map)) {
+    return false;
+  }
+  Value value;
+  *result = BOOL_VAL(mapGet(map, keyArg(args, 1), &value));
+  return true;
+}
+
+static bool removeNative(int argCount, Value *args, Value *result) {
+  ObjMap *map;
+  if (!mapArg("remove", args, 0, &map)) {
+    return false;
+  }
+  *result = BOOL_VAL(mapDelete(map, keyArg(args, 1)));
+  return true;
+}
+
+static bool keysNative(int argCount, Value *args, Value *result) {
+  ObjMap *map;
+  if (!mapArg("keys", args, 0, &map)) {
+    return false;
+  }
+
+  ObjList *list = newList(NULL, 0);
+  *result = OBJ_VAL(list);
+  for (int i = 0; i < map->entryCount; i++) {
+    if (!IS_UNDEFINED(map->entries[i].key)) {
+      appendToList(list, map->entries[i].key);
+    }
+  }
+  return true;
+}
+
+static bool readFileNative(int argCount, Value *args, Value *result) {
+  ObjString *path;
+  if (!stringArg("readFile", args, 0, &path)) {
+    return false;
+  }
+
+  MappedFile file;
+  if (!mapFile(path->chars, &file)) {
+    *result = NIL_VAL;
+    return true;
+  }
+  if (file.size > INT32_MAX) {
+    unmapFile(&file);
+    runtimeError("readFile() can't read \"%s\", it is too big.", path->chars);
+    return false;
+  }
+  // Mapped files are read straight into the string, no stdio buffer between.
+  *result = OBJ_VAL(copyString(file.data, (int)file.size));
+  unmapFile(&file);
+  return true;
+}
+
+static bool writeText(const char *native, Value *args, const char *mode,
+                      Value *result) {
+  ObjString *path;
+  ObjString *text;
+  if (!stringArg(native, args, 0, &path) ||
+      !stringArg(native, args, 1, &text)) {
+    return false;
+  }
+
+  FILE *file = fopen(path->chars, mode);
+  bool written = false;
+  if (file != NULL) {
+    written = fwrite(text->chars, 1, text->length, file) ==
+              (size_t)text->length;
+    written = fclose(file) == 0 && written;
+  }
+  *result = BOOL_VAL(written);
+  return true;
+}
+
+static bool writeFileNative(int argCount, Value *args, Value *result) {
+  return writeText("writeFile", args, "wb", result);
+}
+
+static bool appendFileNative(int argCount, Value *args, Value *result) {
+  return writeText("appendFile", args, "ab", result);
+}
+
+static bool readLineNative(int argCount, Value *args, Value *result) {
+  char buffer[1024];
+  char *line = buffer;
+  size_t capacity = sizeof(buffer);
+  size_t length = 0;
+
+  for (;;) {
+    if (fgets(line + length, (int)(capacity - length), stdin) == NULL) {
+      break;
+    }
+    length += strlen(line + length);
+    if (length > 0 && line[length - 1] == '\n') {
+      break;
+    }
+    if (length + 1 < capacity) {
+      continue;
+    }
+
+    // Long line, move to the heap and keep reading.
+    capacity *= 2;
+    char *grown = line == buffer ? malloc(capacity) : realloc(line, capacity);
+    if (grown == NULL) {
+      exit(1);
+    }
+    if (line == buffer) {
+      memcpy(grown, buffer, length + 1);
+    }
+    line = grown;
+  }
+
+  if (length == 0 && feof(stdin)) {
+    *result = NIL_VAL;
+  } else {
+    if (length > 0 && line[length - 1] == '\n') {
+      length--;
+    }
+    *result = OBJ_VAL(copyString(line, (int)length));
+  }
+  if (line != buffer) {
+    free(line);
+  }
+  return true;
+}
+
+static bool writeNative(int argCount, Value *args, Value *result) {
+  printValue(args[0]);
+  *result = NIL_VAL;
+  return true;
+}
+
+// The key is kept on the stack while mapSet() allocates.
+static void setEntry(ObjMap *map, const char *name, Value value) {
+  push(OBJ_VAL(copyString(name, (int)strlen(name))));
+  mapSet(map, vm->stackTop[-1], value);
+  pop();
+}
+
+static bool gcStatsNative(int argCount, Value *args, Value *result) {
+  // Read before building the map, which allocates and may run the collector.
+  GCStats stats = vm->gcStats;
+  size_t heapBytes = vm->bytesAllocated;
+  size_t nextGC = vm->nextGC;
+  int strings = tableSize(&vm->strings);
+  int counts[OBJ_TYPE_COUNT];
+  countObjects(counts);
+
+  ObjMap *map = newMap();
+  *result = OBJ_VAL(map);
+  setEntry(map, "cycles", NUMBER_VAL(stats.cycles));
+  setEntry(map, "pause_total_ns", NUMBER_VAL((double)stats.pauseTotal));
+  setEntry(map, "pause_max_ns", NUMBER_VAL((double)stats.pauseMax));
+  setEntry(map, "bytes_freed", NUMBER_VAL((double)stats.bytesFreed));
+  setEntry(map, "heap_bytes", NUMBER_VAL((double)heapBytes));
+  setEntry(map, "peak_bytes", NUMBER_VAL((double)stats.peakBytes));
+  setEntry(map, "next_gc", NUMBER_VAL((double)nextGC));
+  setEntry(map, "interned_strings", NUMBER_VAL(strings));
+
+  ObjMap *objects = newMap();
+  push(OBJ_VAL(objects));
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    setEntry(objects, objTypeName((ObjType)i), NUMBER_VAL(counts[i]));
+  }
+  setEntry(map, "objects", OBJ_VAL(objects));
+  pop();
+  return true;
+}
+
+void defineNative(const char *name, NativeFn function, int arity) {
+  push(OBJ_VAL(copyString(name, (int)strlen(name))));
+  push(OBJ_VAL(newNative(function, AS_STRING(vm->stackTop[-1]), arity)));
+  int slot = globalSlot(AS_STRING(vm->stackTop[-2]));
+  vm->globalValues.values[slot] = vm->stackTop[-1];
+  pop();
+  pop();
+}
+
+void defineNatives() {
+  defineNative("clock", clockNative, 0);
+
+  defineNative("len", lenNative, 1);
+  defineNative("substring", substringNative, 3);
+  defineNative("find", findNative, 2);
+  defineNative("str", strNative, 1);
+  defineNative("number", numberNative, 1);
+  defineNative("split", splitNative, 2);
+  defineNative("join", joinNative, 2);
+
+  defineNative("push", pushNative, 2);
+  defineNative("pop", popNative, 1);
+  defineNative("has", hasNative, 2);
+  defineNative("remove", removeNative, 2);
+  defineNative("keys", keysNative, 1);
+
+  defineNative("abs", absNative, 1);
+  defineNative("floor", floorNative, 1);
+  defineNative("ceil", ceilNative, 1);
+  defineNative("sqrt", sqrtNative, 1);
+  defineNative("exp", expNative, 1);
+  defineNative("log", logNative, 1);
+  defineNative("sin", sinNative, 1);
+  defineNative("cos", cosNative, 1);
+  defineNative("pow", powNative, 2);
+  defineNative("min", minNative, 2);
+  defineNative("max", maxNative, 2);
+
+  defineNative("readFile", readFileNative, 1);
+  defineNative("writeFile", writeFileNative, 2);
+  defineNative("appendFile", appendFileNative, 2);
+  defineNative("readLine", readLineNative, 0);
+  defineNative("write", writeNative, 1);
+
+  defineNative("gcStats", gcStatsNative, 0);
+}
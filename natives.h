@@ -0,0 +1,44 @@
+#ifndef clox_natives_h
+#define clox_natives_h
+
+#include "object.h"
+
+/*
+ * The standard library, defined as globals in every new VM:
+ *
+ *   clock()                        seconds of CPU time
+ *   len(value)                     length of a string, list or map
+ *   substring(s, start, end)       chars [start, end) of s
+ *   find(s, needle)                first index of needle in s, or -1
+ *   str(value)                     number, bool, nil or string as a string
+ *   number(s)                      s parsed as a number, or nil
+ *   split(s, separator)            list of the pieces between separators,
+ *                                  of the chars if separator is ""
+ *   join(list, separator)          the strings in list, separated
+ *   push(list, value)              appends value
+ *   pop(list)                      removes and returns the last item
+ *   has(map, key)                  true if key is in map
+ *   remove(map, key)               removes key, true if it was there
+ *   keys(map)                      list of the keys in insertion order
+ *   abs floor ceil sqrt exp log sin cos (x), pow min max (x, y)
+ *   readFile(path)                 whole file as a string, or nil
+ *   writeFile(path, s)             replaces the file, true on success
+ *   appendFile(path, s)            appends to the file, true on success
+ *   readLine()                     next line of stdin without the newline,
+ *                                  or nil at the end
+ *   write(value)                   prints value without a newline
+ *   gcStats()                      map of collector and heap numbers: cycles,
+ *                                  pause_total_ns, pause_max_ns, bytes_freed,
+ *                                  heap_bytes, peak_bytes, next_gc,
+ *                                  interned_strings, and objects, a map from
+ *                                  each object type to how many are live
+ *
+ * Wrong argument counts and types are runtime errors.
+ */
+void defineNatives();
+
+// Makes function a global. arity is the argument count callValue() checks
+// before calling it, -1 for natives that check their arguments themselves.
+void defineNative(const char *name, NativeFn function, int arity);
+
+#endif
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "chunk.h"
@@ -11,18 +12,23 @@
 #define ALLOCATE_OBJ(type, objectType)                                         \
   (type *)allocateObject(sizeof(type), objectType)
 
-static Obj *allocateObject(size_t size, ObjType type) {
-  Obj *object = (Obj *)reallocate(NULL, 0, size);
-  object->type = type;
-  object->isMarked = false;
-
-  object->next = vm.objects;
-  vm.objects = object;
+// Puts an object on the list the GC sweeps.
+static void linkObject(Obj *object, size_t size) {
+  object->next = vm->objects;
+  vm->objects = object;
 
 #ifdef DEBUG_LOG_GC
-  printf("%p allocate %zu for %d\n", (void *)object, size, type);
+  printf("%p allocate %zu for %d\n", (void *)object, size, object->type);
+#else
+  (void)size;
 #endif
+}
 
+static Obj *allocateObject(size_t size, ObjType type) {
+  Obj *object = (Obj *)allocateObjectMemory(size);
+  object->type = type;
+  object->isMarked = false;
+  linkObject(object, size);
   return object;
 }
 
@@ -33,23 +39,44 @@ ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method) {
   return bound;
 }
 
+static ObjShape *newShape(ObjShape *parent, ObjString *name) {
+  ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+  shape->parent = parent;
+  shape->name = name;
+  shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+  initTable(&shape->slots);
+  initTable(&shape->transitions);
+  return shape;
+}
+
 ObjClass *newClass(ObjString *name) {
   ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
   klass->name = name;
+  klass->superclass = NULL;
   initTable(&klass->methods);
+  initValueArray(&klass->vtable);
+  klass->ownsMethods = true;
+  klass->ownsVtable = true;
+  klass->initializer = NULL;
+  klass->rootShape = NULL;
+  klass->fieldHint = 0;
+
+  push(OBJ_VAL(klass));
+  klass->rootShape = newShape(NULL, NULL);
+  writeBarrier(OBJ_VAL(klass->rootShape));
+  pop();
   return klass;
 }
 
 ObjClosure *newClosure(ObjFunction *function) {
-  ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, function->upvalueCount);
-  for (int i = 0; i < function->upvalueCount; i++) {
-    upvalues[i] = NULL;
-  }
-
-  ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+  ObjClosure *closure = (ObjClosure *)allocateObject(
+      sizeof(ObjClosure) + sizeof(ObjUpvalue *) * function->upvalueCount,
+      OBJ_CLOSURE);
   closure->function = function;
   closure->upvalueCount = function->upvalueCount;
-  closure->upvalues = upvalues;
+  for (int i = 0; i < function->upvalueCount; i++) {
+    closure->upvalues[i] = NULL;
+  }
   return closure;
 }
 
@@ -57,59 +84,293 @@ ObjFunction *newFunction() {
   ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->upvalueCount = 0;
+  function->maxStack = 0;
   function->name = NULL;
+  function->closure = NULL;
+  function->lazy = NULL;
+#ifdef CLOX_PROFILE
+  function->profile = NULL;
+#endif
+#ifdef CLOX_JIT
+  function->hotness = 0;
+  function->jit = NULL;
+#endif
   initChunk(&function->chunk);
   return function;
 }
 
+void freeLazyBody(LazyBody *lazy, int upvalueCount) {
+  FREE_ARRAY(char, lazy->source, lazy->length + 1);
+  FREE_ARRAY(ObjString *, lazy->upvalueNames, upvalueCount);
+  FREE(LazyBody, lazy);
+}
+
 ObjInstance *newInstance(ObjClass *klass) {
   ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
   instance->klass = klass;
-  initTable(&instance->fields);
+  instance->shape = klass->rootShape;
+  instance->fields = NULL;
+  instance->fieldCapacity = 0;
+  initTable(&instance->dictionary);
+  instance->bound = NULL;
   return instance;
 }
 
-ObjNative *newNative(NativeFn function) {
+int shapeSlot(ObjShape *shape, ObjString *name) {
+  Value slot;
+  if (!tableGet(&shape->slots, name, &slot)) {
+    return -1;
+  }
+  return (int)AS_NUMBER(slot);
+}
+
+// Returns the shape reached by adding field "name" to "shape", creating it on
+// first use, or NULL when instances past this point go to dictionary mode.
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name) {
+  Value next;
+  if (tableGet(&shape->transitions, name, &next)) {
+    return AS_SHAPE(next);
+  }
+
+  if (shape->fieldCount >= SHAPE_MAX_FIELDS ||
+      shape->transitions.count >= SHAPE_MAX_TRANSITIONS) {
+    return NULL;
+  }
+
+  ObjShape *child = newShape(shape, name);
+  push(OBJ_VAL(child));
+  tableAddAll(&shape->slots, &child->slots);
+  tableSet(&child->slots, name, NUMBER_VAL(shape->fieldCount));
+  tableSet(&shape->transitions, name, OBJ_VAL(child));
+  pop();
+  return child;
+}
+
+// Moves an instance to "shape", one of the children of its current shape,
+// storing value into the slot of the added field.
+void transitionInstance(ObjInstance *instance, ObjShape *shape, Value value) {
+  ObjClass *klass = instance->klass;
+  if (shape->fieldCount > klass->fieldHint) {
+    klass->fieldHint = shape->fieldCount;
+  }
+
+  if (instance->fieldCapacity < shape->fieldCount) {
+    int oldCapacity = instance->fieldCapacity;
+    // First allocation jumps straight to the size earlier instances of the
+    // class ended up needing; after that, grow geometrically.
+    instance->fieldCapacity =
+        oldCapacity == 0 ? klass->fieldHint : oldCapacity * 2;
+    if (instance->fieldCapacity < shape->fieldCount) {
+      instance->fieldCapacity = shape->fieldCount;
+    }
+    instance->fields = GROW_ARRAY(Value, instance->fields, oldCapacity,
+                                  instance->fieldCapacity);
+  }
+
+  instance->fields[shape->fieldCount - 1] = value;
+  instance->shape = shape;
+  writeBarrier(value);
+  writeBarrier(OBJ_VAL(shape));
+}
+
+static void makeDictionary(ObjInstance *instance) {
+  ObjShape *shape = instance->shape;
+  for (int i = 0; i < shape->slots.capacity; i++) {
+    Entry *entry = &shape->slots.entries[i];
+    if (entry->key != NULL) {
+      tableSet(&instance->dictionary, entry->key,
+               instance->fields[(int)AS_NUMBER(entry->value)]);
+    }
+  }
+
+  FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+  instance->fields = NULL;
+  instance->fieldCapacity = 0;
+  instance->shape = NULL;
+}
+
+bool getField(ObjInstance *instance, ObjString *name, Value *value) {
+  if (instance->shape == NULL) {
+    return tableGet(&instance->dictionary, name, value);
+  }
+
+  int slot = shapeSlot(instance->shape, name);
+  if (slot < 0) {
+    return false;
+  }
+  *value = instance->fields[slot];
+  return true;
+}
+
+void setField(ObjInstance *instance, ObjString *name, Value value) {
+  if (instance->shape != NULL) {
+    int slot = shapeSlot(instance->shape, name);
+    if (slot >= 0) {
+      instance->fields[slot] = value;
+      writeBarrier(value);
+      return;
+    }
+
+    ObjShape *next = shapeTransition(instance->shape, name);
+    if (next != NULL) {
+      transitionInstance(instance, next, value);
+      return;
+    }
+
+    makeDictionary(instance);
+  }
+
+  tableSet(&instance->dictionary, name, value);
+}
+
+bool getMethod(ObjClass *klass, ObjString *name, Value *method) {
+  Value index;
+  if (!tableGet(&klass->methods, name, &index)) {
+    return false;
+  }
+  *method = klass->vtable.values[(int)AS_NUMBER(index)];
+  return true;
+}
+
+/*
+ * The copies below need no write barrier even when klass is already black:
+ * everything in them is also in the superclass's arrays, and blackening
+ * klass grayed the superclass.
+ */
+static void ownMethods(ObjClass *klass) {
+  if (klass->ownsMethods) {
+    return;
+  }
+  Table copy;
+  tableCopy(&klass->methods, &copy);
+  klass->methods = copy;
+  klass->ownsMethods = true;
+}
+
+static void ownVtable(ObjClass *klass) {
+  if (klass->ownsVtable) {
+    return;
+  }
+  ValueArray copy;
+  initValueArray(&copy);
+  if (klass->vtable.count > 0) {
+    copy.values = ALLOCATE(Value, klass->vtable.count);
+    copy.capacity = copy.count = klass->vtable.count;
+    memcpy(copy.values, klass->vtable.values, sizeof(Value) * copy.count);
+  }
+  klass->vtable = copy;
+  klass->ownsVtable = true;
+}
+
+void defineMethod(ObjClass *klass, ObjString *name, Value method) {
+  Value index;
+  if (tableGet(&klass->methods, name, &index)) {
+    ownVtable(klass);
+    klass->vtable.values[(int)AS_NUMBER(index)] = method;
+  } else {
+    ownMethods(klass);
+    ownVtable(klass);
+    tableSet(&klass->methods, name, NUMBER_VAL(klass->vtable.count));
+    writeValueArray(&klass->vtable, method);
+  }
+  writeBarrier(method);
+
+  if (name == vm->initString) {
+    klass->initializer = AS_CLOSURE(method);
+  }
+}
+
+void inheritMethods(ObjClass *subclass, ObjClass *superclass) {
+  subclass->superclass = superclass;
+  subclass->methods = superclass->methods;
+  subclass->vtable = superclass->vtable;
+  subclass->ownsMethods = false;
+  subclass->ownsVtable = false;
+  subclass->initializer = superclass->initializer;
+  writeBarrier(OBJ_VAL(superclass));
+}
+
+ObjBoundMethod *bindMethod(ObjInstance *receiver, ObjClosure *method) {
+  ObjBoundMethod *bound = receiver->bound;
+  if (bound != NULL && bound->method == method) {
+    return bound;
+  }
+
+  bound = newBoundMethod(OBJ_VAL(receiver), method);
+  receiver->bound = bound;
+  writeBarrier(OBJ_VAL(bound));
+  return bound;
+}
+
+ObjNative *newNative(NativeFn function, ObjString *name, int arity) {
   ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
   native->function = function;
+  native->name = name;
+  native->arity = arity;
   return native;
 }
 
-static ObjString *allocateString(char *chars, int length, uint32_t hash) {
-  ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-  string->length = length;
-  string->chars = chars;
-  string->hash = hash;
-  push(OBJ_VAL(string));
-  tableSet(&vm.strings, string, NIL_VAL);
-  pop();
-  return string;
+static uint64_t rotateLeft(uint64_t x, int bits) {
+  return (x << bits) | (x >> (64 - bits));
 }
 
+// Spreads the bits down into the low ones the tables index with.
+static uint32_t finishHash(uint64_t hash) {
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdu;
+  hash ^= hash >> 33;
+  return (uint32_t)hash;
+}
+
+// Mixes in eight bytes per step rather than FNV-1a's one. Loads go through
+// memcpy so unaligned keys are fine, the tail is zero padded and the length
+// folded in so padding can't collide with real NUL bytes.
 static uint32_t hashString(const char *key, int length) {
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
+  uint64_t hash = 0x9e3779b97f4a7c15u ^ (uint64_t)length;
+  while (length >= 8) {
+    uint64_t word;
+    memcpy(&word, key, 8);
+    hash = (rotateLeft(hash, 5) ^ word) * 0x517cc1b727220a95u;
+    key += 8;
+    length -= 8;
+  }
+  if (length > 0) {
+    uint64_t word = 0;
+    memcpy(&word, key, (size_t)length);
+    hash = (rotateLeft(hash, 5) ^ word) * 0x517cc1b727220a95u;
   }
-  return hash;
+  return finishHash(hash);
 }
 
-// copyString() functions assumes it cannot take ownership (because its a source
-// string) and we don't want to modify the source. As a result it creates a new
-// copy of the data, and then allocates the ObjString on the heap. For
-// concatenation we use takeString(), and the dynamic array has already been
-// allocated.
-ObjString *takeString(char *chars, int length) {
-  uint32_t hash = hashString(chars, length);
-  ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+ObjString *newString(int length) {
+  ObjString *string = (ObjString *)allocateObjectMemory(sizeof(ObjString) +
+                                                        (size_t)length + 1);
+  string->obj.type = OBJ_STRING;
+  string->obj.isMarked = false;
+  string->obj.next = NULL;
+  string->length = length;
+  return string;
+}
+
+// Hands a filled in string to the GC and the intern table.
+static ObjString *addString(ObjString *string) {
+  linkObject((Obj *)string, sizeof(ObjString) + (size_t)string->length + 1);
+  push(OBJ_VAL(string));
+  tableSet(&vm->strings, string, NIL_VAL);
+  pop();
+  return string;
+}
+
+ObjString *internString(ObjString *string) {
+  string->hash = hashString(string->chars, string->length);
+  ObjString *interned = tableFindString(&vm->strings, string->chars,
+                                        string->length, string->hash);
   if (interned != NULL) {
-    // In case of takeString, memory has been allocated, as the ownership was
-    // taken. We need to free it.
-    FREE_ARRAY(char, chars, length + 1);
+    freeObjectMemory(string, sizeof(ObjString) + (size_t)string->length + 1);
     return interned;
   }
-  return allocateString(chars, length, hash);
+
+  return addString(string);
 }
 
 // Note, we are copying the string by allocating memory in Heap
@@ -119,15 +380,123 @@ ObjString *takeString(char *chars, int length) {
 ObjString *copyString(const char *chars, int length) {
   uint32_t hash = hashString(chars, length);
   // Dont allocate memory for new string, if string already interned.
-  ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+  ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
   if (interned != NULL) {
     return interned;
   }
 
-  char *heapChars = ALLOCATE(char, length + 1);
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
-  return allocateString(heapChars, length, hash);
+  ObjString *string = newString(length);
+  memcpy(string->chars, chars, length);
+  string->chars[length] = '\0';
+  string->hash = hash;
+  return addString(string);
+}
+
+static int textLength(Obj *text) {
+  return text->type == OBJ_STRING ? ((ObjString *)text)->length
+                                  : ((ObjRope *)text)->length;
+}
+
+// A rope that has been flattened is just its string to anything built on it.
+static Obj *ropePiece(Obj *text) {
+  if (text->type == OBJ_ROPE && ((ObjRope *)text)->flat != NULL) {
+    return (Obj *)((ObjRope *)text)->flat;
+  }
+  return text;
+}
+
+Value concatenateStrings(Obj *a, Obj *b) {
+  a = ropePiece(a);
+  b = ropePiece(b);
+  int length = textLength(a) + textLength(b);
+  if (length >= ROPE_MIN_LENGTH) {
+    ObjRope *rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->length = length;
+    rope->left = a;
+    rope->right = b;
+    rope->flat = NULL;
+    return OBJ_VAL(rope);
+  }
+
+  // Ropes are never this short, both sides are flat strings.
+  ObjString *left = (ObjString *)a;
+  ObjString *right = (ObjString *)b;
+  ObjString *result = newString(length);
+  memcpy(result->chars, left->chars, left->length);
+  memcpy(result->chars + left->length, right->chars, right->length);
+  result->chars[length] = '\0';
+  return OBJ_VAL(internString(result));
+}
+
+/*
+ * Copies the rope's text into chars, which has room for rope->length. Fills
+ * from the end, following right branches and leaving left ones on a
+ * worklist, so the left-leaning ropes a loop of s = s + x builds need no
+ * worklist at all. Doesn't allocate from the GC heap, printing uses it too.
+ */
+static void writeRope(ObjRope *rope, char *chars) {
+  int capacity = 0;
+  int count = 0;
+  Obj **pending = NULL;
+  char *end = chars + rope->length;
+  Obj *text = (Obj *)rope;
+
+  for (;;) {
+    text = ropePiece(text);
+    if (text->type == OBJ_ROPE) {
+      ObjRope *node = (ObjRope *)text;
+      if (count == capacity) {
+        capacity = GROW_CAPACITY(capacity);
+        pending = (Obj **)realloc(pending, sizeof(Obj *) * capacity);
+        if (pending == NULL) {
+          exit(1);
+        }
+      }
+      pending[count++] = node->left;
+      text = node->right;
+      continue;
+    }
+
+    ObjString *string = (ObjString *)text;
+    end -= string->length;
+    memcpy(end, string->chars, string->length);
+    if (count == 0) {
+      break;
+    }
+    text = pending[--count];
+  }
+  free(pending);
+}
+
+ObjString *flattenRope(ObjRope *rope) {
+  if (rope->flat != NULL) {
+    return rope->flat;
+  }
+
+  ObjString *string = newString(rope->length);
+  writeRope(rope, string->chars);
+  string->chars[rope->length] = '\0';
+  rope->flat = internString(string);
+  writeBarrier(OBJ_VAL(rope->flat));
+  rope->left = NULL;
+  rope->right = NULL;
+  return rope->flat;
+}
+
+static void printRope(ObjRope *rope) {
+  if (rope->flat != NULL) {
+    printf("%s", rope->flat->chars);
+    return;
+  }
+
+  // Printing can happen where the GC must not run, so no flattening here.
+  char *chars = (char *)malloc((size_t)rope->length);
+  if (chars == NULL) {
+    exit(1);
+  }
+  writeRope(rope, chars);
+  fwrite(chars, 1, (size_t)rope->length, stdout);
+  free(chars);
 }
 
 static void printFunction(ObjFunction *function) {
@@ -147,6 +516,223 @@ ObjUpvalue *newUpvalue(Value *slot) {
   return upvalue;
 }
 
+ObjList *newList(Value *items, int count) {
+  Value *values = ALLOCATE(Value, count);
+  ObjList *list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+  if (count > 0) {
+    memcpy(values, items, sizeof(Value) * count);
+  }
+  list->items.values = values;
+  list->items.count = count;
+  list->items.capacity = count;
+  return list;
+}
+
+void appendToList(ObjList *list, Value value) {
+  // Growing the array can start a collection, value may be referenced from
+  // nowhere else yet.
+  push(value);
+  writeValueArray(&list->items, value);
+  writeBarrier(value);
+  pop();
+}
+
+// Free slots in a map's index.
+#define MAP_EMPTY -1
+#define MAP_DELETED -2
+#define MAP_MIN_INDEX 8
+
+ObjMap *newMap() {
+  ObjMap *map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
+  map->count = 0;
+  map->entryCount = 0;
+  map->entryCapacity = 0;
+  map->entries = NULL;
+  map->indexCapacity = 0;
+  map->index = NULL;
+  return map;
+}
+
+// Equal keys hash the same: strings are interned, and 0 and -0 are one key.
+static uint32_t hashValue(Value key) {
+  if (IS_STRING(key)) {
+    return AS_STRING(key)->hash;
+  }
+
+  uint64_t bits;
+  if (IS_NUMBER(key)) {
+    double number = AS_NUMBER(key) == 0 ? 0 : AS_NUMBER(key);
+    memcpy(&bits, &number, sizeof(bits));
+  } else if (IS_OBJ(key)) {
+    bits = (uint64_t)(uintptr_t)AS_OBJ(key);
+  } else if (IS_BOOL(key)) {
+    bits = AS_BOOL(key) ? 2 : 1;
+  } else {
+    bits = 0;
+  }
+  return finishHash(bits);
+}
+
+// Index slot holding key's entry, or -1. Linear probing, the index always
+// has free slots left since entryCapacity is below its size.
+static int findMapSlot(ObjMap *map, Value key, uint32_t hash) {
+  if (map->count == 0) {
+    return -1;
+  }
+
+  uint32_t mask = (uint32_t)map->indexCapacity - 1;
+  for (uint32_t slot = hash & mask;; slot = (slot + 1) & mask) {
+    int32_t entry = map->index[slot];
+    if (entry == MAP_EMPTY) {
+      return -1;
+    }
+    if (entry >= 0 && valuesEqual(map->entries[entry].key, key)) {
+      return (int)slot;
+    }
+  }
+}
+
+static int freeMapSlot(ObjMap *map, uint32_t hash) {
+  uint32_t mask = (uint32_t)map->indexCapacity - 1;
+  uint32_t slot = hash & mask;
+  while (map->index[slot] >= 0) {
+    slot = (slot + 1) & mask;
+  }
+  return (int)slot;
+}
+
+/*
+ * Packs the live entries into new arrays and indexes them again. The size
+ * doubles unless at least half the entries were holes, then it stays. The
+ * new arrays are only swapped in after both allocations, a collection they
+ * start still sees the old ones.
+ */
+static void rebuildMap(ObjMap *map) {
+  int indexCapacity = map->indexCapacity;
+  if (map->count + 1 > map->entryCapacity / 2) {
+    indexCapacity =
+        indexCapacity < MAP_MIN_INDEX ? MAP_MIN_INDEX : indexCapacity * 2;
+  }
+  int entryCapacity = indexCapacity / 4 * 3;
+  MapEntry *entries = ALLOCATE(MapEntry, entryCapacity);
+  int32_t *index = ALLOCATE(int32_t, indexCapacity);
+  for (int i = 0; i < indexCapacity; i++) {
+    index[i] = MAP_EMPTY;
+  }
+
+  int count = 0;
+  uint32_t mask = (uint32_t)indexCapacity - 1;
+  for (int i = 0; i < map->entryCount; i++) {
+    if (IS_UNDEFINED(map->entries[i].key)) {
+      continue;
+    }
+    uint32_t slot = hashValue(map->entries[i].key) & mask;
+    while (index[slot] != MAP_EMPTY) {
+      slot = (slot + 1) & mask;
+    }
+    index[slot] = count;
+    entries[count++] = map->entries[i];
+  }
+
+  FREE_ARRAY(MapEntry, map->entries, map->entryCapacity);
+  FREE_ARRAY(int32_t, map->index, map->indexCapacity);
+  map->entries = entries;
+  map->entryCount = count;
+  map->entryCapacity = entryCapacity;
+  map->index = index;
+  map->indexCapacity = indexCapacity;
+}
+
+bool mapGet(ObjMap *map, Value key, Value *value) {
+  int slot = findMapSlot(map, key, hashValue(key));
+  if (slot < 0) {
+    return false;
+  }
+  *value = map->entries[map->index[slot]].value;
+  return true;
+}
+
+bool mapSet(ObjMap *map, Value key, Value value) {
+  uint32_t hash = hashValue(key);
+  int slot = findMapSlot(map, key, hash);
+  if (slot >= 0) {
+    map->entries[map->index[slot]].value = value;
+    writeBarrier(value);
+    return false;
+  }
+
+  // Holes count against the capacity too, every one of them still has a
+  // deleted slot in the index.
+  if (map->entryCount == map->entryCapacity) {
+    rebuildMap(map);
+  }
+  slot = freeMapSlot(map, hash);
+  map->index[slot] = map->entryCount;
+  map->entries[map->entryCount].key = key;
+  map->entries[map->entryCount].value = value;
+  map->entryCount++;
+  map->count++;
+  writeBarrier(key);
+  writeBarrier(value);
+  return true;
+}
+
+bool mapDelete(ObjMap *map, Value key) {
+  int slot = findMapSlot(map, key, hashValue(key));
+  if (slot < 0) {
+    return false;
+  }
+
+  MapEntry *entry = &map->entries[map->index[slot]];
+  entry->key = UNDEFINED_VAL;
+  entry->value = NIL_VAL;
+  map->index[slot] = MAP_DELETED;
+  map->count--;
+  return true;
+}
+
+// Lists and maps can contain themselves, printing stops this deep.
+#define PRINT_MAX_DEPTH 16
+
+static _Thread_local int printDepth = 0;
+
+static void printList(ObjList *list) {
+  printf("[");
+  for (int i = 0; i < list->items.count; i++) {
+    if (i > 0) {
+      printf(", ");
+    }
+    printValue(list->items.values[i]);
+  }
+  printf("]");
+}
+
+static void printMap(ObjMap *map) {
+  printf("{");
+  bool first = true;
+  for (int i = 0; i < map->entryCount; i++) {
+    MapEntry *entry = &map->entries[i];
+    if (IS_UNDEFINED(entry->key)) {
+      continue;
+    }
+    if (!first) {
+      printf(", ");
+    }
+    first = false;
+    printValue(entry->key);
+    printf(": ");
+    printValue(entry->value);
+  }
+  printf("}");
+}
+
+const char *objTypeName(ObjType type) {
+  static const char *names[OBJ_TYPE_COUNT] = {
+      "string", "function", "native", "closure", "upvalue", "bound_method",
+      "class", "instance", "shape", "rope", "list", "map"};
+  return names[type];
+}
+
 void printObject(Value value) {
   switch (OBJ_TYPE(value)) {
   case OBJ_BOUND_METHOD: {
@@ -181,5 +767,28 @@ void printObject(Value value) {
     printf("upvalue");
     break;
   }
+  case OBJ_ROPE: {
+    printRope(AS_ROPE(value));
+    break;
+  }
+  case OBJ_SHAPE: {
+    printf("shape");
+    break;
+  }
+  case OBJ_LIST:
+  case OBJ_MAP: {
+    if (printDepth == PRINT_MAX_DEPTH) {
+      printf("...");
+      break;
+    }
+    printDepth++;
+    if (IS_LIST(value)) {
+      printList(AS_LIST(value));
+    } else {
+      printMap(AS_MAP(value));
+    }
+    printDepth--;
+    break;
+  }
   }
 }
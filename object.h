@@ -9,21 +9,29 @@
 
 // When downcasting from Obj --> ObjString, we need to ensure the type is string
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_SHAPE(value) isObjType(value, OBJ_SHAPE)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
 #define IS_CLASS(value) isObjType(value, OBJ_CLASS)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
 #define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_LIST(value) isObjType(value, OBJ_LIST)
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
+#define AS_SHAPE(value) ((ObjShape *)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
 #define AS_CLASS(value) ((ObjClass *)AS_OBJ(value))
 #define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
-#define AS_NATIVE(value) (((ObjNative *)AS_OBJ(value))->function)
+#define AS_NATIVE(value) ((ObjNative *)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
+#define AS_ROPE(value) ((ObjRope *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
+#define AS_LIST(value) ((ObjList *)AS_OBJ(value))
+#define AS_MAP(value) ((ObjMap *)AS_OBJ(value))
 
 typedef enum {
   OBJ_STRING,
@@ -33,37 +41,130 @@ typedef enum {
   OBJ_UPVALUE,
   OBJ_BOUND_METHOD,
   OBJ_CLASS,
-  OBJ_INSTANCE
+  OBJ_INSTANCE,
+  OBJ_SHAPE,
+  OBJ_ROPE,
+  OBJ_LIST,
+  OBJ_MAP
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_MAP + 1)
+
 struct Obj {
   ObjType type;
   bool isMarked;
   struct Obj *next;
 };
 
+/*
+ * A function body the compiler skipped in lazy mode, compileFunction()
+ * turns it into bytecode the first time the function is called. The
+ * upvalues were worked out when the body was skipped, since the enclosing
+ * function's OP_CLOSURE needed them; the body resolves its free variables
+ * against these names.
+ */
+typedef struct {
+  char *source; // From the "(" of the parameters to the body's "}".
+  int length;
+  int line;                 // Line the source starts on.
+  uint8_t type;             // The compiler's FunctionType.
+  bool inClass;             // Whether "this" may be used,
+  bool hasSuperclass;       // and "super".
+  ObjString **upvalueNames; // upvalueCount of them.
+} LazyBody;
+
 typedef struct {
   Obj obj;
   int arity;
   int upvalueCount;
+  // Stack slots the function needs, see maxStackDepth().
+  int maxStack;
   Chunk chunk;
   ObjString *name;
+  // A function that captures nothing needs one closure only, every
+  // OP_CLOSURE of it pushes this one. Made on first use.
+  struct ObjClosure *closure;
+  LazyBody *lazy; // NULL once the body is compiled.
+#ifdef CLOX_PROFILE
+  // Created by the profiler the first time the function runs
+  struct FunctionProfile *profile;
+#endif
+#ifdef CLOX_JIT
+  // Calls plus loop iterations so far, see heatUp() in jit.h.
+  int hotness;
+  struct JitCode *jit; // NULL until the function is hot.
+#endif
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, Value *args);
+// Natives store their return value in *result. Returning false means they
+// reported a runtime error instead, see natives.c.
+typedef bool (*NativeFn)(int argCount, Value *args, Value *result);
 
 typedef struct {
   Obj obj;
   NativeFn function;
+  ObjString *name;
+  int arity; // -1 when the native checks the count itself.
 } ObjNative;
 
+// The characters live in the same allocation as the header, NUL terminated.
 struct ObjString {
   Obj obj;
   int length;
-  char *chars;
   uint32_t hash;
+  char chars[];
 };
 
+/*
+ * A concatenation that hasn't been copied out yet, so building a string with
+ * repeated + costs one small node per step instead of a copy of everything so
+ * far. Only results of at least ROPE_MIN_LENGTH chars become ropes, shorter
+ * ones are copied and interned right away.
+ *
+ * Ropes aren't interned, so anything that compares, hashes or keys on a
+ * string has to flatten it first. flattenRope() interns the text once and
+ * keeps it in flat, dropping the pieces.
+ */
+#define ROPE_MIN_LENGTH 64
+
+typedef struct {
+  Obj obj;
+  int length;
+  Obj *left; // ObjString or ObjRope, NULL once flattened.
+  Obj *right;
+  ObjString *flat;
+} ObjRope;
+
+// The items are one contiguous array, grown by doubling like the others.
+typedef struct {
+  Obj obj;
+  ValueArray items;
+} ObjList;
+
+/*
+ * Hash map from any value to any value, keys compared with valuesEqual().
+ * The entries sit in insertion order in one array, which is what iterating
+ * walks, and a separate open addressed index of entry positions finds a key
+ * by its hash. Removing a key leaves a hole (key UNDEFINED_VAL) that the next
+ * rebuild packs away. Keys have to be flat strings, not ropes.
+ */
+typedef struct {
+  Value key;
+  Value value;
+} MapEntry;
+
+typedef struct {
+  Obj obj;
+  int count;      // Live entries
+  int entryCount; // Entries used, holes included
+  int entryCapacity;
+  MapEntry *entries;
+  int indexCapacity; // Power of two, 0 until the first key
+  int32_t *index;    // Entry positions, or MAP_EMPTY/MAP_DELETED
+} ObjMap;
+
+// While open, location points into the stack and next is the upvalue of the
+// next lower slot in the same frame, see CallFrame.
 typedef struct ObjUpvalue {
   Obj obj;
   Value *location;
@@ -71,41 +172,120 @@ typedef struct ObjUpvalue {
   struct ObjUpvalue *next;
 } ObjUpvalue;
 
-typedef struct {
+// The upvalue pointers are part of the same allocation as the closure.
+typedef struct ObjClosure {
   Obj obj;
   ObjFunction *function;
-  ObjUpvalue **upvalues;
   int upvalueCount;
+  ObjUpvalue *upvalues[];
 } ObjClosure;
 
-typedef struct {
+/*
+ * Hidden class. Instances that got the same fields added in the same order
+ * share one shape, which maps each field name to a slot in the instance's
+ * fields array. Shapes form a tree per class: the root has no fields and
+ * every child adds one field (name) to its parent.
+ */
+struct ObjShape {
   Obj obj;
+  ObjShape *parent;
   ObjString *name;
-  Table methods;
+  int fieldCount;
+  Table slots;       // Field name -> NUMBER_VAL(slot), for all fields.
+  Table transitions; // Field name -> OBJ_VAL(child shape).
+};
+
+// Past these limits instances stop sharing layouts and fall back to a
+// per-instance hash table (dictionary mode), so a class whose instances keep
+// getting fields added in different orders can't grow an unbounded tree.
+#define SHAPE_MAX_FIELDS 64
+#define SHAPE_MAX_TRANSITIONS 8
+
+/*
+ * Methods live in a flat vtable. "methods" maps every name the class
+ * answers to, inherited ones included, to an index into it. A subclass
+ * starts out sharing both with its superclass and only copies what it
+ * changes: overriding a method copies the vtable, adding a name the table
+ * too. Nothing is shared with a class whose body hasn't finished running,
+ * so the owner never writes to a table a subclass is looking at.
+ */
+typedef struct ObjClass {
+  Obj obj;
+  ObjString *name;
+  struct ObjClass *superclass;
+  Table methods; // Method name -> NUMBER_VAL(index into vtable).
+  ValueArray vtable;
+  bool ownsMethods;
+  bool ownsVtable;
+  ObjClosure *initializer; // The vtable's "init", so calls skip the lookup.
+  ObjShape *rootShape;
+  int fieldHint; // Most fields any instance has had, to presize new ones.
 } ObjClass;
 
+typedef struct ObjBoundMethod ObjBoundMethod;
+
 typedef struct {
   Obj obj;
   ObjClass *klass;
-  Table fields;
+  ObjShape *shape; // NULL in dictionary mode.
+  Value *fields;   // shape->fieldCount slots in use.
+  int fieldCapacity;
+  Table dictionary; // Fields of an instance in dictionary mode.
+  // The last method bound to this instance, handed out again while the same
+  // method is asked for so "obj.method" doesn't allocate every time.
+  ObjBoundMethod *bound;
 } ObjInstance;
 
-typedef struct {
+struct ObjBoundMethod {
   Obj obj;
   Value receiver;
   ObjClosure *method;
-} ObjBoundMethod;
+};
 
 ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method);
 ObjInstance *newInstance(ObjClass *klass);
 ObjClass *newClass(ObjString *name);
 ObjClosure *newClosure(ObjFunction *function);
 ObjFunction *newFunction();
-ObjNative *newNative(NativeFn function);
-ObjString *takeString(char *chars, int length);
+void freeLazyBody(LazyBody *lazy, int upvalueCount);
+ObjNative *newNative(NativeFn function, ObjString *name, int arity);
 ObjString *copyString(const char *chars, int length);
+// For building a string in place: newString() returns one with room for
+// length chars that isn't interned or known to the GC yet. Fill in chars and
+// pass it to internString(), which returns the interned string and frees the
+// new one if that text already existed.
+ObjString *newString(int length);
+ObjString *internString(ObjString *string);
+// a and b are strings or ropes and must stay reachable while this allocates.
+Value concatenateStrings(Obj *a, Obj *b);
+// The rope must stay reachable while this allocates.
+ObjString *flattenRope(ObjRope *rope);
 ObjUpvalue *newUpvalue(Value *slot);
+// A list holding a copy of the count values at items, which must stay
+// reachable while this allocates.
+ObjList *newList(Value *items, int count);
+void appendToList(ObjList *list, Value value);
+ObjMap *newMap();
+bool mapGet(ObjMap *map, Value key, Value *value);
+// Returns true if key wasn't in the map yet.
+bool mapSet(ObjMap *map, Value key, Value value);
+bool mapDelete(ObjMap *map, Value key);
+int shapeSlot(ObjShape *shape, ObjString *name);
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name);
+void transitionInstance(ObjInstance *instance, ObjShape *shape, Value value);
+bool getField(ObjInstance *instance, ObjString *name, Value *value);
+void setField(ObjInstance *instance, ObjString *name, Value value);
+bool getMethod(ObjClass *klass, ObjString *name, Value *method);
+// Adds or replaces a method, copying whatever klass still shares first.
+void defineMethod(ObjClass *klass, ObjString *name, Value method);
+// Makes subclass, which has no methods of its own yet, share superclass's.
+void inheritMethods(ObjClass *subclass, ObjClass *superclass);
+// Bound method for receiver, reusing the one it was last given if that was
+// for the same method.
+ObjBoundMethod *bindMethod(ObjInstance *receiver, ObjClosure *method);
 void printObject(Value value);
+// Lower case with underscores, as gcStats() and --stats report them.
+const char *objTypeName(ObjType type);
 // Why not define function itself as a macro?
 // As seen, the body uses "value" twice, and macro is expanded
 // by argument expression every place parameter name appear in the body.
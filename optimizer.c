@@ -0,0 +1,352 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "optimizer.h"
+
+// How far a single jump is threaded through a chain, and how often the whole
+// pass is repeated while it still finds something to do.
+#define MAX_THREADING 16
+#define MAX_PASSES 8
+
+static void *checkedAlloc(size_t size) {
+  void *result = calloc(1, size);
+  if (result == NULL) {
+    exit(1);
+  }
+  return result;
+}
+
+static bool isForwardJump(uint8_t instruction) {
+  return instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE ||
+         instruction == OP_JUMP_IF_TRUE;
+}
+
+// Pushes that can't fail, so dropping one along with the pop that follows it
+// doesn't lose an error.
+static bool isPurePush(uint8_t instruction) {
+  switch (instruction) {
+  case OP_CONSTANT:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_LOCAL:
+  case OP_GET_UPVALUE:
+  case OP_CONSTANT_LONG:
+  case OP_GET_LOCAL_LONG:
+  case OP_GET_UPVALUE_LONG:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static void writeShort(Chunk *chunk, int offset, int value) {
+  chunk->code[offset] = (value >> 8) & 0xff;
+  chunk->code[offset + 1] = value & 0xff;
+}
+
+static void setJumpTarget(Chunk *chunk, int offset, int target) {
+  int end = offset + instructionLength(chunk, offset);
+  writeShort(chunk, offset + jumpOperand(chunk->code[offset]),
+             chunk->code[offset] == OP_LOOP ? end - target : target - end);
+}
+
+static bool threadJumps(Chunk *chunk) {
+  bool changed = false;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t instruction = chunk->code[offset];
+    if (!isForwardJump(instruction)) {
+      continue;
+    }
+
+    // Landing on an OP_JUMP goes on to its target. A conditional jump landing
+    // on the same kind of jump tests the same value again, which takes the
+    // same branch, so it can skip that one too.
+    int original = jumpTarget(chunk, offset);
+    int target = original;
+    for (int i = 0; i < MAX_THREADING && target < chunk->count; i++) {
+      uint8_t next = chunk->code[target];
+      if (next != OP_JUMP && next != instruction) {
+        break;
+      }
+      target = jumpTarget(chunk, target);
+    }
+
+    // A jump to a loop's back edge can take the back edge itself, the end of
+    // an if inside a loop body does this.
+    if (instruction == OP_JUMP && target < chunk->count &&
+        chunk->code[target] == OP_LOOP) {
+      int loopStart = jumpTarget(chunk, target);
+      chunk->code[offset] = OP_LOOP;
+      setJumpTarget(chunk, offset, loopStart);
+      changed = true;
+      continue;
+    }
+
+    if (target != original && target - (offset + 3) <= UINT16_MAX) {
+      setJumpTarget(chunk, offset, target);
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+static void markTargets(Chunk *chunk, bool *targets) {
+  memset(targets, 0, sizeof(bool) * (chunk->count + 1));
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (jumpOperand(chunk->code[offset]) != 0) {
+      targets[jumpTarget(chunk, offset)] = true;
+    }
+  }
+}
+
+static void removeBytes(bool *removed, int offset, int length) {
+  for (int i = 0; i < length; i++) {
+    removed[offset + i] = true;
+  }
+}
+
+// Marks the instructions to drop, rewriting in place what only changes
+// opcodes. Returns false if there's nothing to drop.
+static bool findRemovals(Chunk *chunk, bool *targets, bool *removed) {
+  bool changed = false;
+  bool reachable = true;
+
+  for (int offset = 0; offset < chunk->count;) {
+    uint8_t instruction = chunk->code[offset];
+    int length = instructionLength(chunk, offset);
+    int next = offset + length;
+    if (targets[offset]) {
+      reachable = true;
+    }
+
+    if (!reachable) {
+      removeBytes(removed, offset, length);
+      changed = true;
+      offset = next;
+      continue;
+    }
+
+    if (instruction == OP_JUMP || instruction == OP_LOOP ||
+        instruction == OP_RETURN) {
+      reachable = false;
+    }
+
+    if (isForwardJump(instruction) && jumpTarget(chunk, offset) == next) {
+      removeBytes(removed, offset, length);
+      changed = true;
+    } else if (isPurePush(instruction) && next < chunk->count &&
+               chunk->code[next] == OP_POP && !targets[next]) {
+      removeBytes(removed, offset, length + 1);
+      changed = true;
+      next++;
+    } else if (instruction == OP_NOT && next + 3 < chunk->count &&
+               !targets[next] &&
+               (chunk->code[next] == OP_JUMP_IF_FALSE ||
+                chunk->code[next] == OP_JUMP_IF_TRUE) &&
+               chunk->code[next + 3] == OP_POP &&
+               chunk->code[jumpTarget(chunk, next)] == OP_POP) {
+      // The negated value only decides the branch, both ways pop it, so
+      // testing the original value the other way round is the same thing.
+      removeBytes(removed, offset, length);
+      chunk->code[next] = chunk->code[next] == OP_JUMP_IF_FALSE
+                              ? OP_JUMP_IF_TRUE
+                              : OP_JUMP_IF_FALSE;
+      changed = true;
+    }
+
+    offset = next;
+  }
+  return changed;
+}
+
+static int skipRemoved(Chunk *chunk, bool *removed, int offset) {
+  while (offset < chunk->count && removed[offset]) {
+    offset++;
+  }
+  return offset;
+}
+
+/*
+ * Slides the kept bytes down over the removed ones. Removal is per byte so a
+ * superinstruction can be written over the start of the sequence it replaces
+ * with the rest of that sequence removed. Jumps into removed code land on the
+ * next kept instruction, which is where execution would have continued anyway
+ * since only no-ops, unreachable code and the tails of fused sequences are
+ * removed. Lines move with their bytes, in the one-per-byte copy the passes
+ * work on.
+ */
+static void compact(Chunk *chunk, int *lines, bool *removed) {
+  int *newOffsets = checkedAlloc(sizeof(int) * (chunk->count + 1));
+  int write = 0;
+  for (int offset = 0; offset < chunk->count; offset++) {
+    newOffsets[offset] = write;
+    if (!removed[offset]) {
+      write++;
+    }
+  }
+  newOffsets[chunk->count] = write;
+
+  // Patched before anything moves, while the old offsets are still valid.
+  // Each kept instruction stays in one piece, so its end moves with its start.
+  for (int offset = skipRemoved(chunk, removed, 0); offset < chunk->count;
+       offset = skipRemoved(chunk, removed,
+                            offset + instructionLength(chunk, offset))) {
+    uint8_t instruction = chunk->code[offset];
+    int operand = jumpOperand(instruction);
+    if (operand == 0) {
+      continue;
+    }
+    int from = newOffsets[offset] + instructionLength(chunk, offset);
+    int to = newOffsets[jumpTarget(chunk, offset)];
+    writeShort(chunk, offset + operand,
+               instruction == OP_LOOP ? from - to : to - from);
+  }
+
+  for (int offset = 0; offset < chunk->count; offset++) {
+    if (!removed[offset]) {
+      chunk->code[newOffsets[offset]] = chunk->code[offset];
+      lines[newOffsets[offset]] = lines[offset];
+    }
+  }
+  chunk->count = write;
+
+  free(newOffsets);
+}
+
+static int *expandLines(Chunk *chunk) {
+  int *lines = checkedAlloc(sizeof(int) * (chunk->count + 1));
+  for (int offset = 0; offset < chunk->count; offset++) {
+    lines[offset] = getLine(chunk, offset);
+  }
+  return lines;
+}
+
+void optimizeChunk(Chunk *chunk) {
+  // The chunk only shrinks, so these stay big enough for every pass.
+  bool *targets = checkedAlloc(sizeof(bool) * (chunk->count + 1));
+  bool *removed = checkedAlloc(sizeof(bool) * (chunk->count + 1));
+  int *lines = expandLines(chunk);
+
+  for (int pass = 0; pass < MAX_PASSES; pass++) {
+    bool changed = threadJumps(chunk);
+    markTargets(chunk, targets);
+    memset(removed, 0, sizeof(bool) * (chunk->count + 1));
+    if (findRemovals(chunk, targets, removed)) {
+      compact(chunk, lines, removed);
+      changed = true;
+    }
+    if (!changed) {
+      break;
+    }
+  }
+
+  setLines(chunk, lines);
+  free(targets);
+  free(removed);
+  free(lines);
+}
+
+// Whether the sequence of opcodes starts at offset, with nothing jumping into
+// the middle of it.
+static bool matchSequence(Chunk *chunk, bool *targets, int offset,
+                          const uint8_t *opcodes, int count) {
+  for (int i = 0; i < count; i++) {
+    if (offset >= chunk->count || chunk->code[offset] != opcodes[i] ||
+        (i > 0 && targets[offset])) {
+      return false;
+    }
+    offset += instructionLength(chunk, offset);
+  }
+  return true;
+}
+
+/*
+ * Writes the superinstruction over the first length bytes of the sequence
+ * and removes the rest of it. Every byte takes the line of the instruction
+ * in the sequence that can fail, runtimeError() reports the line of the last
+ * byte read.
+ */
+static void fuse(Chunk *chunk, int *lines, bool *removed, int offset,
+                 int sequenceLength, const uint8_t *bytes, int length,
+                 int line) {
+  memcpy(chunk->code + offset, bytes, length);
+  for (int i = 0; i < length; i++) {
+    lines[offset + i] = line;
+  }
+  removeBytes(removed, offset + length, sequenceLength - length);
+}
+
+void fuseInstructions(Chunk *chunk) {
+  static const uint8_t addLocals[] = {OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD};
+  static const uint8_t addLocalConstant[] = {OP_GET_LOCAL, OP_CONSTANT,
+                                             OP_ADD};
+  static const uint8_t lessJump[] = {OP_GET_LOCAL, OP_CONSTANT, OP_LESS,
+                                     OP_JUMP_IF_FALSE};
+  static const uint8_t thisProperty[] = {OP_GET_LOCAL, OP_GET_PROPERTY};
+  static const uint8_t setLocalPop[] = {OP_SET_LOCAL, OP_POP};
+  static const uint8_t setGlobalPop[] = {OP_SET_GLOBAL, OP_POP};
+
+  bool *targets = checkedAlloc(sizeof(bool) * (chunk->count + 1));
+  bool *removed = checkedAlloc(sizeof(bool) * (chunk->count + 1));
+  int *lines = expandLines(chunk);
+  markTargets(chunk, targets);
+
+  bool changed = false;
+  for (int offset = 0; offset < chunk->count;) {
+    uint8_t *code = chunk->code + offset;
+    int *sequenceLines = lines + offset;
+    int next = offset + instructionLength(chunk, offset);
+
+    if (matchSequence(chunk, targets, offset, lessJump, 4)) {
+      // Same target, counted from the end of the shorter instruction
+      int target = jumpTarget(chunk, offset + 5);
+      int jump = target - (offset + 5);
+      if (jump <= UINT16_MAX) {
+        uint8_t bytes[] = {OP_LESS_LOCAL_CONSTANT_JUMP, code[1], code[3],
+                           (jump >> 8) & 0xff, jump & 0xff};
+        fuse(chunk, lines, removed, offset, 8, bytes, 5, sequenceLines[4]);
+        next = offset + 8;
+        changed = true;
+      }
+    } else if (matchSequence(chunk, targets, offset, addLocals, 3)) {
+      uint8_t bytes[] = {OP_ADD_LOCALS, code[1], code[3]};
+      fuse(chunk, lines, removed, offset, 5, bytes, 3, sequenceLines[4]);
+      next = offset + 5;
+      changed = true;
+    } else if (matchSequence(chunk, targets, offset, addLocalConstant, 3)) {
+      uint8_t bytes[] = {OP_ADD_LOCAL_CONSTANT, code[1], code[3]};
+      fuse(chunk, lines, removed, offset, 5, bytes, 3, sequenceLines[4]);
+      next = offset + 5;
+      changed = true;
+    } else if (matchSequence(chunk, targets, offset, thisProperty, 2) &&
+               code[1] == 0) {
+      uint8_t bytes[] = {OP_GET_THIS_PROPERTY, code[3], code[4], code[5]};
+      fuse(chunk, lines, removed, offset, 6, bytes, 4, sequenceLines[2]);
+      next = offset + 6;
+      changed = true;
+    } else if (matchSequence(chunk, targets, offset, setLocalPop, 2)) {
+      uint8_t bytes[] = {OP_SET_LOCAL_POP, code[1]};
+      fuse(chunk, lines, removed, offset, 3, bytes, 2, sequenceLines[0]);
+      next = offset + 3;
+      changed = true;
+    } else if (matchSequence(chunk, targets, offset, setGlobalPop, 2)) {
+      uint8_t bytes[] = {OP_SET_GLOBAL_POP, code[1], code[2]};
+      fuse(chunk, lines, removed, offset, 4, bytes, 3, sequenceLines[0]);
+      next = offset + 4;
+      changed = true;
+    }
+
+    offset = next;
+  }
+
+  if (changed) {
+    compact(chunk, lines, removed);
+    setLines(chunk, lines);
+  }
+  free(targets);
+  free(removed);
+  free(lines);
+}
@@ -0,0 +1,25 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+
+/*
+ * Peephole pass over a finished function, run by the compiler with -O. It
+ * threads jumps through OP_JUMP chains, drops dead code, no-op jumps and
+ * pushes that are popped straight away, and turns OP_NOT + conditional jump
+ * into the opposite jump when both successors pop the condition anyway.
+ *
+ * Only instructions that can't fail are removed, so every instruction left
+ * keeps its line and runtime errors report the same lines as without -O.
+ */
+void optimizeChunk(Chunk *chunk);
+
+/*
+ * Rewrites common sequences into the superinstructions at the end of OpCode,
+ * cutting the number of dispatches in tight loops. Run on every function,
+ * after optimizeChunk() with -O; the earlier pass doesn't know the fused
+ * opcodes.
+ */
+void fuseInstructions(Chunk *chunk);
+
+#endif
@@ -0,0 +1,231 @@
+// clock_gettime() on targets without a cycle counter
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "profile.h"
+
+#ifdef CLOX_PROFILE
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TICKS_UNIT "cycles"
+static inline uint64_t readTicks() { return __rdtsc(); }
+#else
+#include <time.h>
+#define TICKS_UNIT "ns"
+static inline uint64_t readTicks() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+#endif
+
+// Hot lines listed in the report, the opcode and function tables are complete.
+#define PROFILE_MAX_LINES 25
+
+_Thread_local Profiler profiler;
+
+typedef struct {
+  const char *name;
+  int line;
+  uint64_t count;
+  uint64_t ticks;
+} ProfileRow;
+
+void startProfiler(bool timing) {
+  memset(&profiler, 0, sizeof(profiler));
+  profiler.enabled = true;
+  profiler.timing = timing;
+}
+
+static void *checkedAlloc(size_t size) {
+  // The profiler's own bookkeeping stays out of bytesAllocated, it shouldn't
+  // change when the GC runs.
+  void *result = calloc(1, size);
+  if (result == NULL) {
+    exit(1);
+  }
+  return result;
+}
+
+static FunctionProfile *newFunctionProfile(ObjFunction *function) {
+  FunctionProfile *profile = checkedAlloc(sizeof(FunctionProfile));
+  // Named the way runtime errors name frames: "script" or "fib()"
+  if (function->name == NULL) {
+    profile->name = checkedAlloc(sizeof("script"));
+    strcpy(profile->name, "script");
+  } else {
+    profile->name = checkedAlloc(function->name->length + 3);
+    sprintf(profile->name, "%s()", function->name->chars);
+  }
+
+  profile->count = function->chunk.count;
+  profile->lines = checkedAlloc(sizeof(int) * profile->count);
+  for (int offset = 0; offset < profile->count; offset++) {
+    profile->lines[offset] = getLine(&function->chunk, offset);
+  }
+  profile->counts = checkedAlloc(sizeof(uint64_t) * profile->count);
+  profile->ticks = checkedAlloc(sizeof(uint64_t) * profile->count);
+
+  profile->next = profiler.functions;
+  profiler.functions = profile;
+  return profile;
+}
+
+// Called by run() with ip on the opcode it's about to execute.
+void profileInstruction(ObjFunction *function, uint8_t *ip) {
+  FunctionProfile *profile = function->profile;
+  if (profile == NULL) {
+    profile = function->profile = newFunctionProfile(function);
+  }
+
+  int offset = (int)(ip - function->chunk.code);
+  uint8_t opcode = *ip;
+  profiler.opcodeCounts[opcode]++;
+  profile->counts[offset]++;
+
+  if (profiler.timing) {
+    uint64_t now = readTicks();
+    if (profiler.lastTicks != NULL) {
+      *profiler.lastTicks += now - profiler.lastTick;
+      *profiler.lastOpcodeTicks += now - profiler.lastTick;
+    }
+    profiler.lastTicks = &profile->ticks[offset];
+    profiler.lastOpcodeTicks = &profiler.opcodeTicks[opcode];
+    // Read again so the bookkeeping above isn't charged to the instruction.
+    profiler.lastTick = readTicks();
+  }
+}
+
+static int compareRows(const void *a, const void *b) {
+  const ProfileRow *left = a;
+  const ProfileRow *right = b;
+  uint64_t x = profiler.timing ? left->ticks : left->count;
+  uint64_t y = profiler.timing ? right->ticks : right->count;
+  return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+static double percent(uint64_t part, uint64_t total) {
+  return total == 0 ? 0.0 : 100.0 * (double)part / (double)total;
+}
+
+static void printHeader(const char *title, const char *what) {
+  fprintf(stderr, "== profile: %s ==\n", title);
+  fprintf(stderr, "%-28s %14s %7s", what, "count", "%");
+  if (profiler.timing) {
+    fprintf(stderr, " %16s %7s", TICKS_UNIT, "%");
+  }
+  fprintf(stderr, "\n");
+}
+
+static void printRows(ProfileRow *rows, int count, int limit,
+                      uint64_t totalCount, uint64_t totalTicks) {
+  qsort(rows, count, sizeof(ProfileRow), compareRows);
+  for (int i = 0; i < count && i < limit; i++) {
+    char label[64];
+    if (rows[i].line > 0) {
+      snprintf(label, sizeof(label), "[line %d] in %s", rows[i].line,
+               rows[i].name);
+    } else {
+      snprintf(label, sizeof(label), "%s", rows[i].name);
+    }
+    fprintf(stderr, "%-28s %14llu %6.2f%%", label,
+            (unsigned long long)rows[i].count,
+            percent(rows[i].count, totalCount));
+    if (profiler.timing) {
+      fprintf(stderr, " %16llu %6.2f%%", (unsigned long long)rows[i].ticks,
+              percent(rows[i].ticks, totalTicks));
+    }
+    fprintf(stderr, "\n");
+  }
+}
+
+void printProfile() {
+  uint64_t totalCount = 0;
+  uint64_t totalTicks = 0;
+  ProfileRow opcodes[UINT8_COUNT];
+  int opcodeCount = 0;
+  for (int i = 0; i < UINT8_COUNT; i++) {
+    if (profiler.opcodeCounts[i] == 0) {
+      continue;
+    }
+    totalCount += profiler.opcodeCounts[i];
+    totalTicks += profiler.opcodeTicks[i];
+    opcodes[opcodeCount++] = (ProfileRow){opcodeName((uint8_t)i), 0,
+                                          profiler.opcodeCounts[i],
+                                          profiler.opcodeTicks[i]};
+  }
+
+  printHeader("opcodes", "opcode");
+  printRows(opcodes, opcodeCount, UINT8_COUNT, totalCount, totalTicks);
+
+  // One row per function and one per (function, line) that ran at all.
+  int functionCount = 0;
+  int lineCapacity = 0;
+  for (FunctionProfile *p = profiler.functions; p != NULL; p = p->next) {
+    functionCount++;
+    lineCapacity += p->count;
+  }
+  ProfileRow *functions =
+      checkedAlloc(sizeof(ProfileRow) * (functionCount + 1));
+  ProfileRow *lines = checkedAlloc(sizeof(ProfileRow) * (lineCapacity + 1));
+  int lineCount = 0;
+  functionCount = 0;
+
+  for (FunctionProfile *p = profiler.functions; p != NULL; p = p->next) {
+    ProfileRow *function = &functions[functionCount++];
+    *function = (ProfileRow){p->name, 0, 0, 0};
+    int firstLine = lineCount;
+
+    for (int offset = 0; offset < p->count; offset++) {
+      if (p->counts[offset] == 0 && p->ticks[offset] == 0) {
+        continue;
+      }
+      function->count += p->counts[offset];
+      function->ticks += p->ticks[offset];
+
+      ProfileRow *row = NULL;
+      for (int i = firstLine; i < lineCount; i++) {
+        if (lines[i].line == p->lines[offset]) {
+          row = &lines[i];
+          break;
+        }
+      }
+      if (row == NULL) {
+        row = &lines[lineCount++];
+        *row = (ProfileRow){p->name, p->lines[offset], 0, 0};
+      }
+      row->count += p->counts[offset];
+      row->ticks += p->ticks[offset];
+    }
+  }
+
+  printHeader("functions", "function");
+  printRows(functions, functionCount, functionCount, totalCount, totalTicks);
+  printHeader("lines", "line");
+  printRows(lines, lineCount, PROFILE_MAX_LINES, totalCount, totalTicks);
+
+  free(functions);
+  free(lines);
+}
+
+void freeProfiler() {
+  FunctionProfile *profile = profiler.functions;
+  while (profile != NULL) {
+    FunctionProfile *next = profile->next;
+    free(profile->name);
+    free(profile->lines);
+    free(profile->counts);
+    free(profile->ticks);
+    free(profile);
+    profile = next;
+  }
+  profiler.functions = NULL;
+  profiler.enabled = false;
+}
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include "common.h"
+#include "object.h"
+
+/*
+ * Instruction profiler for --profile. Only built with the CLOX_PROFILE CMake
+ * option, so normal builds don't pay anything for it in run().
+ *
+ * Every executed instruction is counted per opcode and per bytecode offset of
+ * the function it belongs to; the report folds offsets into source lines. With
+ * timing on, the ticks between the start of one instruction and the start of
+ * the next are charged to the first one, which makes them "self" time: a call
+ * instruction is charged for the call setup, not for the callee.
+ */
+#ifdef CLOX_PROFILE
+
+typedef struct FunctionProfile {
+  struct FunctionProfile *next;
+  // Copied out of the function so the report stays valid after the GC has
+  // freed it.
+  char *name;
+  int count;
+  int *lines;
+  uint64_t *counts;
+  uint64_t *ticks;
+} FunctionProfile;
+
+typedef struct {
+  bool enabled;
+  bool timing;
+  uint64_t opcodeCounts[UINT8_COUNT];
+  uint64_t opcodeTicks[UINT8_COUNT];
+  FunctionProfile *functions;
+  // The instruction the ticks since lastTick will be charged to
+  uint64_t lastTick;
+  uint64_t *lastOpcodeTicks;
+  uint64_t *lastTicks;
+} Profiler;
+
+// Per thread like the VM, it profiles whatever the thread runs.
+extern _Thread_local Profiler profiler;
+
+void startProfiler(bool timing);
+void profileInstruction(ObjFunction *function, uint8_t *ip);
+void printProfile();
+void freeProfiler();
+
+#endif
+
+#endif
@@ -10,12 +10,14 @@ typedef struct {
   int line;
 } Scanner;
 
-Scanner scanner;
+_Thread_local Scanner scanner;
 
-void initScanner(const char *source) {
+void initScanner(const char *source) { initScannerAt(source, 1); }
+
+void initScannerAt(const char *source, int line) {
   scanner.start = source;
   scanner.current = source;
-  scanner.line = 1;
+  scanner.line = line;
 }
 
 static bool isAtEnd() { return *scanner.current == '\0'; }
@@ -113,7 +115,7 @@ static Token number() {
   }
 
   // Look for decimal
-  if (isDigit(peekNext())) {
+  if (peek() == '.' && isDigit(peekNext())) {
     // consume "."
     advance();
   }
@@ -229,6 +231,12 @@ Token scanToken() {
     return makeToken(TOKEN_LEFT_BRACE);
   case '}':
     return makeToken(TOKEN_RIGHT_BRACE);
+  case '[':
+    return makeToken(TOKEN_LEFT_BRACKET);
+  case ']':
+    return makeToken(TOKEN_RIGHT_BRACKET);
+  case ':':
+    return makeToken(TOKEN_COLON);
   case ';':
     return makeToken(TOKEN_SEMICOLON);
   case ',':
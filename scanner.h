@@ -7,6 +7,9 @@ typedef enum {
   TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE,
   TOKEN_RIGHT_BRACE,
+  TOKEN_LEFT_BRACKET,
+  TOKEN_RIGHT_BRACKET,
+  TOKEN_COLON,
   TOKEN_COMMA,
   TOKEN_DOT,
   TOKEN_MINUS,
@@ -57,6 +60,8 @@ typedef struct {
 } Token;
 
 void initScanner(const char *source);
+// For source that starts on a later line of a file, like a lazy function.
+void initScannerAt(const char *source, int line);
 Token scanToken();
 
 #endif
@@ -1,6 +1,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "memory.h"
 #include "object.h"
 #include "table.h"
@@ -8,6 +12,20 @@
 
 #define TABLE_MAX_LOAD 0.75
 
+// Control bytes. Live entries hold hash & 0x7f, so the high bit tells the
+// free slots apart from the used ones.
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xfe
+
+static size_t tableBytes(int capacity) {
+  return (size_t)capacity * (sizeof(Entry) + 1);
+}
+
+// Not stored in Table, instances embed one and every byte counts there.
+static uint8_t *controlBytes(Table *table) {
+  return (uint8_t *)(table->entries + table->capacity);
+}
+
 void initTable(Table *table) {
   table->count = 0;
   table->capacity = 0;
@@ -15,39 +33,89 @@ void initTable(Table *table) {
 }
 
 void freeTable(Table *table) {
-  FREE_ARRAY(Table, table->entries, table->capacity);
+  reallocate(table->entries, tableBytes(table->capacity), 0);
   initTable(table);
 }
 
-static Entry *findEntry(Entry *entries, int capacity, ObjString *key) {
-  // HashFunction converts string to an integer, below Modulo ensures we map
-  // that to a bucket. We could have even used a ASCII value of last char, or
-  // sum of ASCII of each char then taken Modulo with Array Size or Capacity to
-  // map it to one of the bucket. Current Hash Function ensures uniformity.
-  uint32_t index = key->hash % capacity;
-  Entry *tombstone = NULL;
-
-  // Linear Probing
-  for (;;) {
-    Entry *entry = &entries[index];
-    // We are comparing 2 String Objects, not exactly string "chars".
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) {
-        // Empty Entry.
-        return tombstone != NULL ? tombstone : entry;
-      } else {
-        // value is Bool:True, so we have found a Tombstone
-        if (tombstone == NULL) {
-          tombstone = entry;
-        }
+// One bit per slot in the group whose control byte is "byte".
+static uint32_t matchByte(const uint8_t *group, uint8_t byte) {
+#ifdef __SSE2__
+  __m128i bytes = _mm_loadu_si128((const __m128i *)group);
+  return (uint32_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)byte)));
+#else
+  uint32_t bits = 0;
+  for (int i = 0; i < TABLE_GROUP; i++) {
+    bits |= (uint32_t)(group[i] == byte) << i;
+  }
+  return bits;
+#endif
+}
+
+// Slots in the group that are empty or deleted, the ones with the high bit.
+static uint32_t matchFree(const uint8_t *group) {
+#ifdef __SSE2__
+  return (uint32_t)_mm_movemask_epi8(
+      _mm_loadu_si128((const __m128i *)group));
+#else
+  uint32_t bits = 0;
+  for (int i = 0; i < TABLE_GROUP; i++) {
+    bits |= (uint32_t)(group[i] >> 7) << i;
+  }
+  return bits;
+#endif
+}
+
+static int lowestBit(uint32_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctz(bits);
+#else
+  int index = 0;
+  while ((bits & 1) == 0) {
+    bits >>= 1;
+    index++;
+  }
+  return index;
+#endif
+}
+
+/*
+ * Probing goes a whole group at a time, starting from the group the high
+ * hash bits pick and stepping 1, 2, 3... groups further. With a power of two
+ * number of groups that visits every group once. A lookup can stop at the
+ * first group with an empty slot: an insert would have used it.
+ */
+#define FOR_EACH_GROUP(table, hash, position)                                  \
+  for (uint32_t position = ((hash) >> 7) & ((table)->capacity - 1) &           \
+                           ~(uint32_t)(TABLE_GROUP - 1),                       \
+                stride = 0;                                                    \
+       ; stride += TABLE_GROUP,                                               \
+                position = (position + stride) & ((table)->capacity - 1))
+
+static int findIndex(Table *table, ObjString *key) {
+  uint8_t tag = key->hash & 0x7f;
+  FOR_EACH_GROUP(table, key->hash, position) {
+    const uint8_t *group = controlBytes(table) + position;
+    for (uint32_t bits = matchByte(group, tag); bits != 0; bits &= bits - 1) {
+      int index = (int)position + lowestBit(bits);
+      // We are comparing 2 String Objects, not exactly string "chars".
+      if (table->entries[index].key == key) {
+        return index;
       }
-    } else if (entry->key == key) {
-      // We found the key
-      return entry;
     }
+    if (matchByte(group, CONTROL_EMPTY) != 0) {
+      return -1;
+    }
+  }
+}
 
-    // Modulo to wrap around if we are at the last element.
-    index = (index + 1) % capacity;
+// First empty or deleted slot on the key's probe sequence.
+static int findFreeSlot(Table *table, uint32_t hash) {
+  FOR_EACH_GROUP(table, hash, position) {
+    uint32_t bits = matchFree(controlBytes(table) + position);
+    if (bits != 0) {
+      return (int)position + lowestBit(bits);
+    }
   }
 }
 
@@ -55,58 +123,82 @@ bool tableGet(Table *table, ObjString *key, Value *value) {
   if (table->count == 0)
     return false;
 
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) {
+  int index = findIndex(table, key);
+  if (index < 0) {
     return false;
   }
 
-  *value = entry->value;
+  *value = table->entries[index].value;
   return true;
 }
 
+// Like tableGet(), but returns the index of the key's entry (or -1) so
+// callers such as the inline caches can revisit it without probing.
+int tableGetIndex(Table *table, ObjString *key) {
+  if (table->count == 0)
+    return -1;
+
+  return findIndex(table, key);
+}
+
 static void adjustCapacity(Table *table, int capacity) {
-  Entry *entries = ALLOCATE(Entry, capacity);
+  Table resized;
+  resized.count = 0;
+  resized.capacity = capacity;
+  resized.entries = (Entry *)reallocate(NULL, 0, tableBytes(capacity));
+  uint8_t *control = controlBytes(&resized);
   for (int i = 0; i < capacity; i++) {
-    entries[i].key = NULL;
-    entries[i].value = NIL_VAL;
+    control[i] = CONTROL_EMPTY;
+    resized.entries[i].key = NULL;
+    resized.entries[i].value = NIL_VAL;
   }
 
-  // Unlike regular case where we copy all elements to bigger heap allocated
-  // memory when we Realloc, we can't do it her because the "index" we use is
-  // obtained from taking modulo with array length or capacity is updated here.
-  // Hence we need to re-calculate all the entries and probe sequence for each
-  // key present.
-  table->count = 0; // Don't count the Tombstone value.
+  // Every key has to be placed again, where it goes depends on the capacity.
+  // Deleted slots are left behind.
   for (int i = 0; i < table->capacity; i++) {
     Entry *entry = &table->entries[i];
     if (entry->key == NULL)
       continue;
 
-    Entry *destEntry = findEntry(entries, capacity, entry->key);
-    destEntry->key = entry->key;
-    destEntry->value = entry->value;
-    table->count++;
+    int index = findFreeSlot(&resized, entry->key->hash);
+    control[index] = entry->key->hash & 0x7f;
+    resized.entries[index] = *entry;
+    resized.count++;
   }
 
-  FREE_ARRAY(Entry, table->entries, table->capacity);
-  table->entries = entries;
-  table->capacity = capacity;
+  reallocate(table->entries, tableBytes(table->capacity), 0);
+  *table = resized;
 }
 
 bool tableSet(Table *table, ObjString *key, Value value) {
-  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-    int capacity = GROW_CAPACITY(table->capacity);
-    adjustCapacity(table, capacity);
-  }
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  bool isNewKey = entry->key == NULL;
-  // Count only if its new, and not a tombstone
-  if (isNewKey && IS_NIL(entry->value)) {
-    table->count++;
+  int index = table->count == 0 ? -1 : findIndex(table, key);
+  bool isNewKey = index < 0;
+  if (isNewKey) {
+    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
+      // Deleted slots count towards the load but are dropped by the rehash,
+      // a table that is mostly tombstones is rebuilt at the same size.
+      int live = tableSize(table);
+      int capacity = table->capacity;
+      if (live + 1 > capacity * TABLE_MAX_LOAD / 2) {
+        capacity = capacity < TABLE_GROUP ? TABLE_GROUP : capacity * 2;
+      }
+      adjustCapacity(table, capacity);
+    }
+
+    index = findFreeSlot(table, key->hash);
+    uint8_t *control = controlBytes(table);
+    // Reusing a deleted slot doesn't add to the load.
+    if (control[index] == CONTROL_EMPTY) {
+      table->count++;
+    }
+    control[index] = key->hash & 0x7f;
   }
 
+  Entry *entry = &table->entries[index];
   entry->key = key;
   entry->value = value;
+  writeBarrier(OBJ_VAL(key));
+  writeBarrier(value);
   return isNewKey;
 }
 
@@ -115,17 +207,34 @@ bool tableDelete(Table *table, ObjString *key) {
     return false;
   }
 
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) {
+  int index = findIndex(table, key);
+  if (index < 0) {
     return false;
   }
 
-  // Place a tombstone in the entry;
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+  table->entries[index].key = NULL;
+  table->entries[index].value = NIL_VAL;
+  // If the slot's group already has an empty slot no probe goes past it, so
+  // the slot can be empty again. Otherwise lookups for keys placed further
+  // along must keep going, and it becomes a tombstone.
+  uint8_t *control = controlBytes(table);
+  if (matchByte(control + (index & ~(TABLE_GROUP - 1)), CONTROL_EMPTY) != 0) {
+    control[index] = CONTROL_EMPTY;
+    table->count--;
+  } else {
+    control[index] = CONTROL_DELETED;
+  }
   return true;
 }
 
+int tableSize(Table *table) {
+  int size = 0;
+  for (int i = 0; i < table->capacity; i++) {
+    size += table->entries[i].key != NULL;
+  }
+  return size;
+}
+
 void tableAddAll(Table *from, Table *to) {
   for (int i = 0; i < from->capacity; i++) {
     Entry *entry = &from->entries[i];
@@ -135,29 +244,36 @@ void tableAddAll(Table *from, Table *to) {
   }
 }
 
+void tableCopy(Table *from, Table *to) {
+  initTable(to);
+  if (from->capacity == 0) {
+    return;
+  }
+  to->entries = (Entry *)reallocate(NULL, 0, tableBytes(from->capacity));
+  memcpy(to->entries, from->entries, tableBytes(from->capacity));
+  to->count = from->count;
+  to->capacity = from->capacity;
+}
+
 ObjString *tableFindString(Table *table, const char *chars, int length,
                            uint32_t hash) {
   if (table->count == 0) {
     return NULL;
   }
 
-  uint32_t index = hash % table->capacity;
-  // we grow the table capacity when we are at the LOAD factor of 0.75, this
-  // will ensure there is always empty entry in the entries to avoid infinite
-  // loops.
-  for (;;) {
-    Entry *entry = &table->entries[index];
-    if (entry->key == NULL) {
-      // stop if we empty entry, which is not a tombstone entry.
-      if (IS_NIL(entry->value)) {
-        return NULL;
+  uint8_t tag = hash & 0x7f;
+  FOR_EACH_GROUP(table, hash, position) {
+    const uint8_t *group = controlBytes(table) + position;
+    for (uint32_t bits = matchByte(group, tag); bits != 0; bits &= bits - 1) {
+      ObjString *key = table->entries[position + lowestBit(bits)].key;
+      if (key->hash == hash && key->length == length &&
+          memcmp(key->chars, chars, length) == 0) {
+        return key;
       }
-    } else if (entry->key->length == length && entry->key->hash == hash &&
-               memcmp(entry->key->chars, chars, length) == 0) {
-      return entry->key;
     }
-
-    index = (index + 1) % table->capacity;
+    if (matchByte(group, CONTROL_EMPTY) != 0) {
+      return NULL;
+    }
   }
 }
 
@@ -9,8 +9,18 @@ typedef struct {
   Value value;
 } Entry;
 
+/*
+ * Open addressing in the style of SwissTable. Next to every entry sits a
+ * control byte: empty, deleted, or the low 7 bits of a live key's hash. A
+ * probe looks at TABLE_GROUP control bytes at once and only touches the
+ * entries whose byte matches, so most misses never load a key at all.
+ * Capacity is zero or a power of two of at least TABLE_GROUP. The control
+ * bytes follow the entries in the same allocation.
+ */
+#define TABLE_GROUP 16
+
 typedef struct {
-  int count;
+  int count; // Live entries plus deleted ones still taking up slots.
   int capacity;
   Entry *entries;
 } Table;
@@ -18,9 +28,14 @@ typedef struct {
 void initTable(Table *table);
 void freeTable(Table *table);
 bool tableGet(Table *table, ObjString *key, Value *value);
+int tableGetIndex(Table *table, ObjString *key);
 bool tableSet(Table *table, ObjString *key, Value value);
 bool tableDelete(Table *table, ObjString *key);
+// Live entries only, unlike count.
+int tableSize(Table *table);
 void tableAddAll(Table *from, Table *to);
+// Initializes "to" as a copy of from, slot for slot, without rehashing.
+void tableCopy(Table *from, Table *to);
 ObjString *tableFindString(Table *table, const char *chars, int length,
                            uint32_t hash);
 void tableRemoveWhite(Table *table);
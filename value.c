@@ -30,6 +30,19 @@ void freeValueArray(ValueArray *array) {
 }
 
 void printValue(Value value) {
+#ifdef NAN_BOXING
+  if (IS_BOOL(value)) {
+    printf(AS_BOOL(value) ? "true" : "false");
+  } else if (IS_NIL(value)) {
+    printf("nil");
+  } else if (IS_UNDEFINED(value)) {
+    printf("undefined");
+  } else if (IS_NUMBER(value)) {
+    printf("%g", AS_NUMBER(value));
+  } else if (IS_OBJ(value)) {
+    printObject(value);
+  }
+#else
   switch (value.type) {
   case VAL_BOOL:
     printf(AS_BOOL(value) ? "true" : "false");
@@ -37,6 +50,9 @@ void printValue(Value value) {
   case VAL_NIL:
     printf("nil");
     break;
+  case VAL_UNDEFINED:
+    printf("undefined");
+    break;
   case VAL_NUMBER:
     printf("%g", AS_NUMBER(value));
     break;
@@ -44,9 +60,18 @@ void printValue(Value value) {
     printObject(value);
     break;
   }
+#endif
 }
 
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+  // Comparing the raw bits would make NaN equal to itself, so numbers still
+  // go through a floating-point comparison.
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  }
+  return a == b;
+#else
   if (a.type != b.type)
     return false;
   switch (a.type) {
@@ -61,4 +86,5 @@ bool valuesEqual(Value a, Value b) {
   default:
     return false;
   }
+#endif
 }
@@ -1,52 +1,63 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <time.h>
 
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "memory.h"
+#include "natives.h"
 #include "object.h"
+#include "profile.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 
-VM vm;
+#if defined(CLOX_COMPUTED_GOTO) && (defined(__GNUC__) || defined(__clang__))
+#define USE_COMPUTED_GOTO
+#endif
 
-static Value clockNative(int argCount, Value *args) {
-  return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
-}
+_Thread_local VM *vm = NULL;
 
 static void resetStack() {
-  vm.stackTop = vm.stack;
-  vm.frameCount = 0;
-  vm.openUpvalues = NULL;
+  vm->stackTop = vm->stack;
+  vm->frameCount = 0;
 }
 
 void push(Value value) {
-  *vm.stackTop = value;
-  vm.stackTop++;
+  *vm->stackTop = value;
+  vm->stackTop++;
 }
 
 Value pop() {
-  vm.stackTop--;
-  return *vm.stackTop;
+  vm->stackTop--;
+  return *vm->stackTop;
 }
 
-static void runtimeError(const char *format, ...) {
+#define TRACE_FRAMES 32
+
+void runtimeError(const char *format, ...) {
   va_list args;
   va_start(args, format);
   vfprintf(stderr, format, args);
   va_end(args);
   fputs("\n", stderr);
 
-  for (int i = vm.frameCount - 1; i >= 0; i--) {
-    CallFrame *frame = &vm.frames[i];
+  // A runaway recursion can leave a million frames, only both ends of the
+  // trace are worth printing.
+  for (int i = vm->frameCount - 1; i >= 0; i--) {
+    if (i == vm->frameCount - 1 - TRACE_FRAMES && i >= TRACE_FRAMES) {
+      fprintf(stderr, "[... %d more frames]\n", i - TRACE_FRAMES + 1);
+      i = TRACE_FRAMES - 1;
+    }
+    CallFrame *frame = &vm->frames[i];
     ObjFunction *function = frame->closure->function;
     size_t instruction = frame->ip - function->chunk.code - 1;
-    fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+    fprintf(stderr, "[line %d] in ",
+            getLine(&function->chunk, (int)instruction));
     if (function->name == NULL) {
       fprintf(stderr, "script\n");
     } else {
@@ -57,17 +68,74 @@ static void runtimeError(const char *format, ...) {
   resetStack();
 }
 
-// Foreign Function Interface to expose different native methods
-// to the language users
-static void defineNative(const char *name, NativeFn function) {
-  push(OBJ_VAL(copyString(name, (int)strlen(name))));
-  push(OBJ_VAL(newNative(function)));
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-  pop();
+// Returns the global slot for name, reserving an undefined one the first time
+// the name is seen. Slots are never released, so compiled code can keep the
+// index for the lifetime of the VM.
+int globalSlot(ObjString *name) {
+  Value index;
+  if (tableGet(&vm->globalSlots, name, &index)) {
+    return (int)AS_NUMBER(index);
+  }
+
+  // Growing the arrays can trigger a collection, keep the name reachable.
+  push(OBJ_VAL(name));
+  int slot = vm->globalValues.count;
+  writeValueArray(&vm->globalNames, OBJ_VAL(name));
+  writeValueArray(&vm->globalValues, UNDEFINED_VAL);
+  tableSet(&vm->globalSlots, name, NUMBER_VAL(slot));
   pop();
+  return slot;
+}
+
+static Value peek(int distance) { return vm->stackTop[-1 - distance]; }
+
+// The stacks are plain malloc memory like the gray stack, growing them must
+// not start a collection halfway through moving them.
+static void growFrames() {
+  vm->frameCapacity *= 2;
+  vm->frames = realloc(vm->frames, sizeof(CallFrame) * vm->frameCapacity);
+  if (vm->frames == NULL) {
+    exit(1);
+  }
+}
+
+// Moves the stack to a bigger block and points every frame window, open
+// upvalue and the stack top at the new copy.
+static void growStack(int needed) {
+  int capacity = vm->stackCapacity;
+  while (capacity < needed) {
+    capacity *= 2;
+  }
+
+  Value *stack = malloc(sizeof(Value) * capacity);
+  if (stack == NULL) {
+    exit(1);
+  }
+  memcpy(stack, vm->stack, sizeof(Value) * vm->stackCapacity);
+
+  for (int i = 0; i < vm->frameCount; i++) {
+    CallFrame *frame = &vm->frames[i];
+    frame->slots = stack + (frame->slots - vm->stack);
+    for (ObjUpvalue *upvalue = frame->openUpvalues; upvalue != NULL;
+         upvalue = upvalue->next) {
+      upvalue->location = stack + (upvalue->location - vm->stack);
+    }
+  }
+  vm->stackTop = stack + (vm->stackTop - vm->stack);
+
+  free(vm->stack);
+  vm->stack = stack;
+  vm->stackCapacity = capacity;
 }
 
-static Value peek(int distance) { return vm.stackTop[-1 - distance]; }
+// Compiles the body of a function the compiler skipped in lazy mode.
+static bool ensureCompiled(ObjFunction *function) {
+  if (function->lazy != NULL && !compileFunction(function)) {
+    runtimeError("Could not compile %s().", function->name->chars);
+    return false;
+  }
+  return true;
+}
 
 static bool call(ObjClosure *closure, int argCount) {
   if (argCount != closure->function->arity) {
@@ -76,15 +144,35 @@ static bool call(ObjClosure *closure, int argCount) {
     return false;
   }
 
-  if (vm.frameCount == FRAMES_MAX) {
-    runtimeError("stack overflow.");
+  if (!ensureCompiled(closure->function)) {
     return false;
   }
+#ifdef CLOX_JIT
+  heatUp(closure->function);
+#endif
+
+  // The compiler worked out how deep the function's stack gets, so checking
+  // once here is enough for every push it makes.
+  int needed = (int)(vm->stackTop - vm->stack) - argCount - 1 +
+               closure->function->maxStack + STACK_SLACK;
+  if (vm->frameCount == vm->frameCapacity || needed > vm->stackCapacity) {
+    if (vm->frameCount == FRAMES_MAX || needed > STACK_MAX) {
+      runtimeError("stack overflow.");
+      return false;
+    }
+    if (vm->frameCount == vm->frameCapacity) {
+      growFrames();
+    }
+    if (needed > vm->stackCapacity) {
+      growStack(needed);
+    }
+  }
 
-  CallFrame *frame = &vm.frames[vm.frameCount++];
+  CallFrame *frame = &vm->frames[vm->frameCount++];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
-  frame->slots = vm.stackTop - argCount - 1;
+  frame->slots = vm->stackTop - argCount - 1;
+  frame->openUpvalues = NULL;
   return true;
 }
 
@@ -93,7 +181,7 @@ static bool callValue(Value callee, int argCount) {
     switch (OBJ_TYPE(callee)) {
     case OBJ_BOUND_METHOD: {
       ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
-      vm.stackTop[-argCount - 1] = bound->receiver;
+      vm->stackTop[-argCount - 1] = bound->receiver;
       return call(bound->method, argCount);
     }
     case OBJ_CLASS: {
@@ -106,11 +194,10 @@ static bool callValue(Value callee, int argCount) {
        *
        */
       ObjClass *klass = AS_CLASS(callee);
-      vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+      vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
 
-      Value initializer;
-      if (tableGet(&klass->methods, vm.initString, &initializer)) {
-        return call(AS_CLOSURE(initializer), argCount);
+      if (klass->initializer != NULL) {
+        return call(klass->initializer, argCount);
       } else if (argCount != 0) {
         runtimeError("Expected 0 arguments but got %d.", argCount);
         return false;
@@ -124,11 +211,18 @@ static bool callValue(Value callee, int argCount) {
     case OBJ_NATIVE: {
       // We don't need to manually setup CallFrame for native function.
       // Since, we don't have to generate INSTR. Native langauge will handle
-      // the execution.
-      NativeFn native = AS_NATIVE(callee);
-      Value result = native(argCount, vm.stackTop - argCount);
-      vm.stackTop -= argCount + 1;
-      push(result);
+      // the execution. The result goes where the callee was.
+      ObjNative *native = AS_NATIVE(callee);
+      if (native->arity >= 0 && argCount != native->arity) {
+        runtimeError("Expected %d arguments but got %d.", native->arity,
+                     argCount);
+        return false;
+      }
+      Value *args = vm->stackTop - argCount;
+      if (!native->function(argCount, args, &args[-1])) {
+        return false;
+      }
+      vm->stackTop = args;
       return true;
     }
     default:
@@ -141,7 +235,7 @@ static bool callValue(Value callee, int argCount) {
 
 static bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount) {
   Value method;
-  if (!tableGet(&klass->methods, name, &method)) {
+  if (!getMethod(klass, name, &method)) {
     runtimeError("Undefined property '%s'", name->chars);
     return false;
   }
@@ -149,7 +243,92 @@ static bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount) {
   return call(AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjString *name, int argCount) {
+typedef enum {
+  PROPERTY_MISSING,
+  PROPERTY_FIELD,
+  PROPERTY_METHOD,
+} PropertyKind;
+
+static CacheEntry *newCacheEntry(InlineCache *cache) {
+  if (cache->count < INLINE_CACHE_WAYS) {
+    return &cache->entries[cache->count++];
+  }
+
+  // The site is megamorphic, let the oldest layout go.
+  memmove(&cache->entries[0], &cache->entries[1],
+          sizeof(CacheEntry) * (INLINE_CACHE_WAYS - 1));
+  return &cache->entries[INLINE_CACHE_WAYS - 1];
+}
+
+static void cacheField(InlineCache *cache, ObjShape *shape,
+                       ObjShape *transition, int slot) {
+  CacheEntry *entry = newCacheEntry(cache);
+  entry->shape = shape;
+  entry->transition = transition;
+  entry->fieldIndex = slot;
+  entry->method = NIL_VAL;
+  writeBarrier(OBJ_VAL(shape));
+  writeBarrier(OBJ_VAL(transition));
+}
+
+static void cacheMethod(InlineCache *cache, ObjShape *shape, Value method) {
+  CacheEntry *entry = newCacheEntry(cache);
+  entry->shape = shape;
+  entry->transition = NULL;
+  entry->fieldIndex = -1;
+  entry->method = method;
+  writeBarrier(OBJ_VAL(shape));
+  writeBarrier(method);
+}
+
+/*
+ * Resolves a property of an instance the way OP_GET_PROPERTY/OP_INVOKE see
+ * it: own fields first, then methods of the class. When the site has an
+ * inline cache, a hit is a single shape comparison; a miss does the lookups
+ * and remembers what it found for the instance's shape. cache may be NULL,
+ * and instances in dictionary mode are never cached.
+ */
+static PropertyKind findProperty(ObjInstance *instance, ObjString *name,
+                                 InlineCache *cache, Value *value) {
+  ObjShape *shape = instance->shape;
+  if (cache != NULL && shape != NULL) {
+    for (int i = 0; i < cache->count; i++) {
+      CacheEntry *entry = &cache->entries[i];
+      if (entry->shape == shape) {
+        if (entry->fieldIndex >= 0) {
+          *value = instance->fields[entry->fieldIndex];
+          return PROPERTY_FIELD;
+        }
+        *value = entry->method;
+        return PROPERTY_METHOD;
+      }
+    }
+  }
+
+  if (shape != NULL) {
+    int slot = shapeSlot(shape, name);
+    if (slot >= 0) {
+      *value = instance->fields[slot];
+      if (cache != NULL) {
+        cacheField(cache, shape, NULL, slot);
+      }
+      return PROPERTY_FIELD;
+    }
+  } else if (tableGet(&instance->dictionary, name, value)) {
+    return PROPERTY_FIELD;
+  }
+
+  if (getMethod(instance->klass, name, value)) {
+    if (cache != NULL && shape != NULL) {
+      cacheMethod(cache, shape, *value);
+    }
+    return PROPERTY_METHOD;
+  }
+
+  return PROPERTY_MISSING;
+}
+
+static bool invoke(ObjString *name, int argCount, InlineCache *cache) {
   Value receiver = peek(argCount);
   if (!IS_INSTANCE(receiver)) {
     runtimeError("only instances have methods.");
@@ -158,37 +337,45 @@ static bool invoke(ObjString *name, int argCount) {
   ObjInstance *instance = AS_INSTANCE(receiver);
 
   Value value;
-  if (tableGet(&instance->fields, name, &value)) {
+  switch (findProperty(instance, name, cache, &value)) {
+  case PROPERTY_FIELD:
     /*
      * This is generally how OP_GET_PROPERTY, then
      * OP_CALL behaves, we get the property, then
      * process the list of arguments. Followed by
      * OP_CALL which calls callValue.
      */
-    vm.stackTop[-argCount - 1] = value;
+    vm->stackTop[-argCount - 1] = value;
     return callValue(value, argCount);
+  case PROPERTY_METHOD:
+    return call(AS_CLOSURE(value), argCount);
+  case PROPERTY_MISSING:
+    break;
   }
 
-  return invokeFromClass(instance->klass, name, argCount);
+  runtimeError("Undefined property '%s'", name->chars);
+  return false;
 }
 
-static bool bindMethod(ObjClass *klass, ObjString *name) {
+// Replaces the receiver on top of the stack with klass's method "name"
+// bound to it.
+static bool bindSuperMethod(ObjClass *klass, ObjString *name) {
   Value method;
 
-  if (!tableGet(&klass->methods, name, &method)) {
+  if (!getMethod(klass, name, &method)) {
     runtimeError("Undefined porperty '%s'.", name->chars);
     return false;
   }
 
-  ObjBoundMethod *bound = newBoundMethod(peek(0), AS_CLOSURE(method));
+  ObjBoundMethod *bound = bindMethod(AS_INSTANCE(peek(0)), AS_CLOSURE(method));
   pop();
   push(OBJ_VAL(bound));
   return true;
 }
 
-static ObjUpvalue *captureUpvalue(Value *local) {
+static ObjUpvalue *captureUpvalue(CallFrame *frame, Value *local) {
   ObjUpvalue *prevUpvalue = NULL;
-  ObjUpvalue *upvalue = vm.openUpvalues;
+  ObjUpvalue *upvalue = frame->openUpvalues;
   while (upvalue != NULL && upvalue->location > local) {
     prevUpvalue = upvalue;
     upvalue = upvalue->next;
@@ -200,11 +387,11 @@ static ObjUpvalue *captureUpvalue(Value *local) {
   }
 
   ObjUpvalue *createdUpvalue = newUpvalue(local);
-  // insert the upvalue to openUpvalues tracked by vm
+  // insert the upvalue into the frame's openUpvalues
   createdUpvalue->next = upvalue;
 
   if (prevUpvalue == NULL) {
-    vm.openUpvalues = createdUpvalue;
+    frame->openUpvalues = createdUpvalue;
   } else {
     prevUpvalue->next = createdUpvalue;
   }
@@ -212,122 +399,513 @@ static ObjUpvalue *captureUpvalue(Value *local) {
   return createdUpvalue;
 }
 
-static void closeUpvalues(Value *last) {
-  while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-    ObjUpvalue *upvalue = vm.openUpvalues;
+static void closeUpvalues(CallFrame *frame, Value *last) {
+  while (frame->openUpvalues != NULL &&
+         frame->openUpvalues->location >= last) {
+    ObjUpvalue *upvalue = frame->openUpvalues;
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
-    vm.openUpvalues = upvalue->next;
+    // The value is leaving the stack, and the upvalue may already be black.
+    writeBarrier(upvalue->closed);
+    frame->openUpvalues = upvalue->next;
   }
 }
 
-static void defineMethod(ObjString *name) {
-  Value method = peek(0);
-  ObjClass *klass = AS_CLASS(peek(1));
-  tableSet(&klass->methods, name, method);
-  pop();
-}
-
 static bool isFalsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+static bool isText(Value value) {
+  return IS_STRING(value) || IS_ROPE(value);
+}
+
 static void concatenate() {
-  ObjString *b = AS_STRING(peek(0));
-  ObjString *a = AS_STRING(peek(1));
-  int length = a->length + b->length;
-  char *chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
-
-  ObjString *result = takeString(chars, length);
+  Value result = concatenateStrings(AS_OBJ(peek(1)), AS_OBJ(peek(0)));
   pop();
   pop();
-  push(OBJ_VAL(result));
+  push(result);
+}
+
+// Ropes aren't interned, equality needs their flat strings.
+static void flattenOperand(int distance) {
+  Value *slot = vm->stackTop - 1 - distance;
+  if (IS_ROPE(*slot)) {
+    *slot = OBJ_VAL(flattenRope(AS_ROPE(*slot)));
+  }
+}
+
+// Pops the operands of OP_EQUAL/OP_NOT_EQUAL and compares them.
+static bool popEqual() {
+  if (IS_ROPE(peek(0)) || IS_ROPE(peek(1))) {
+    flattenOperand(0);
+    flattenOperand(1);
+  }
+  Value b = pop();
+  Value a = pop();
+  return valuesEqual(a, b);
+}
+
+// Checks that index is a whole number in [0, length).
+static bool checkIndex(Value index, int length, int *position) {
+  if (!IS_NUMBER(index)) {
+    runtimeError("Index must be a number.");
+    return false;
+  }
+  double number = AS_NUMBER(index);
+  if (!(number >= 0 && number < length)) {
+    runtimeError("Index %g out of range [0, %d).", number, length);
+    return false;
+  }
+  if (number != (int)number) {
+    runtimeError("Index must be a whole number.");
+    return false;
+  }
+  *position = (int)number;
+  return true;
+}
+
+// OP_INDEX_GET past the list fast path in run(): maps, strings and errors.
+static bool indexGet() {
+  Value receiver = peek(1);
+  Value value;
+  if (IS_MAP(receiver)) {
+    flattenOperand(0);
+    if (!mapGet(AS_MAP(receiver), peek(0), &value)) {
+      value = NIL_VAL;
+    }
+  } else if (IS_LIST(receiver)) {
+    int index;
+    if (!checkIndex(peek(0), AS_LIST(receiver)->items.count, &index)) {
+      return false;
+    }
+    value = AS_LIST(receiver)->items.values[index];
+  } else if (IS_STRING(receiver) || IS_ROPE(receiver)) {
+    flattenOperand(1);
+    ObjString *string = AS_STRING(peek(1));
+    int index;
+    if (!checkIndex(peek(0), string->length, &index)) {
+      return false;
+    }
+    value = OBJ_VAL(copyString(string->chars + index, 1));
+  } else {
+    runtimeError("Only lists, maps and strings can be indexed.");
+    return false;
+  }
+
+  vm->stackTop[-2] = value;
+  vm->stackTop--;
+  return true;
 }
 
-void initVM() {
+static bool indexSet() {
+  Value receiver = peek(2);
+  if (IS_MAP(receiver)) {
+    flattenOperand(1);
+    mapSet(AS_MAP(receiver), peek(1), peek(0));
+  } else if (IS_LIST(receiver)) {
+    ObjList *list = AS_LIST(receiver);
+    int index;
+    if (!checkIndex(peek(1), list->items.count, &index)) {
+      return false;
+    }
+    list->items.values[index] = peek(0);
+    writeBarrier(peek(0));
+  } else {
+    runtimeError("Only lists and maps can be assigned by index.");
+    return false;
+  }
+
+  vm->stackTop[-3] = peek(0);
+  vm->stackTop -= 2;
+  return true;
+}
+
+// Replaces the count key/value pairs on top of the stack with their map.
+static void buildMap(int count) {
+  ObjMap *map = newMap();
+  push(OBJ_VAL(map));
+  Value *pairs = vm->stackTop - 1 - 2 * count;
+  for (int i = 0; i < 2 * count; i += 2) {
+    if (IS_ROPE(pairs[i])) {
+      pairs[i] = OBJ_VAL(flattenRope(AS_ROPE(pairs[i])));
+    }
+    mapSet(map, pairs[i], pairs[i + 1]);
+  }
+  vm->stackTop = pairs;
+  push(OBJ_VAL(map));
+}
+
+/*
+ * One step of OP_FOR_ITER for maps and strings, lists are done in run().
+ * state is the loop variable, then the sequence and the position in it.
+ * *more says whether there was another item, false is a runtime error. A
+ * map that gets rebuilt while it is iterated moves its entries, the loop may
+ * then see keys twice or not at all.
+ */
+static bool iterate(Value *state, bool *more) {
+  int position = (int)AS_NUMBER(state[2]);
+  if (IS_MAP(state[1])) {
+    ObjMap *map = AS_MAP(state[1]);
+    while (position < map->entryCount &&
+           IS_UNDEFINED(map->entries[position].key)) {
+      position++;
+    }
+    *more = position < map->entryCount;
+    if (*more) {
+      state[0] = map->entries[position].key;
+    }
+  } else if (IS_STRING(state[1]) || IS_ROPE(state[1])) {
+    if (IS_ROPE(state[1])) {
+      state[1] = OBJ_VAL(flattenRope(AS_ROPE(state[1])));
+    }
+    ObjString *string = AS_STRING(state[1]);
+    *more = position < string->length;
+    if (*more) {
+      state[0] = OBJ_VAL(copyString(string->chars + position, 1));
+    }
+  } else {
+    runtimeError("Can only iterate over lists, maps and strings.");
+    return false;
+  }
+
+  state[2] = NUMBER_VAL(position + 1);
+  return true;
+}
+
+VM *newVM() {
+  VM *machine = calloc(1, sizeof(VM));
+  if (machine == NULL) {
+    exit(1);
+  }
+  // Everything below allocates through the current VM.
+  vm = machine;
+
+  vm->optimizeCode = false;
+  vm->lazyCompile = false;
+  vm->frameCapacity = FRAMES_INITIAL;
+  vm->frames = malloc(sizeof(CallFrame) * vm->frameCapacity);
+  vm->stackCapacity = STACK_INITIAL;
+  vm->stack = malloc(sizeof(Value) * vm->stackCapacity);
+  if (vm->frames == NULL || vm->stack == NULL) {
+    exit(1);
+  }
   resetStack();
-  vm.objects = NULL;
-  vm.bytesAllocated = 0;
-  vm.nextGC = 1024;
+  vm->objects = NULL;
+  vm->bytesAllocated = 0;
+  vm->gcInitialHeap = GC_INITIAL_HEAP;
+  vm->gcGrowFactor = GC_HEAP_GROW_FACTOR;
+  vm->gcMaxHeap = 0;
+  vm->nextGC = vm->gcInitialHeap;
+  vm->gcPhase = GC_IDLE;
+  vm->gcStepSize = GC_STEP_SIZE;
+  vm->gcThreads = 1;
+  vm->sweepList = NULL;
+  for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+    vm->slabs[i] = (SlabClass){NULL, NULL, NULL, NULL};
+  }
+  vm->gcStats = (GCStats){0, 0, 0, 0, 0};
+  vm->instructionCount = 0;
 
-  initTable(&vm.globals);
-  initTable(&vm.strings);
-  vm.initString = NULL;
-  vm.initString = copyString("init", 4);
+  initTable(&vm->globalSlots);
+  initValueArray(&vm->globalNames);
+  initValueArray(&vm->globalValues);
+  initTable(&vm->strings);
+  vm->initString = NULL;
+  vm->initString = copyString("init", 4);
 
-  vm.grayCount = 0;
-  vm.grayCapacity = 0;
-  vm.grayStack = NULL;
+  vm->grayCount = 0;
+  vm->grayCapacity = 0;
+  vm->grayStack = NULL;
 
   // Register the native functions using FFI: defineNative
-  defineNative("clock", clockNative);
+  defineNatives();
+  return machine;
 }
 
-void freeVM() {
-  freeTable(&vm.strings);
-  vm.initString = NULL;
-  freeTable(&vm.globals);
+void freeVM(VM *machine) {
+  vm = machine;
+  freeTable(&vm->strings);
+  vm->initString = NULL;
+  freeTable(&vm->globalSlots);
+  freeValueArray(&vm->globalNames);
+  freeValueArray(&vm->globalValues);
   freeObjects();
+  free(vm->frames);
+  free(vm->stack);
+  free(vm);
+  vm = NULL;
+}
+
+static inline InlineCache *cacheAt(CallFrame *frame, uint16_t index) {
+  if (index == NO_INLINE_CACHE) {
+    return NULL;
+  }
+  return &frame->closure->function->chunk.caches[index];
 }
 
 static InterpretResult run() {
-  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  /*
+   * The instruction pointer, the frame's slot window and its constant table
+   * are touched by almost every instruction. Going through frame->ip and
+   * frame->closure->function->chunk each time is a chain of dependent loads,
+   * so they live in locals (ideally registers) instead. frame->ip is only
+   * brought up to date with SAVE_FRAME() where something else may read it:
+   * before pushing/popping frames and before anything that can report a
+   * runtime error, since runtimeError() walks every frame's ip.
+   */
+  CallFrame *frame;
+  register uint8_t *ip;
+  register Value *slots;
+  register Value *constants;
+  // Operands the _LONG property and invoke handlers decode before handing
+  // over to the shared body of the narrow one.
+  ObjString *name;
+  InlineCache *cache;
+
+#define SAVE_FRAME() (frame->ip = ip)
+#define LOAD_FRAME()                                                           \
+  do {                                                                         \
+    frame = &vm->frames[vm->frameCount - 1];                                     \
+    ip = frame->ip;                                                            \
+    slots = frame->slots;                                                      \
+    constants = frame->closure->function->chunk.constants.values;              \
+  } while (false)
 
-#define READ_BYTE() (*frame->ip++)
-#define READ_CONSTANT()                                                        \
-  (frame->closure->function->chunk.constants.values[READ_BYTE()])
-#define READ_SHORT()                                                           \
-  (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
 #define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(valueType, op)                                               \
+#define READ_LONG()                                                            \
+  (ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT_LONG() (constants[READ_LONG()])
+#define READ_STRING_LONG() AS_STRING(READ_CONSTANT_LONG())
+#define READ_CACHE() cacheAt(frame, READ_SHORT())
+// Two numbers quicken the instruction into numberOp, which is what the
+// next run through this code executes.
+#define BINARY_OP(valueType, op, numberOp)                                     \
   do {                                                                         \
     if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                          \
+      SAVE_FRAME();                                                            \
       runtimeError("Operands must be numbers.");                               \
       return INTERPRET_RUNTIME_ERROR;                                          \
     }                                                                          \
+    ip[-1] = numberOp;                                                         \
     double b = AS_NUMBER(pop());                                               \
     double a = AS_NUMBER(pop());                                               \
     push(valueType(a op b));                                                   \
   } while (false)
+// The quickened form: one guard, and the result replaces the left operand.
+// Anything else turns the instruction back into genericOp and runs that,
+// which concatenates, reports the error or quickens it again.
+#define NUMBER_OP(valueType, op, genericOp)                                    \
+  do {                                                                         \
+    Value *top = vm->stackTop;                                                 \
+    if (IS_NUMBER(top[-1]) && IS_NUMBER(top[-2])) {                            \
+      top[-2] = valueType(AS_NUMBER(top[-2]) op AS_NUMBER(top[-1]));           \
+      vm->stackTop = top - 1;                                                  \
+    } else {                                                                   \
+      *--ip = genericOp;                                                       \
+    }                                                                          \
+  } while (false)
+// >= and <= are "not <" and "not >", so NaN is >= and <= everything.
+#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_EXECUTION()                                                      \
+  do {                                                                         \
+    printf("         ");                                                       \
+    for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {                 \
+      printf("[ ");                                                            \
+      printValue(*slot);                                                       \
+      printf(" ]");                                                            \
+    }                                                                          \
+    printf("\n");                                                              \
+    disassembleInstruction(                                                    \
+        &frame->closure->function->chunk,                                      \
+        (int)(ip - frame->closure->function->chunk.code));                     \
+  } while (false)
+#else
+#define TRACE_EXECUTION()                                                      \
+  do {                                                                         \
+  } while (false)
+#endif
+
+#ifdef CLOX_STATS
+#define COUNT_INSTRUCTION() (vm->instructionCount++)
+#else
+#define COUNT_INSTRUCTION()                                                    \
+  do {                                                                         \
+  } while (false)
+#endif
+
+#ifdef CLOX_PROFILE
+#define PROFILE_INSTRUCTION()                                                  \
+  do {                                                                         \
+    if (profiler.enabled) {                                                    \
+      profileInstruction(frame->closure->function, ip);                        \
+    }                                                                          \
+  } while (false)
+#else
+#define PROFILE_INSTRUCTION()                                                  \
+  do {                                                                         \
+  } while (false)
+#endif
+
+// Carries on in native code from ip if the function has been compiled, see
+// jit.h. Done where native code hands over to run() most: calls, returns,
+// loops and property and list accesses.
+#ifdef CLOX_JIT
+#define ENTER_JIT()                                                            \
+  do {                                                                         \
+    ObjFunction *function = frame->closure->function;                          \
+    if (function->jit != NULL &&                                               \
+        function->jit->entries[ip - function->chunk.code] >= 0) {              \
+      ip = runJit(frame->closure, slots, ip);                                  \
+    }                                                                          \
+  } while (false)
+#else
+#define ENTER_JIT()                                                            \
+  do {                                                                         \
+  } while (false)
+#endif
+
+  /*
+   * Direct threaded dispatch: every handler ends by jumping straight to the
+   * handler of the next opcode through this table, instead of going back to
+   * the single indirect jump of the switch. Each handler then gets its own
+   * indirect branch, which the branch predictor can learn separately. The
+   * switch is kept around so the first instruction is dispatched through it
+   * and so that builds without computed goto behave identically.
+   */
+#ifdef USE_COMPUTED_GOTO
+  // The range fills every slot first, the opcodes then override theirs.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+  static void *dispatchTable[UINT8_COUNT] = {
+      [0 ... UINT8_MAX] = &&label_UNKNOWN,
+      [OP_CONSTANT] = &&label_OP_CONSTANT,
+      [OP_NIL] = &&label_OP_NIL,
+      [OP_TRUE] = &&label_OP_TRUE,
+      [OP_FALSE] = &&label_OP_FALSE,
+      [OP_POP] = &&label_OP_POP,
+      [OP_DEFINE_GLOBAL] = &&label_OP_DEFINE_GLOBAL,
+      [OP_SET_GLOBAL] = &&label_OP_SET_GLOBAL,
+      [OP_SET_LOCAL] = &&label_OP_SET_LOCAL,
+      [OP_SET_UPVALUE] = &&label_OP_SET_UPVALUE,
+      [OP_SET_PROPERTY] = &&label_OP_SET_PROPERTY,
+      [OP_GET_PROPERTY] = &&label_OP_GET_PROPERTY,
+      [OP_GET_LOCAL] = &&label_OP_GET_LOCAL,
+      [OP_GET_GLOBAL] = &&label_OP_GET_GLOBAL,
+      [OP_GET_UPVALUE] = &&label_OP_GET_UPVALUE,
+      [OP_GET_SUPER] = &&label_OP_GET_SUPER,
+      [OP_SUPER_INVOKE] = &&label_OP_SUPER_INVOKE,
+      [OP_EQUAL] = &&label_OP_EQUAL,
+      [OP_GREATER] = &&label_OP_GREATER,
+      [OP_LESS] = &&label_OP_LESS,
+      [OP_NEGATE] = &&label_OP_NEGATE,
+      [OP_PRINT] = &&label_OP_PRINT,
+      [OP_JUMP] = &&label_OP_JUMP,
+      [OP_JUMP_IF_FALSE] = &&label_OP_JUMP_IF_FALSE,
+      [OP_JUMP_IF_TRUE] = &&label_OP_JUMP_IF_TRUE,
+      [OP_LOOP] = &&label_OP_LOOP,
+      [OP_CALL] = &&label_OP_CALL,
+      [OP_INVOKE] = &&label_OP_INVOKE,
+      [OP_CLOSURE] = &&label_OP_CLOSURE,
+      [OP_ADD] = &&label_OP_ADD,
+      [OP_SUBTRACT] = &&label_OP_SUBTRACT,
+      [OP_MULTIPLY] = &&label_OP_MULTIPLY,
+      [OP_DIVIDE] = &&label_OP_DIVIDE,
+      [OP_NOT] = &&label_OP_NOT,
+      [OP_CLOSE_UPVALUE] = &&label_OP_CLOSE_UPVALUE,
+      [OP_CLASS] = &&label_OP_CLASS,
+      [OP_METHOD] = &&label_OP_METHOD,
+      [OP_INHERIT] = &&label_OP_INHERIT,
+      [OP_RETURN] = &&label_OP_RETURN,
+      [OP_BUILD_LIST] = &&label_OP_BUILD_LIST,
+      [OP_BUILD_MAP] = &&label_OP_BUILD_MAP,
+      [OP_INDEX_GET] = &&label_OP_INDEX_GET,
+      [OP_INDEX_SET] = &&label_OP_INDEX_SET,
+      [OP_FOR_ITER] = &&label_OP_FOR_ITER,
+      [OP_TAIL_CALL] = &&label_OP_TAIL_CALL,
+      [OP_NOT_EQUAL] = &&label_OP_NOT_EQUAL,
+      [OP_GREATER_EQUAL] = &&label_OP_GREATER_EQUAL,
+      [OP_LESS_EQUAL] = &&label_OP_LESS_EQUAL,
+      [OP_ADD_NUMBER] = &&label_OP_ADD_NUMBER,
+      [OP_SUBTRACT_NUMBER] = &&label_OP_SUBTRACT_NUMBER,
+      [OP_MULTIPLY_NUMBER] = &&label_OP_MULTIPLY_NUMBER,
+      [OP_DIVIDE_NUMBER] = &&label_OP_DIVIDE_NUMBER,
+      [OP_GREATER_NUMBER] = &&label_OP_GREATER_NUMBER,
+      [OP_LESS_NUMBER] = &&label_OP_LESS_NUMBER,
+      [OP_GREATER_EQUAL_NUMBER] = &&label_OP_GREATER_EQUAL_NUMBER,
+      [OP_LESS_EQUAL_NUMBER] = &&label_OP_LESS_EQUAL_NUMBER,
+      [OP_ADD_LOCALS] = &&label_OP_ADD_LOCALS,
+      [OP_ADD_LOCAL_CONSTANT] = &&label_OP_ADD_LOCAL_CONSTANT,
+      [OP_LESS_LOCAL_CONSTANT_JUMP] = &&label_OP_LESS_LOCAL_CONSTANT_JUMP,
+      [OP_GET_THIS_PROPERTY] = &&label_OP_GET_THIS_PROPERTY,
+      [OP_SET_LOCAL_POP] = &&label_OP_SET_LOCAL_POP,
+      [OP_SET_GLOBAL_POP] = &&label_OP_SET_GLOBAL_POP,
+      [OP_CONSTANT_LONG] = &&label_OP_CONSTANT_LONG,
+      [OP_GET_LOCAL_LONG] = &&label_OP_GET_LOCAL_LONG,
+      [OP_SET_LOCAL_LONG] = &&label_OP_SET_LOCAL_LONG,
+      [OP_GET_UPVALUE_LONG] = &&label_OP_GET_UPVALUE_LONG,
+      [OP_SET_UPVALUE_LONG] = &&label_OP_SET_UPVALUE_LONG,
+      [OP_GET_PROPERTY_LONG] = &&label_OP_GET_PROPERTY_LONG,
+      [OP_SET_PROPERTY_LONG] = &&label_OP_SET_PROPERTY_LONG,
+      [OP_INVOKE_LONG] = &&label_OP_INVOKE_LONG,
+      [OP_GET_SUPER_LONG] = &&label_OP_GET_SUPER_LONG,
+      [OP_SUPER_INVOKE_LONG] = &&label_OP_SUPER_INVOKE_LONG,
+      [OP_CLASS_LONG] = &&label_OP_CLASS_LONG,
+      [OP_METHOD_LONG] = &&label_OP_METHOD_LONG,
+      [OP_CLOSURE_LONG] = &&label_OP_CLOSURE_LONG,
+  };
+#pragma GCC diagnostic pop
+
+#define CASE(op)                                                               \
+  case op:                                                                     \
+  label_##op
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    TRACE_EXECUTION();                                                         \
+    COUNT_INSTRUCTION();                                                       \
+    PROFILE_INSTRUCTION();                                                     \
+    goto *dispatchTable[instruction = READ_BYTE()];                            \
+  } while (false)
+#else
+#define CASE(op) case op
+#define DISPATCH() break
+#endif
+
+  LOAD_FRAME();
 
   for (;;) {
     uint8_t instruction;
 
-#ifdef DEBUG_TRACE_EXECUTION
-    printf("         ");
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
-    }
-    printf("\n");
-    disassembleInstruction(
-        &frame->closure->function->chunk,
-        (int)(frame->ip - frame->closure->function->chunk.code));
-#endif
+    TRACE_EXECUTION();
+    COUNT_INSTRUCTION();
+    PROFILE_INSTRUCTION();
 
     switch (instruction = READ_BYTE()) {
-    case OP_CONSTANT: {
+    CASE(OP_CONSTANT): {
       Value constant = READ_CONSTANT();
       push(constant);
-      break;
+      DISPATCH();
     }
-    case OP_NIL:
+    CASE(OP_CONSTANT_LONG):
+      push(READ_CONSTANT_LONG());
+      DISPATCH();
+    CASE(OP_NIL):
       push(NIL_VAL);
-      break;
-    case OP_TRUE:
+      DISPATCH();
+    CASE(OP_TRUE):
       push(BOOL_VAL(true));
-      break;
-    case OP_FALSE:
+      DISPATCH();
+    CASE(OP_FALSE):
       push(BOOL_VAL(false));
-      break;
-    case OP_POP:
+      DISPATCH();
+    CASE(OP_POP):
       pop();
-      break;
-    case OP_GET_LOCAL: {
+      DISPATCH();
+    CASE(OP_GET_LOCAL): {
       /*
       {
        var a = 10;
@@ -338,171 +916,350 @@ static InterpretResult run() {
       }
       */
       uint8_t slot = READ_BYTE();
-      push(frame->slots[slot]);
-      break;
+      push(slots[slot]);
+      DISPATCH();
     }
-    case OP_DEFINE_GLOBAL: {
-      ObjString *name = READ_STRING();
-      tableSet(&vm.globals, name, peek(0));
+    CASE(OP_GET_LOCAL_LONG):
+      push(slots[READ_LONG()]);
+      DISPATCH();
+    CASE(OP_DEFINE_GLOBAL): {
+      vm->globalValues.values[READ_SHORT()] = peek(0);
       pop();
-      break;
+      DISPATCH();
     }
-    case OP_SET_LOCAL: {
+    CASE(OP_SET_LOCAL): {
       uint8_t slot = READ_BYTE();
-      frame->slots[slot] = peek(0);
-      break;
-    }
-    case OP_SET_GLOBAL: {
-      ObjString *name = READ_STRING();
-      if (tableSet(&vm.globals, name, peek(0))) {
-        // tableSet returns true if new key, hence
-        // we delete the key value we added and report
-        // runtime error if its  a new value
-        tableDelete(&vm.globals, name);
-        runtimeError("Undefined variable '%s'.", name->chars);
+      slots[slot] = peek(0);
+      DISPATCH();
+    }
+    CASE(OP_SET_LOCAL_LONG):
+      slots[READ_LONG()] = peek(0);
+      DISPATCH();
+    CASE(OP_SET_LOCAL_POP): {
+      uint8_t slot = READ_BYTE();
+      slots[slot] = pop();
+      DISPATCH();
+    }
+    CASE(OP_SET_GLOBAL): {
+      uint16_t slot = READ_SHORT();
+      // Assigning to a global that was never defined is an error, even though
+      // the compiler has already reserved its slot.
+      if (IS_UNDEFINED(vm->globalValues.values[slot])) {
+        SAVE_FRAME();
+        runtimeError("Undefined variable '%s'.",
+                     AS_STRING(vm->globalNames.values[slot])->chars);
         return INTERPRET_RUNTIME_ERROR;
       }
+      vm->globalValues.values[slot] = peek(0);
       // Why not popping? Because since this is an assignment expression
       // It can nested in another expression for instance a = b = 1
       // we need that value on stack.
-    } break;
-    case OP_SET_PROPERTY: {
+      DISPATCH();
+    }
+    CASE(OP_SET_GLOBAL_POP): {
+      uint16_t slot = READ_SHORT();
+      if (IS_UNDEFINED(vm->globalValues.values[slot])) {
+        SAVE_FRAME();
+        runtimeError("Undefined variable '%s'.",
+                     AS_STRING(vm->globalNames.values[slot])->chars);
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      vm->globalValues.values[slot] = pop();
+      DISPATCH();
+    }
+    CASE(OP_SET_PROPERTY_LONG):
+      name = READ_STRING_LONG();
+      cache = READ_CACHE();
+      goto setProperty;
+    CASE(OP_SET_PROPERTY): {
+      name = READ_STRING();
+      cache = READ_CACHE();
+    setProperty:
       if (!IS_INSTANCE(peek(1))) {
+        SAVE_FRAME();
         runtimeError("Only Instances have properties");
         return INTERPRET_RUNTIME_ERROR;
       }
 
       ObjInstance *instance = AS_INSTANCE(peek(1));
-      tableSet(&instance->fields, READ_STRING(), peek(0));
+      ObjShape *shape = instance->shape;
+
+      bool cached = false;
+      if (cache != NULL && shape != NULL) {
+        for (int i = 0; i < cache->count; i++) {
+          CacheEntry *entry = &cache->entries[i];
+          if (entry->shape == shape) {
+            if (entry->transition == NULL) {
+              instance->fields[entry->fieldIndex] = peek(0);
+              writeBarrier(peek(0));
+            } else {
+              transitionInstance(instance, entry->transition, peek(0));
+            }
+            cached = true;
+            break;
+          }
+        }
+      }
+
+      if (!cached) {
+        setField(instance, name, peek(0));
+        ObjShape *after = instance->shape;
+        if (cache != NULL && shape != NULL && after != NULL) {
+          cacheField(cache, shape, after == shape ? NULL : after,
+                     shapeSlot(after, name));
+        }
+      }
+
       Value value = pop();
       pop();
       // Set expression produces a value, hence pushed value to stack.
       // var a = someInstance.field = 16;
       // print someInstance.field = "value";
       push(value);
-      break;
+      ENTER_JIT();
+      DISPATCH();
     }
-    case OP_GET_PROPERTY: {
+    CASE(OP_GET_THIS_PROPERTY):
+      push(slots[0]);
+      goto getProperty;
+    CASE(OP_GET_PROPERTY_LONG):
+      name = READ_STRING_LONG();
+      cache = READ_CACHE();
+      goto getPropertyOperands;
+    CASE(OP_GET_PROPERTY): {
+    getProperty:
+      name = READ_STRING();
+      cache = READ_CACHE();
+    getPropertyOperands:
       if (!IS_INSTANCE(peek(0))) {
+        SAVE_FRAME();
         runtimeError("Only Instances have properties");
         return INTERPRET_RUNTIME_ERROR;
       }
 
       ObjInstance *instance = AS_INSTANCE(peek(0));
-      ObjString *name = READ_STRING();
 
       Value value;
-      if (tableGet(&instance->fields, name, &value)) {
-        pop(); // Instance
-        push(value);
-        break;
+      PropertyKind kind = findProperty(instance, name, cache, &value);
+      if (kind == PROPERTY_MISSING) {
+        SAVE_FRAME();
+        runtimeError("Undefined porperty '%s'.", name->chars);
+        return INTERPRET_RUNTIME_ERROR;
       }
 
-      if (!bindMethod(instance->klass, name)) {
-        return INTERPRET_RUNTIME_ERROR;
+      if (kind == PROPERTY_METHOD) {
+        value = OBJ_VAL(bindMethod(instance, AS_CLOSURE(value)));
       }
-      break;
+      pop(); // Instance
+      push(value);
+      ENTER_JIT();
+      DISPATCH();
     }
-    case OP_GET_GLOBAL: {
-      ObjString *name = READ_STRING();
-      Value value;
+    CASE(OP_GET_GLOBAL): {
+      uint16_t slot = READ_SHORT();
+      Value value = vm->globalValues.values[slot];
 
-      if (!tableGet(&vm.globals, name, &value)) {
-        runtimeError("Undefined Variable '%s'.", name->chars);
+      if (IS_UNDEFINED(value)) {
+        SAVE_FRAME();
+        runtimeError("Undefined Variable '%s'.",
+                     AS_STRING(vm->globalNames.values[slot])->chars);
         return INTERPRET_RUNTIME_ERROR;
       }
       push(value);
-      break;
+      DISPATCH();
     }
-    case OP_GET_SUPER: {
-      ObjString *name = READ_STRING();
+    CASE(OP_GET_SUPER_LONG):
+      name = READ_STRING_LONG();
+      goto getSuper;
+    CASE(OP_GET_SUPER): {
+      name = READ_STRING();
+    getSuper:;
       ObjClass *superclass = AS_CLASS(pop());
-      if (!bindMethod(superclass, name)) {
+      SAVE_FRAME();
+      if (!bindSuperMethod(superclass, name)) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      break;
+      DISPATCH();
     }
-    case OP_EQUAL: {
-      Value b = pop();
-      Value a = pop();
-      push(BOOL_VAL(valuesEqual(a, b)));
-      break;
-    }
-    case OP_SET_UPVALUE: {
+    CASE(OP_EQUAL):
+      push(BOOL_VAL(popEqual()));
+      DISPATCH();
+    CASE(OP_NOT_EQUAL):
+      push(BOOL_VAL(!popEqual()));
+      DISPATCH();
+    CASE(OP_SET_UPVALUE): {
       uint8_t slot = READ_BYTE();
       *frame->closure->upvalues[slot]->location = peek(0);
-      break;
+      writeBarrier(peek(0));
+      DISPATCH();
     }
-    case OP_GET_UPVALUE: {
+    CASE(OP_SET_UPVALUE_LONG):
+      *frame->closure->upvalues[READ_LONG()]->location = peek(0);
+      writeBarrier(peek(0));
+      DISPATCH();
+    CASE(OP_GET_UPVALUE): {
       uint8_t slot = READ_BYTE();
       push(*frame->closure->upvalues[slot]->location);
-      break;
-    }
-    case OP_GREATER:
-      BINARY_OP(BOOL_VAL, >);
-      break;
-    case OP_LESS:
-      BINARY_OP(BOOL_VAL, <);
-      break;
-    case OP_ADD: {
-      if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-        concatenate();
-      } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+      DISPATCH();
+    }
+    CASE(OP_GET_UPVALUE_LONG):
+      push(*frame->closure->upvalues[READ_LONG()]->location);
+      DISPATCH();
+    CASE(OP_GREATER):
+      BINARY_OP(BOOL_VAL, >, OP_GREATER_NUMBER);
+      DISPATCH();
+    CASE(OP_GREATER_EQUAL):
+      BINARY_OP(NOT_BOOL_VAL, <, OP_GREATER_EQUAL_NUMBER);
+      DISPATCH();
+    CASE(OP_LESS):
+      BINARY_OP(BOOL_VAL, <, OP_LESS_NUMBER);
+      DISPATCH();
+    CASE(OP_LESS_EQUAL):
+      BINARY_OP(NOT_BOOL_VAL, >, OP_LESS_EQUAL_NUMBER);
+      DISPATCH();
+    CASE(OP_LESS_LOCAL_CONSTANT_JUMP): {
+      Value a = slots[READ_BYTE()];
+      Value b = READ_CONSTANT();
+      uint16_t offset = READ_SHORT();
+      if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+        SAVE_FRAME();
+        runtimeError("Operands must be numbers.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      // Leaves the result behind like OP_JUMP_IF_FALSE, both ways pop it.
+      bool less = AS_NUMBER(a) < AS_NUMBER(b);
+      push(BOOL_VAL(less));
+      if (!less) {
+        ip += offset;
+      }
+      DISPATCH();
+    }
+    // The superinstructions only do numbers themselves, anything else is
+    // pushed and handed to OP_ADD for the strings and the error.
+    CASE(OP_ADD_LOCALS): {
+      Value a = slots[READ_BYTE()];
+      Value b = slots[READ_BYTE()];
+      if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+        DISPATCH();
+      }
+      push(a);
+      push(b);
+      goto add;
+    }
+    CASE(OP_ADD_LOCAL_CONSTANT): {
+      Value a = slots[READ_BYTE()];
+      Value b = READ_CONSTANT();
+      if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+        DISPATCH();
+      }
+      push(a);
+      push(b);
+      goto add;
+    }
+    CASE(OP_ADD): {
+      if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+        ip[-1] = OP_ADD_NUMBER;
         double b = AS_NUMBER(pop());
         double a = AS_NUMBER(pop());
         push(NUMBER_VAL(a + b));
+        DISPATCH();
+      }
+    add:
+      if (isText(peek(0)) && isText(peek(1))) {
+        concatenate();
+        ENTER_JIT();
       } else {
+        SAVE_FRAME();
         runtimeError("Operands must be either two numbers or two strings.");
         return INTERPRET_RUNTIME_ERROR;
       }
-      break;
-    }
-    case OP_SUBTRACT:
-      BINARY_OP(NUMBER_VAL, -);
-      break;
-    case OP_MULTIPLY:
-      BINARY_OP(NUMBER_VAL, *);
-      break;
-    case OP_DIVIDE:
-      BINARY_OP(NUMBER_VAL, /);
-      break;
-    case OP_NOT:
+      DISPATCH();
+    }
+    CASE(OP_SUBTRACT):
+      BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUMBER);
+      DISPATCH();
+    CASE(OP_MULTIPLY):
+      BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUMBER);
+      DISPATCH();
+    CASE(OP_DIVIDE):
+      BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUMBER);
+      DISPATCH();
+    CASE(OP_ADD_NUMBER):
+      NUMBER_OP(NUMBER_VAL, +, OP_ADD);
+      DISPATCH();
+    CASE(OP_SUBTRACT_NUMBER):
+      NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT);
+      DISPATCH();
+    CASE(OP_MULTIPLY_NUMBER):
+      NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY);
+      DISPATCH();
+    CASE(OP_DIVIDE_NUMBER):
+      NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE);
+      DISPATCH();
+    CASE(OP_GREATER_NUMBER):
+      NUMBER_OP(BOOL_VAL, >, OP_GREATER);
+      DISPATCH();
+    CASE(OP_LESS_NUMBER):
+      NUMBER_OP(BOOL_VAL, <, OP_LESS);
+      DISPATCH();
+    CASE(OP_GREATER_EQUAL_NUMBER):
+      NUMBER_OP(NOT_BOOL_VAL, <, OP_GREATER_EQUAL);
+      DISPATCH();
+    CASE(OP_LESS_EQUAL_NUMBER):
+      NUMBER_OP(NOT_BOOL_VAL, >, OP_LESS_EQUAL);
+      DISPATCH();
+    CASE(OP_NOT):
       // Unlike in OP_NEGATE where we check if its a number, here we dont.
       // Everything except boolean False and Nil is True.
       // Just like how in python int, not empty list is considered True.
       push(BOOL_VAL(isFalsey(pop())));
-      break;
-    case OP_NEGATE:
+      DISPATCH();
+    CASE(OP_NEGATE):
       if (!IS_NUMBER(peek(0))) {
+        SAVE_FRAME();
         runtimeError("Operand must be a number.");
         return INTERPRET_RUNTIME_ERROR;
       }
       push(NUMBER_VAL(-AS_NUMBER(pop())));
-      break;
-    case OP_PRINT: {
+      DISPATCH();
+    CASE(OP_PRINT): {
       printValue(pop());
       printf("\n");
-      break;
+      DISPATCH();
     }
-    case OP_JUMP: {
+    CASE(OP_JUMP): {
       uint16_t offset = READ_SHORT();
-      frame->ip += offset;
-      break;
+      ip += offset;
+      DISPATCH();
     }
-    case OP_JUMP_IF_FALSE: {
+    CASE(OP_JUMP_IF_FALSE): {
       uint16_t offset = READ_SHORT();
       if (isFalsey(peek(0))) {
-        frame->ip += offset;
+        ip += offset;
       }
-      break;
+      DISPATCH();
     }
-    case OP_LOOP: {
+    CASE(OP_JUMP_IF_TRUE): {
       uint16_t offset = READ_SHORT();
-      frame->ip -= offset;
-      break;
+      if (!isFalsey(peek(0))) {
+        ip += offset;
+      }
+      DISPATCH();
+    }
+    CASE(OP_LOOP): {
+      uint16_t offset = READ_SHORT();
+      ip -= offset;
+#ifdef CLOX_JIT
+      heatUp(frame->closure->function);
+#endif
+      ENTER_JIT();
+      DISPATCH();
     }
-    case OP_CALL: {
+    CASE(OP_CALL): {
       int argCount = READ_BYTE();
+      SAVE_FRAME();
       if (!callValue(peek(argCount), argCount)) {
         return INTERPRET_RUNTIME_ERROR;
       }
@@ -510,69 +1267,237 @@ static InterpretResult run() {
       // This frame has the slot pointer, ip of the function chunk etc.
       // Since, we are calling that, we should start executing from that IP,
       // hence we set the latest frame that was setup to invoke
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      LOAD_FRAME();
+      ENTER_JIT();
+      DISPATCH();
     }
-    case OP_INVOKE: {
-      ObjString *method = READ_STRING();
+    CASE(OP_TAIL_CALL): {
       int argCount = READ_BYTE();
-      if (!invoke(method, argCount)) {
+      Value callee = peek(argCount);
+      ObjClosure *closure = NULL;
+      if (IS_CLOSURE(callee)) {
+        closure = AS_CLOSURE(callee);
+      } else if (IS_BOUND_METHOD(callee)) {
+        closure = AS_BOUND_METHOD(callee)->method;
+      }
+      // Natives, classes and wrong argument counts take the normal call,
+      // the OP_RETURN after this one then returns its result.
+      if (closure == NULL || closure->function->arity != argCount) {
+        SAVE_FRAME();
+        if (!callValue(callee, argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        LOAD_FRAME();
+        ENTER_JIT();
+        DISPATCH();
+      }
+      SAVE_FRAME();
+      if (!ensureCompiled(closure->function)) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+#ifdef CLOX_JIT
+      heatUp(closure->function);
+#endif
+      if (IS_BOUND_METHOD(callee)) {
+        vm->stackTop[-argCount - 1] = AS_BOUND_METHOD(callee)->receiver;
+      }
+
+      // The callee and its arguments take over this frame's window, so a
+      // loop written as a tail call runs in constant stack. Nothing of the
+      // caller is left to return to, its upvalues are closed first.
+      closeUpvalues(frame, slots);
+      Value *callStart = vm->stackTop - argCount - 1;
+      memmove(slots, callStart, sizeof(Value) * (argCount + 1));
+      vm->stackTop = slots + argCount + 1;
+
+      int needed = (int)(slots - vm->stack) + closure->function->maxStack +
+                   STACK_SLACK;
+      if (needed > vm->stackCapacity) {
+        if (needed > STACK_MAX) {
+          SAVE_FRAME();
+          runtimeError("stack overflow.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        growStack(needed);
+      }
+      frame->closure = closure;
+      frame->ip = closure->function->chunk.code;
+      LOAD_FRAME();
+      ENTER_JIT();
+      DISPATCH();
     }
-    case OP_SUPER_INVOKE: {
-      ObjString *method = READ_STRING();
+    CASE(OP_INVOKE_LONG):
+      name = READ_STRING_LONG();
+      goto invoke;
+    CASE(OP_INVOKE): {
+      name = READ_STRING();
+    invoke:;
+      int argCount = READ_BYTE();
+      cache = READ_CACHE();
+      SAVE_FRAME();
+      if (!invoke(name, argCount, cache)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_FRAME();
+      ENTER_JIT();
+      DISPATCH();
+    }
+    CASE(OP_SUPER_INVOKE_LONG):
+      name = READ_STRING_LONG();
+      goto superInvoke;
+    CASE(OP_SUPER_INVOKE): {
+      name = READ_STRING();
+    superInvoke:;
       int argCount = READ_BYTE();
       ObjClass *superclass = AS_CLASS(pop());
-      if (!invokeFromClass(superclass, method, argCount)) {
+      SAVE_FRAME();
+      if (!invokeFromClass(superclass, name, argCount)) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      LOAD_FRAME();
+      ENTER_JIT();
+      DISPATCH();
     }
-    case OP_CLOSURE: {
-      ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+    CASE(OP_CLOSURE_LONG):
+    CASE(OP_CLOSURE): {
+      bool wide = instruction == OP_CLOSURE_LONG;
+      ObjFunction *function =
+          AS_FUNCTION(wide ? READ_CONSTANT_LONG() : READ_CONSTANT());
+      // The compiler found nothing to capture, so no upvalue can tell one
+      // evaluation's closure from another's.
+      if (function->upvalueCount == 0) {
+        if (function->closure == NULL) {
+          function->closure = newClosure(function);
+          writeBarrier(OBJ_VAL(function->closure));
+        }
+        push(OBJ_VAL(function->closure));
+        DISPATCH();
+      }
+
       ObjClosure *closure = newClosure(function);
       push(OBJ_VAL(closure));
 
       for (int i = 0; i < closure->upvalueCount; i++) {
         uint8_t isLocal = READ_BYTE();
-        uint8_t index = READ_BYTE();
+        uint32_t index = wide ? READ_LONG() : READ_BYTE();
         if (isLocal) {
-          closure->upvalues[i] = captureUpvalue(frame->slots + index);
+          closure->upvalues[i] = captureUpvalue(frame, slots + index);
         } else {
           closure->upvalues[i] = frame->closure->upvalues[index];
         }
+        // The closure is on the stack and may have been traced already by an
+        // increment run from captureUpvalue().
+        writeBarrier(OBJ_VAL(closure->upvalues[i]));
       }
-      break;
+      DISPATCH();
     }
-    case OP_CLASS: {
+    CASE(OP_CLASS): {
       push(OBJ_VAL(newClass(READ_STRING())));
-      break;
+      DISPATCH();
     }
-    case OP_METHOD: {
-      defineMethod(READ_STRING());
-      break;
+    CASE(OP_CLASS_LONG):
+      push(OBJ_VAL(newClass(READ_STRING_LONG())));
+      DISPATCH();
+    CASE(OP_METHOD_LONG):
+      name = READ_STRING_LONG();
+      goto defineMethod;
+    CASE(OP_METHOD): {
+      name = READ_STRING();
+    defineMethod:
+      // The closure stays on the stack while the tables may grow.
+      defineMethod(AS_CLASS(peek(1)), name, peek(0));
+      pop();
+      DISPATCH();
     }
-    case OP_INHERIT: {
+    CASE(OP_INHERIT): {
       Value superclass = peek(1);
       if (!(IS_CLASS(superclass))) {
+        SAVE_FRAME();
         runtimeError("Superclass must be a class.");
         return INTERPRET_RUNTIME_ERROR;
       }
       ObjClass *subclass = AS_CLASS(peek(0));
-      tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+      inheritMethods(subclass, AS_CLASS(superclass));
       pop(); // subclass
-      break;
+      DISPATCH();
     }
-    case OP_CLOSE_UPVALUE: {
-      closeUpvalues(vm.stackTop - 1);
+    CASE(OP_BUILD_LIST): {
+      int count = (int)READ_LONG();
+      ObjList *list = newList(vm->stackTop - count, count);
+      vm->stackTop -= count;
+      push(OBJ_VAL(list));
+      DISPATCH();
+    }
+    CASE(OP_BUILD_MAP):
+      buildMap((int)READ_LONG());
+      DISPATCH();
+    CASE(OP_INDEX_GET): {
+      // Reading a list at a valid index is the case loops care about.
+      if (IS_LIST(peek(1)) && IS_NUMBER(peek(0))) {
+        ObjList *list = AS_LIST(peek(1));
+        double index = AS_NUMBER(peek(0));
+        if (index >= 0 && index < list->items.count && index == (int)index) {
+          vm->stackTop[-2] = list->items.values[(int)index];
+          vm->stackTop--;
+          ENTER_JIT();
+          DISPATCH();
+        }
+      }
+      SAVE_FRAME();
+      if (!indexGet()) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    CASE(OP_INDEX_SET): {
+      if (IS_LIST(peek(2)) && IS_NUMBER(peek(1))) {
+        ObjList *list = AS_LIST(peek(2));
+        double index = AS_NUMBER(peek(1));
+        if (index >= 0 && index < list->items.count && index == (int)index) {
+          list->items.values[(int)index] = peek(0);
+          writeBarrier(peek(0));
+          vm->stackTop[-3] = peek(0);
+          vm->stackTop -= 2;
+          ENTER_JIT();
+          DISPATCH();
+        }
+      }
+      SAVE_FRAME();
+      if (!indexSet()) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    CASE(OP_FOR_ITER): {
+      Value *state = &slots[READ_LONG()];
+      uint16_t offset = READ_SHORT();
+      if (IS_LIST(state[1])) {
+        ObjList *list = AS_LIST(state[1]);
+        int position = (int)AS_NUMBER(state[2]);
+        if (position < list->items.count) {
+          state[0] = list->items.values[position];
+          state[2] = NUMBER_VAL(position + 1);
+        } else {
+          ip += offset;
+        }
+        DISPATCH();
+      }
+      SAVE_FRAME();
+      bool more;
+      if (!iterate(state, &more)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      if (!more) {
+        ip += offset;
+      }
+      DISPATCH();
+    }
+    CASE(OP_CLOSE_UPVALUE): {
+      closeUpvalues(frame, vm->stackTop - 1);
       pop();
-      break;
+      DISPATCH();
     }
-    case OP_RETURN: {
+    CASE(OP_RETURN): {
       Value result = pop();
       /*
        * Important (closures): Ideally endScope should add OP_POP or
@@ -584,36 +1509,66 @@ static InterpretResult run() {
        * callframe. Hence, we close all the openUpvalues from the starting of
        * the callframe.
        */
-      closeUpvalues(frame->slots);
+      closeUpvalues(frame, slots);
 
-      vm.frameCount--;
-      if (vm.frameCount == 0) {
+      vm->frameCount--;
+      if (vm->frameCount == 0) {
         // script (high level) function added at the top of the stack initially.
         pop();
         return INTERPRET_OK;
       }
 
-      vm.stackTop = frame->slots;
+      vm->stackTop = slots;
       push(result);
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      LOAD_FRAME();
+      ENTER_JIT();
+      DISPATCH();
     }
+#ifdef USE_COMPUTED_GOTO
+    label_UNKNOWN:
+#endif
+    default:
+      SAVE_FRAME();
+      runtimeError("Unknown opcode %d.", instruction);
+      return INTERPRET_RUNTIME_ERROR;
     }
   }
 
+#undef SAVE_FRAME
+#undef LOAD_FRAME
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_LONG
+#undef READ_CONSTANT_LONG
+#undef READ_STRING_LONG
+#undef READ_CACHE
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef NOT_BOOL_VAL
+#undef TRACE_EXECUTION
+#undef COUNT_INSTRUCTION
+#undef PROFILE_INSTRUCTION
+#undef ENTER_JIT
+#undef CASE
+#undef DISPATCH
 }
 
-InterpretResult interpret(const char *source) {
+InterpretResult interpret(VM *machine, const char *source) {
+  vm = machine;
   ObjFunction *function = compile(source);
   if (function == NULL) {
     return INTERPRET_COMPILER_ERROR;
   }
 
+  return interpretFunction(machine, function);
+}
+
+// Runs an already compiled top level function, e.g. one from a .loxc cache.
+// The function has to belong to the same VM.
+InterpretResult interpretFunction(VM *machine, ObjFunction *function) {
+  vm = machine;
   // If no compiler error, push function to stack (hence the 0th slot in
   // compiler is market with empty string), and initialize the CallFrame
   push(OBJ_VAL(function));
@@ -622,10 +1577,10 @@ InterpretResult interpret(const char *source) {
   push(OBJ_VAL(closure));
   // Sets up the window frame for the top level function
   // Replace:
-  // CallFrame *frame = &vm.frames[vm.frameCount++];
+  // CallFrame *frame = &vm->frames[vm->frameCount++];
   // frame->function = function;
   // frame->ip = function->chunk.code;
-  // frame->slots = vm.stack;
+  // frame->slots = vm->stack;
   call(closure, 0);
 
   return run();
@@ -5,31 +5,123 @@
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// The frame and value stacks start this big and double as calls need more,
+// up to the MAX limits where a call reports a stack overflow instead.
+#define FRAMES_INITIAL 64
+#define FRAMES_MAX (1 << 20)
+// Also covers what the compiler and the bytecode loader push outside any
+// call, one value per nested function at most.
+#define STACK_INITIAL (UINT8_COUNT * 4)
+#define STACK_MAX (1 << 24)
+// Room every call gets past its function's maxStack, for the values handlers
+// push to keep new objects alive while they allocate.
+#define STACK_SLACK 16
 
+/*
+ * Closures only ever capture slots of the frame that is running, so every
+ * frame keeps its own list of open upvalues, sorted from the highest slot
+ * down. Capturing only looks through the current frame's, and returning
+ * from a frame that captured nothing finds an empty list right there.
+ */
 typedef struct {
   ObjClosure *closure;
   uint8_t *ip;
   Value *slots;
+  ObjUpvalue *openUpvalues;
 } CallFrame;
 
+// Fixed-size objects live in page-aligned slabs, one per 8-byte size class
+// up to SLAB_MAX_SIZE. Larger objects go straight to the system allocator.
+#define SLAB_GRANULE 8
+#define SLAB_CLASS_COUNT 16
+#define SLAB_MAX_SIZE (SLAB_GRANULE * SLAB_CLASS_COUNT)
+#define SLAB_PAGE_SIZE (64 * 1024)
+
+typedef struct SlabPage {
+  struct SlabPage *next;
+} SlabPage;
+
+typedef struct {
+  // Freed slots, linked through their first word
+  void *freeList;
+  // Not yet handed out part of the newest page
+  char *bump;
+  char *end;
+  SlabPage *pages;
+} SlabClass;
+
+// Reported by --stats and gcStats(). Pauses are the time spent in each
+// increment of collection work, in nanoseconds.
 typedef struct {
-  CallFrame frames[FRAMES_MAX];
+  int cycles;
+  uint64_t pauseTotal;
+  uint64_t pauseMax;
+  size_t peakBytes;
+  // What the sweeps gave back, not counting memory freed along the way.
+  uint64_t bytesFreed;
+} GCStats;
+
+// The collector runs incrementally: a cycle marks a little on every
+// allocation, then sweeps a little on every allocation, then goes idle until
+// the heap has grown past nextGC again.
+typedef enum { GC_IDLE, GC_MARK, GC_SWEEP } GCPhase;
+
+typedef struct VM {
+  // Set by -O: fold literal expressions and run the peephole pass over every
+  // function this VM compiles.
+  bool optimizeCode;
+  // Set by --lazy: compile function bodies when they're first called, see
+  // deferBody() in compiler.c.
+  bool lazyCompile;
+
+  CallFrame *frames;
   int frameCount;
-  Value stack[STACK_MAX];
+  int frameCapacity;
+  // Only call() grows the stack, which moves it. Anything holding a pointer
+  // into it across a call has to reload it from its frame.
+  Value *stack;
   Value *stackTop;
-  Table globals;
+  int stackCapacity;
+  // Globals are resolved to slots at compile time. globalSlots maps a name to
+  // its index, globalNames/globalValues are indexed by it. A slot whose value
+  // is UNDEFINED_VAL has been referenced but not defined yet.
+  Table globalSlots;
+  ValueArray globalNames;
+  ValueArray globalValues;
   Table strings;
   ObjString *initString;
-  ObjUpvalue *openUpvalues;
 
   size_t bytesAllocated;
   size_t nextGC;
+  // After a cycle the next one starts once the heap has grown gcGrowFactor
+  // times bigger, but never below gcInitialHeap, which is also where the
+  // first one starts. A heap still over gcMaxHeap after a full collection
+  // ends the process, zero means no limit. Set by --gc-initial-heap,
+  // --gc-grow-factor and --gc-max-heap.
+  size_t gcInitialHeap;
+  double gcGrowFactor;
+  size_t gcMaxHeap;
   Obj *objects;
+  GCPhase gcPhase;
+  // Objects traced or swept per increment, bounds the pause of each step.
+  // Zero collects the whole heap at once.
+  int gcStepSize;
+  // Threads that trace the heap and free garbage when the atomic parts of a
+  // cycle run on a big heap. Only used in builds with CLOX_PARALLEL_GC.
+  int gcThreads;
+  // Objects still to be swept, detached from "objects" so that allocations
+  // made during the sweep are never looked at by it.
+  Obj *sweepList;
   int grayCount;
   int grayCapacity;
   Obj **grayStack;
+  // Heap size when the current cycle started, for DEBUG_LOG_GC
+  size_t cycleStartBytes;
+
+  SlabClass slabs[SLAB_CLASS_COUNT];
+  GCStats gcStats;
+  // Only counted in builds with CLOX_STATS, see run()
+  uint64_t instructionCount;
 } VM;
 
 typedef enum {
@@ -38,12 +130,28 @@ typedef enum {
   INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
+/*
+ * Embedding API. Each VM is a separate interpreter with its own heap,
+ * globals and interned strings; nothing is shared between two of them, so
+ * values must never be passed from one to another.
+ *
+ * A thread runs one VM at a time, the one in vm below. newVM(), interpret()
+ * and interpretFunction() make theirs current for the calling thread and it
+ * stays current afterwards, so push(), compile() and the rest of the
+ * internal API act on it. Different threads can run different VMs at once;
+ * the same VM must not be used from two threads at the same time.
+ */
+extern _Thread_local VM *vm;
 
-void initVM();
-void freeVM();
-InterpretResult interpret(const char *source);
+VM *newVM();
+void freeVM(VM *machine);
+InterpretResult interpret(VM *machine, const char *source);
+InterpretResult interpretFunction(VM *machine, ObjFunction *function);
 void push(Value value);
 Value pop();
+int globalSlot(ObjString *name);
+// Prints message and a stack trace and unwinds the VM. For natives, which
+// return false afterwards.
+void runtimeError(const char *format, ...);
 
 #endif